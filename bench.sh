@@ -0,0 +1,48 @@
+#!/bin/bash
+# Boots straight into the benchmark suite ( the bench feature ), qemu exits by itself once it's done
+# Results end up in bench-results.csv, and get compared against bench-baseline.csv if there is one
+# To get a baseline: ./bench.sh && cp bench-results.csv bench-baseline.csv
+BENCH_DISK=bench-disk.img
+RESULTS=bench-results.csv
+BASELINE=bench-baseline.csv
+# A copy of iso/, so the normal iso/boot/ron doesn't get replaced by the bench build
+BENCH_ISO=bench-iso
+
+if [ ! -f $BENCH_DISK ]; then
+    # A 64 mb file for the read benchmarks and a folder with 10k entries for the lookups, same contents every time
+    tmp=$(mktemp -d)
+    head -c 64M /dev/zero | tr '\0' 'R' > $tmp/large.bin
+    mkdir $tmp/dir
+    for i in $(seq 0 9999); do : > $tmp/dir/f$i; done
+    mkfs.ext2 -q -F -b 1024 -d $tmp $BENCH_DISK 128M || { rm -rf $tmp; exit 1; }
+    rm -rf $tmp
+fi
+
+cargo build --features bench || exit 1
+rm -rf $BENCH_ISO
+cp -r iso $BENCH_ISO
+rm -f $BENCH_ISO/boot/ron
+cp target/*/debug/ron $BENCH_ISO/boot
+grub-mkrescue -o out-bench.iso $BENCH_ISO/ || exit 1
+
+# isa-debug-exit turns the kernel writing 0 to port 0xf4 into qemu exiting with status 1
+timeout 600 qemu-system-x86_64 -bios /usr/share/ovmf/x64/OVMF.fd -cdrom out-bench.iso -serial stdio -display none -no-reboot \
+    -hda test-disk-1mb.img -hdb $BENCH_DISK -device isa-debug-exit,iobase=0xf4,iosize=0x04 | tr -d '\r' | tee bench.log
+status=${PIPESTATUS[0]}
+
+grep -E '^(bench|perf),' bench.log > $RESULTS
+if [ $status -ne 1 ] || ! grep -q '^bench,done' $RESULTS; then
+    echo "Benchmarks didn't finish ( qemu exited with $status ), see bench.log"
+    exit 1
+fi
+
+if [ -f $BASELINE ]; then
+    echo
+    echo "name: baseline -> now"
+    # Only the bench lines, the perf ones are there for digging into a difference
+    awk -F, 'NR == FNR { if ($1 == "bench") base[$2] = $3; next }
+        $1 == "bench" && ($2 in base) && $3 ~ /^[0-9]+$/ {
+            change = base[$2] != 0 ? sprintf("%+.1f%%", ($3 - base[$2])*100/base[$2]) : "";
+            printf "%s: %s -> %s %s %s\n", $2, base[$2], $3, $4, change
+        }' $BASELINE $RESULTS
+fi
@@ -1,6 +1,7 @@
 fn main() {
     cc::Build::new()
         .file("src/asm_init_2mb_paging_long_mode_uefi.s")
+        .file("src/asm_ap_trampoline.s")
         .compile("init_asm");
     for arg in &[
         "-ffreestanding", 
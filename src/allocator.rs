@@ -1,131 +1,359 @@
-use core::{alloc::GlobalAlloc, ptr::{self, null_mut}};
-use crate::{primitives::Mutex, UART};
+use core::{alloc::{GlobalAlloc, Layout}, ptr::null_mut, cell::UnsafeCell};
+use crate::{primitives::{Mutex, disable_interrupts, enable_interrupts}, frame_alloc::{FRAME_ALLOCATOR, FRAME_SIZE}, smp::{self, MAX_CPUS}};
 use core::fmt::Debug;
 
 
 
+pub static ALLOCATOR: Mutex<Heap> = Mutex::from(Heap::new());
+
+// Everything goes through the per cpu magazines first, only misses and big allocations lock ALLOCATOR
 #[global_allocator]
-pub static ALLOCATOR: Mutex<BasicAlloc> = Mutex::from(BasicAlloc::new());
+static MAGAZINE_ALLOCATOR: MagazineAllocator = MagazineAllocator{ cpus: [EMPTY_CPU_MAGAZINES; MAX_CPUS] };
+
+// Everything handed out is at least this big and this aligned, so a free block always has room for it's header
+const MIN_BLOCK_SIZE: usize = 16;
+// Size classes are the powers of two from MIN_BLOCK_SIZE up to this
+const MAX_SLAB_OBJECT_SIZE: usize = 2048;
+const SIZE_CLASS_COUNT: usize = 8; // 16, 32, 64, 128, 256, 512, 1024, 2048
+const SLAB_SIZE: usize = 4096;
+// When the heap runs out it grows by at least this much, so we don't go to the frame allocator for every allocation
+const MIN_HEAP_GROWTH: usize = 256*1024;
+
+/// Header of a free block in the general free list, which is sorted by address so neighbours can be merged
+struct FreeBlock{
+    size: usize,
+    next: *mut FreeBlock
+}
+
+/// A free object in a slab, objects of one size class are all in one singly linked list
+struct FreeObject{
+    next: *mut FreeObject
+}
 
-pub struct BasicAlloc{
-    base: *mut u8,
-    len: usize,
-    alloc_count: usize,
-    next: usize,
-    stashed_deallocations: [(*mut u8, core::alloc::Layout); 1024]
+/// Small allocations ( up to 2 kb ) come out of per size class slabs, so they are O(1) to allocate and free
+/// Everything else, including the slabs themselves, is best fit out of an address ordered free list which merges neighbours on free
+pub struct Heap{
+    free_list: *mut FreeBlock,
+    slabs: [*mut FreeObject; SIZE_CLASS_COUNT],
+    heap_max: usize,
+    used: usize, // What callers asked for, rounded up to what they actually got
+    slab_bytes: usize // Taken from the free list for slabs, slabs are never given back
 }
 
-impl Debug for BasicAlloc{
+impl Debug for Heap{
     fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
-        f.debug_struct("BasicAlloc").field("base", &self.base).field("len", &self.len).field("alloc_count", &self.alloc_count).field("next", &self.next).field("stashed_deallocations", &self.stashed_deallocations).finish()
+        f.debug_struct("Heap").field("free_list", &self.free_list).field("heap_max", &self.heap_max).field("used", &self.used).field("slab_bytes", &self.slab_bytes).finish()
     }
 }
-impl BasicAlloc{
+
+fn round_up(val: usize, to: usize) -> usize{
+    (val + to - 1)/to*to
+}
+
+/// Which slab a layout goes in, None if it's too big (or too aligned) for slabs
+fn size_class(layout: &Layout) -> Option<usize>{
+    let size = core::cmp::max(core::cmp::max(layout.size(), layout.align()), MIN_BLOCK_SIZE).next_power_of_two();
+    if size > MAX_SLAB_OBJECT_SIZE { return None; }
+    Some((size.trailing_zeros() - MIN_BLOCK_SIZE.trailing_zeros()) as usize)
+}
+
+fn class_size(class: usize) -> usize{
+    MIN_BLOCK_SIZE << class
+}
+
+impl Heap{
     const fn new() -> Self{
         Self{
-            base: ptr::null_mut(),
-            len: 0,
-            alloc_count: 0,
-            next: 0,
-            stashed_deallocations: [(null_mut(), core::alloc::Layout::new::<u8>()); 1024]
+            free_list: null_mut(),
+            slabs: [null_mut(); SIZE_CLASS_COUNT],
+            heap_max: 0,
+            used: 0,
+            slab_bytes: 0
         }
     }
 
     pub fn init(&mut self, base: *mut u8, len: usize) {
-        self.base = base;
-        self.len = len;
+        self.add_region(base, len);
     }
 
-    pub fn get_heap_used(&self) -> usize { self.next }
-    pub fn get_heap_max(&self) -> usize { self.len }
+    /// Gives the heap more memory to hand out
+    pub fn add_region(&mut self, base: *mut u8, len: usize) {
+        let start = round_up(base as usize, MIN_BLOCK_SIZE);
+        if start - (base as usize) >= len { return; }
+        let len = (len - (start - base as usize))/MIN_BLOCK_SIZE*MIN_BLOCK_SIZE;
+        if len < MIN_BLOCK_SIZE { return; }
+        self.heap_max += len;
+        unsafe{ self.insert_free(start as *mut u8, len); }
+    }
 
-    pub fn find_free_ind(&self) -> Option<usize> {
-        for (i, e) in self.stashed_deallocations.iter().enumerate(){
-            if e.0 == null_mut() { return Some(i); }
+    /// Takes frames from the frame allocator to fit at least an allocation of layout
+    /// NOTE: Physical memory is identity mapped, so the frames can be used as is
+    fn grow(&mut self, layout: &Layout) -> bool {
+        let needed = core::cmp::max(round_up(layout.size() + layout.align(), FRAME_SIZE), MIN_HEAP_GROWTH);
+        if let Some(addr) = FRAME_ALLOCATOR.lock().alloc_frames(needed/FRAME_SIZE) {
+            self.add_region(addr as *mut u8, needed);
+            true
+        }else{
+            false
         }
-        return None;
     }
 
-    fn try_dealloc(&mut self, ptr: *mut u8, layout: core::alloc::Layout) -> bool {
-        let mut did_dealloc = false;
-         // If we are asked to deallocate from the top of the stack we can do that :)
-         if unsafe{ ptr.add(layout.size()).sub(self.next) } == self.base{ // (ptr = alloc.base) alloc.base+alloc.size-head = base <=> alloc.base+alloc.size = base+head <=> we are asked to deallocate from the top of the stack
-            self.next -= layout.size();
-            did_dealloc = true;
+    unsafe fn alloc_layout(&mut self, layout: &Layout) -> (*mut u8, usize) {
+        match size_class(layout) {
+            Some(class) => (self.alloc_small(class), class_size(class)),
+            None => (self.alloc_general(layout.size(), layout.align()), round_up(core::cmp::max(layout.size(), MIN_BLOCK_SIZE), MIN_BLOCK_SIZE))
         }
+    }
 
-        // Or if we have deallocated all the allocations
-        if self.alloc_count == 0 { 
-            self.next = 0; 
-            for e in self.stashed_deallocations.iter_mut(){
-                *e = (null_mut(), core::alloc::Layout::new::<u8>());
+    pub fn get_heap_used(&self) -> usize { self.used }
+    pub fn get_heap_max(&self) -> usize { self.heap_max }
+
+    /// Returns (bytes in the general free list, biggest single free block in it)
+    pub fn get_free_stats(&self) -> (usize, usize) {
+        let mut total = 0;
+        let mut largest = 0;
+        let mut cur = self.free_list;
+        while !cur.is_null() {
+            unsafe{
+                total += (*cur).size;
+                largest = core::cmp::max(largest, (*cur).size);
+                cur = (*cur).next;
             }
-            did_dealloc = true; 
         }
-        // Otherwise we can't deallocate
-        did_dealloc
+        (total, largest)
     }
-}
 
+    /// How much of the free memory can't be used for one big allocation, 0% means all of it is in one block
+    pub fn get_fragmentation_percent(&self) -> f32 {
+        let (total, largest) = self.get_free_stats();
+        if total == 0 { return 0.0; }
+        (1.0 - largest as f32/total as f32) * 100.0
+    }
 
-unsafe impl GlobalAlloc for Mutex<BasicAlloc>{
-    unsafe fn alloc(&self, layout: core::alloc::Layout) -> *mut u8 {
-        let mut s = self.lock();
-        let extra = s.next % layout.align(); // align can never be 0 if it is constructed correctly
-        if extra != 0 { 
-            if let Ok(padding) = core::alloc::Layout::from_size_align(layout.align()-extra, 1){ 
-                s.next += padding.size();
-                if s.next > s.len { return null_mut(); }
-                let padding_ptr = s.base.add(s.next).add(padding.size());
-                if let Some(ind) = s.find_free_ind(){
-                    s.stashed_deallocations[ind] = (padding_ptr, padding);
-                }else{
-                    use core::fmt::Write;
-                    let _ = writeln!(UART.lock(), "Leaking memory :)");
-                    // Just leak memory idk ¯\_(ツ)_/¯
-                }
-            }else{
-                return null_mut();
+    pub fn get_slab_bytes(&self) -> usize { self.slab_bytes }
+
+    /// Puts a block back in the free list, merging it with it's neighbours if they are free too
+    unsafe fn insert_free(&mut self, addr: *mut u8, size: usize) {
+        let block = addr as *mut FreeBlock;
+        let mut prev: *mut FreeBlock = null_mut();
+        let mut next = self.free_list;
+        while !next.is_null() && (next as usize) < (block as usize) {
+            prev = next;
+            next = (*next).next;
+        }
+
+        (*block).size = size;
+        (*block).next = next;
+        if !next.is_null() && block as usize + size == next as usize {
+            (*block).size += (*next).size;
+            (*block).next = (*next).next;
+        }
+
+        if prev.is_null() {
+            self.free_list = block;
+        } else if prev as usize + (*prev).size == block as usize {
+            (*prev).size += (*block).size;
+            (*prev).next = (*block).next;
+        } else {
+            (*prev).next = block;
+        }
+    }
+
+    unsafe fn alloc_general(&mut self, size: usize, align: usize) -> *mut u8 {
+        let size = round_up(core::cmp::max(size, MIN_BLOCK_SIZE), MIN_BLOCK_SIZE);
+        let align = core::cmp::max(align, MIN_BLOCK_SIZE);
+
+        // Best fit, the smallest block that can hold the allocation once it's aligned
+        let mut best: *mut FreeBlock = null_mut();
+        let mut best_prev: *mut FreeBlock = null_mut();
+        let mut prev: *mut FreeBlock = null_mut();
+        let mut cur = self.free_list;
+        while !cur.is_null() {
+            let front_padding = round_up(cur as usize, align) - cur as usize;
+            if front_padding + size <= (*cur).size && (best.is_null() || (*cur).size < (*best).size) {
+                best = cur;
+                best_prev = prev;
+                if (*cur).size == size && front_padding == 0 { break; } // Can't do better than exact
             }
+            prev = cur;
+            cur = (*cur).next;
         }
-        s.next += layout.size();
-        if s.next >= s.len { return null_mut(); } // OOM :^(
-        s.alloc_count += 1;
-        let ret_ptr = s.base.add(s.next).sub(layout.size());    
-        ret_ptr
+        if best.is_null() { return null_mut(); } // OOM :^(
+
+        // Take the block out, then give back whatever is in front of and after the allocation
+        // NOTE: Everything is a multiple of MIN_BLOCK_SIZE, so the leftovers are either empty or big enough to be free blocks
+        let block_addr = best as usize;
+        let block_size = (*best).size;
+        if best_prev.is_null() { self.free_list = (*best).next; } else { (*best_prev).next = (*best).next; }
+        let alloc_addr = round_up(block_addr, align);
+        let front_padding = alloc_addr - block_addr;
+        let tail = block_size - front_padding - size;
+        if front_padding != 0 { self.insert_free(block_addr as *mut u8, front_padding); }
+        if tail != 0 { self.insert_free((alloc_addr + size) as *mut u8, tail); }
+        alloc_addr as *mut u8
     }
 
-    unsafe fn dealloc(&self, ptr: *mut u8, layout: core::alloc::Layout) {
-        let mut s = self.lock();
-        s.alloc_count -= 1; // Keeps track if we have gotten the same amount of deallocations as allocations,
-                            // so we can reset everything that we leaked in that case
-
-        let did_dealloc = s.try_dealloc(ptr, layout);
-        
-        if !did_dealloc{
-            // Store failed deallocation in some free spot in array
-            if let Some(i) = s.find_free_ind(){
-                s.stashed_deallocations[i] = (ptr, layout);
-            }else{
-                use core::fmt::Write;
-                let _ = writeln!(UART.lock(), "Leaking memory :)");
-                // Just leak memory idk ¯\_(ツ)_/¯
+    unsafe fn dealloc_general(&mut self, ptr: *mut u8, size: usize) {
+        let size = round_up(core::cmp::max(size, MIN_BLOCK_SIZE), MIN_BLOCK_SIZE);
+        self.insert_free(ptr, size);
+    }
+
+    unsafe fn alloc_small(&mut self, class: usize) -> *mut u8 {
+        if self.slabs[class].is_null() {
+            // Carve a new slab into objects
+            let slab = self.alloc_general(SLAB_SIZE, SLAB_SIZE);
+            if slab.is_null() { return null_mut(); }
+            self.slab_bytes += SLAB_SIZE;
+            let object_size = class_size(class);
+            for i in (0..SLAB_SIZE/object_size).rev() {
+                let object = slab.add(i*object_size) as *mut FreeObject;
+                (*object).next = self.slabs[class];
+                self.slabs[class] = object;
             }
-        }else{ // Maybe the deallocation we just did allows us to deallocate even more
-            // NOTE: sort_by allocates, so don't use it
-            // Sort array by allocations that are closest to the top of the stack ( a.k.a ascending order, lowest addresses first )
-            s.stashed_deallocations.sort_unstable_by(|alloc1, alloc2|alloc2.0.cmp(&alloc1.0) );
-            
-            for i in 0..s.stashed_deallocations.len(){
-                let stashed_dealloc = s.stashed_deallocations[i];
-                if stashed_dealloc.0 == null_mut() { break; } // If the failed allocation with the lowest address is null, then obv. all other allocations are null as well (a.k.a there are no more allocations to consider)
-                if s.try_dealloc(stashed_dealloc.0, stashed_dealloc.1) {
-                    s.stashed_deallocations[i] = (null_mut(), core::alloc::Layout::new::<u8>());
-                }else{
-                    // If we can't deallocate the allocation with the lowest address, there is no point in trying the others because they will be above it
-                     break; 
-                }
+        }
+        let object = self.slabs[class];
+        self.slabs[class] = (*object).next;
+        object as *mut u8
+    }
+
+    unsafe fn dealloc_small(&mut self, ptr: *mut u8, class: usize) {
+        let object = ptr as *mut FreeObject;
+        (*object).next = self.slabs[class];
+        self.slabs[class] = object;
+    }
+
+    /// Fills objs with objects of a size class, growing the heap if needed, returns how many it got
+    unsafe fn alloc_small_batch(&mut self, class: usize, objs: &mut [*mut u8]) -> usize {
+        let layout = Layout::from_size_align_unchecked(class_size(class), class_size(class));
+        for (i, obj) in objs.iter_mut().enumerate() {
+            let mut ptr = self.alloc_small(class);
+            if ptr.is_null() && self.grow(&layout) { ptr = self.alloc_small(class); }
+            if ptr.is_null() { return i; }
+            *obj = ptr;
+            self.used += class_size(class);
+        }
+        objs.len()
+    }
+
+    unsafe fn dealloc_small_batch(&mut self, class: usize, objs: &[*mut u8]) {
+        for obj in objs {
+            self.dealloc_small(*obj, class);
+            self.used -= class_size(class);
+        }
+    }
+}
+
+// Objects per magazine, refills and flushes move half of that at a time so a cpu going back and forth around a boundary doesn't hit the lock every time
+const MAGAZINE_SIZE: usize = 32;
+
+struct Magazine {
+    objs: [*mut u8; MAGAZINE_SIZE],
+    count: usize
+}
+
+struct CpuMagazines {
+    magazines: UnsafeCell<[Magazine; SIZE_CLASS_COUNT]>,
+    stats: UnsafeCell<MagazineStats>
+}
+
+#[derive(Clone, Copy, Default, Debug)]
+pub struct MagazineStats {
+    pub hits: usize,
+    pub misses: usize,
+    pub lock_acquisitions: usize, // Of ALLOCATOR, through the magazine layer
+    pub cached_bytes: usize // Free objects sitting in magazines
+}
+
+const EMPTY_MAGAZINE: Magazine = Magazine{ objs: [null_mut(); MAGAZINE_SIZE], count: 0 };
+const EMPTY_CPU_MAGAZINES: CpuMagazines = CpuMagazines{ magazines: UnsafeCell::new([EMPTY_MAGAZINE; SIZE_CLASS_COUNT]), stats: UnsafeCell::new(MagazineStats{ hits: 0, misses: 0, lock_acquisitions: 0, cached_bytes: 0 }) };
+
+/// Per cpu caches of free small objects in front of the global heap
+/// NOTE: A cpu only ever touches it's own magazines, with interrupts off so a handler that allocates can't get in the middle, so no locks needed
+struct MagazineAllocator {
+    cpus: [CpuMagazines; MAX_CPUS]
+}
+
+unsafe impl Sync for MagazineAllocator {}
+
+impl MagazineAllocator {
+    /// Runs f on this cpu's magazine for class and it's stats, with interrupts off
+    unsafe fn with_magazine<R>(&self, class: usize, f: impl FnOnce(&mut Magazine, &mut MagazineStats) -> R) -> R {
+        let were_enabled = disable_interrupts();
+        let cpu = &self.cpus[smp::cpu_id()];
+        let res = f(&mut (*cpu.magazines.get())[class], &mut *cpu.stats.get());
+        if were_enabled { enable_interrupts(); }
+        res
+    }
+}
+
+/// Sums up the magazine stats of every cpu
+pub fn get_magazine_stats() -> MagazineStats {
+    let mut total = MagazineStats::default();
+    for cpu in MAGAZINE_ALLOCATOR.cpus.iter() {
+        // NOTE: Other cpus might be updating theirs, so this is only roughly right, good enough for stats
+        let stats = unsafe { *cpu.stats.get() };
+        total.hits += stats.hits;
+        total.misses += stats.misses;
+        total.lock_acquisitions += stats.lock_acquisitions;
+        total.cached_bytes += stats.cached_bytes;
+    }
+    total
+}
+
+unsafe impl GlobalAlloc for MagazineAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        trace_span!(Alloc, layout.size());
+        let class = if let Some(class) = size_class(&layout) { class } else { return ALLOCATOR.alloc(layout); };
+        self.with_magazine(class, |mag, stats| {
+            if mag.count == 0 {
+                stats.misses += 1;
+                stats.lock_acquisitions += 1;
+                mag.count = ALLOCATOR.lock().alloc_small_batch(class, &mut mag.objs[..MAGAZINE_SIZE/2]);
+                stats.cached_bytes += mag.count*class_size(class);
+                if mag.count == 0 { return null_mut(); }
+            } else {
+                stats.hits += 1;
+            }
+            mag.count -= 1;
+            stats.cached_bytes -= class_size(class);
+            mag.objs[mag.count]
+        })
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        trace_span!(Dealloc, layout.size());
+        let class = if let Some(class) = size_class(&layout) { class } else { return ALLOCATOR.dealloc(ptr, layout); };
+        self.with_magazine(class, |mag, stats| {
+            if mag.count == MAGAZINE_SIZE {
+                // Give the older half back
+                stats.lock_acquisitions += 1;
+                ALLOCATOR.lock().dealloc_small_batch(class, &mag.objs[..MAGAZINE_SIZE/2]);
+                mag.objs.copy_within(MAGAZINE_SIZE/2.., 0);
+                mag.count -= MAGAZINE_SIZE/2;
+                stats.cached_bytes -= MAGAZINE_SIZE/2*class_size(class);
             }
+            mag.objs[mag.count] = ptr;
+            mag.count += 1;
+            stats.cached_bytes += class_size(class);
+        })
+    }
+}
+
+
+unsafe impl GlobalAlloc for Mutex<Heap>{
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        let mut s = self.lock();
+        let (mut ptr, size) = s.alloc_layout(&layout);
+        if ptr.is_null() && s.grow(&layout) { ptr = s.alloc_layout(&layout).0; }
+        if !ptr.is_null() { s.used += size; }
+        ptr
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        let mut s = self.lock();
+        match size_class(&layout) {
+            Some(class) => { s.dealloc_small(ptr, class); s.used -= class_size(class); },
+            None => { s.dealloc_general(ptr, layout.size()); s.used -= round_up(core::cmp::max(layout.size(), MIN_BLOCK_SIZE), MIN_BLOCK_SIZE); }
         }
     }
-}
\ No newline at end of file
+}
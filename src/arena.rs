@@ -0,0 +1,139 @@
+use core::{alloc::{Allocator, AllocError, Layout}, cell::Cell, fmt::{Display, Write}, ops::Deref, ptr::{self, NonNull}};
+
+use alloc::{alloc::Global, vec::Vec};
+
+pub type ArenaVec<'a, T> = Vec<T, &'a Arena>;
+
+/// Bump allocator for things that all die at the same time ( say everything one shell command allocates )
+/// Freeing is a no-op, reset() throws everything away at once
+/// NOTE: When it's full allocations just go to the normal heap instead of failing, those get freed like normal
+pub struct Arena {
+    base: NonNull<u8>,
+    capacity: usize,
+    offset: Cell<usize>,
+    last: Cell<usize>, // Start of the last allocation, so that one can be grown in place
+    overflows: Cell<usize>
+}
+
+const ARENA_ALIGN: usize = 16;
+
+impl Arena {
+    pub fn new(capacity: usize) -> Self {
+        let layout = Layout::from_size_align(capacity, ARENA_ALIGN).expect("Arena capacity should be a valid layout!");
+        let base = Global.allocate(layout).expect("Should be able to allocate arena!").cast::<u8>();
+        Self { base, capacity, offset: Cell::new(0), last: Cell::new(0), overflows: Cell::new(0) }
+    }
+
+    /// Frees everything allocated from the arena, in O(1)
+    /// NOTE: Taking &mut self means nothing allocated from it can still be alive
+    pub fn reset(&mut self) {
+        self.offset.set(0);
+        self.last.set(0);
+    }
+
+    pub fn get_used(&self) -> usize { self.offset.get() }
+    pub fn get_capacity(&self) -> usize { self.capacity }
+    /// How many allocations didn't fit and went to the heap
+    pub fn get_overflows(&self) -> usize { self.overflows.get() }
+
+    fn contains(&self, ptr: NonNull<u8>) -> bool {
+        let addr = ptr.as_ptr() as usize;
+        addr >= self.base.as_ptr() as usize && addr < self.base.as_ptr() as usize + self.capacity
+    }
+
+    fn bump(&self, layout: Layout) -> Option<NonNull<[u8]>> {
+        let base = self.base.as_ptr() as usize;
+        let start = (base + self.offset.get() + layout.align() - 1) & !(layout.align() - 1);
+        let end = start.checked_add(layout.size())?;
+        if end > base + self.capacity { return None; }
+        self.last.set(start - base);
+        self.offset.set(end - base);
+        NonNull::new(ptr::slice_from_raw_parts_mut(start as *mut u8, layout.size()))
+    }
+}
+
+impl Drop for Arena {
+    fn drop(&mut self) {
+        unsafe { Global.deallocate(self.base, Layout::from_size_align_unchecked(self.capacity, ARENA_ALIGN)); }
+    }
+}
+
+unsafe impl Allocator for Arena {
+    fn allocate(&self, layout: Layout) -> Result<NonNull<[u8]>, AllocError> {
+        if let Some(mem) = self.bump(layout) { return Ok(mem); }
+        self.overflows.set(self.overflows.get() + 1);
+        Global.allocate(layout)
+    }
+
+    unsafe fn deallocate(&self, ptr: NonNull<u8>, layout: Layout) {
+        if !self.contains(ptr) { return Global.deallocate(ptr, layout); }
+        // The last allocation can be given back, that's what a short lived Vec usually is
+        if ptr.as_ptr() as usize - self.base.as_ptr() as usize == self.last.get() {
+            self.offset.set(self.last.get());
+        }
+    }
+
+    unsafe fn grow(&self, ptr: NonNull<u8>, old_layout: Layout, new_layout: Layout) -> Result<NonNull<[u8]>, AllocError> {
+        // A Vec that's being pushed to is usually the last thing allocated, so it can just get longer
+        if self.contains(ptr) {
+            let offset = ptr.as_ptr() as usize - self.base.as_ptr() as usize;
+            if offset == self.last.get() && ptr.as_ptr() as usize % new_layout.align() == 0 && offset + new_layout.size() <= self.capacity {
+                self.offset.set(offset + new_layout.size());
+                return Ok(NonNull::new_unchecked(ptr::slice_from_raw_parts_mut(ptr.as_ptr(), new_layout.size())));
+            }
+        }
+        let new = self.allocate(new_layout)?;
+        ptr::copy_nonoverlapping(ptr.as_ptr(), new.as_ptr() as *mut u8, old_layout.size());
+        self.deallocate(ptr, old_layout);
+        Ok(new)
+    }
+}
+
+/// String in an arena, alloc's String can't take an allocator
+pub struct ArenaString<'a> {
+    bytes: ArenaVec<'a, u8>
+}
+
+impl<'a> ArenaString<'a> {
+    pub fn new_in(arena: &'a Arena) -> Self {
+        Self { bytes: Vec::new_in(arena) }
+    }
+
+    pub fn from_str_in(s: &str, arena: &'a Arena) -> Self {
+        let mut res = Self { bytes: Vec::with_capacity_in(s.len(), arena) };
+        res.push_str(s);
+        res
+    }
+
+    pub fn push_str(&mut self, s: &str) {
+        self.bytes.extend_from_slice(s.as_bytes());
+    }
+
+    pub fn push(&mut self, c: char) {
+        self.push_str(c.encode_utf8(&mut [0; 4]));
+    }
+
+    pub fn as_str(&self) -> &str {
+        // NOTE: Only ever gets whole strs pushed to it
+        unsafe { core::str::from_utf8_unchecked(&self.bytes) }
+    }
+}
+
+impl<'a> Deref for ArenaString<'a> {
+    type Target = str;
+
+    fn deref(&self) -> &str { self.as_str() }
+}
+
+impl<'a> Display for ArenaString<'a> {
+    fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
+        write!(f, "{}", self.as_str())
+    }
+}
+
+impl<'a> Write for ArenaString<'a> {
+    fn write_str(&mut self, s: &str) -> core::fmt::Result {
+        self.push_str(s);
+        Ok(())
+    }
+}
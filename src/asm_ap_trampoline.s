@@ -0,0 +1,124 @@
+.intel_syntax noprefix
+
+# Application processors start here in real mode after the startup ipi, at TRAMPOLINE_BASE ( smp.rs copies this there )
+# From there it's the usual real mode -> protected mode -> long mode dance, using the bsp's paging setup
+# NOTE: Everything is addressed relative to where the copy ends up, not to where the linker put it
+TRAMPOLINE_BASE = 0x8000
+
+.section .text
+.global ap_trampoline_start
+.global ap_trampoline_end
+.global ap_tramp_cr3
+.global ap_tramp_cr4
+.global ap_tramp_cr0
+.global ap_tramp_efer
+.global ap_tramp_entry
+.global ap_tramp_stack_base
+.global ap_tramp_stack_size
+.global ap_tramp_next_id
+.global ap_tramp_max_cpus
+
+.code16
+ap_trampoline_start:
+	cli
+	cld
+	xor ax, ax
+	mov ds, ax
+	lgdt [TRAMP_GDT_PTR]
+	mov eax, cr0
+	or eax, 1 # Protected mode
+	mov cr0, eax
+	# Far jump to the 32-bit code segment, written out because the assembler wants to do it relative to the link address
+	.byte 0x66, 0xEA
+	.long TRAMP_32
+	.word 0x08
+
+.code32
+ap_tramp_32:
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+
+	# Same control registers as the bsp, cr4 first as it has PAE
+	mov eax, [TRAMP_CR4]
+	mov cr4, eax
+	mov eax, [TRAMP_CR3]
+	mov cr3, eax
+	mov ecx, 0xC0000080 # EFER, for long mode enable
+	mov eax, [TRAMP_EFER]
+	xor edx, edx
+	wrmsr
+	mov eax, [TRAMP_CR0] # Turns paging on, and with it long mode
+	mov cr0, eax
+
+	.byte 0xEA
+	.long TRAMP_64
+	.word 0x18
+
+.code64
+ap_tramp_64:
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+
+	# Every ap takes an id, they might all be running this at the same time
+	mov rbx, OFFSET TRAMP_NEXT_ID
+	mov rdi, 1
+	lock xadd [rbx], rdi
+	mov rbx, OFFSET TRAMP_MAX_CPUS
+	cmp rdi, [rbx]
+	jae ap_tramp_park
+
+	# Stack for ap n is [stack_base + (n-1)*stack_size, stack_base + n*stack_size)
+	mov rbx, OFFSET TRAMP_STACK_SIZE
+	mov rax, rdi
+	imul rax, [rbx]
+	mov rbx, OFFSET TRAMP_STACK_BASE
+	add rax, [rbx]
+	mov rsp, rax
+
+	# ap_main(cpu_id), it never returns
+	mov rbx, OFFSET TRAMP_ENTRY
+	mov rax, [rbx]
+	call rax
+
+ap_tramp_park:
+	cli
+	hlt
+	jmp ap_tramp_park
+
+.balign 8
+ap_tramp_cr3: .quad 0
+ap_tramp_cr4: .quad 0
+ap_tramp_cr0: .quad 0
+ap_tramp_efer: .quad 0
+ap_tramp_entry: .quad 0
+ap_tramp_stack_base: .quad 0
+ap_tramp_stack_size: .quad 0
+ap_tramp_next_id: .quad 1
+ap_tramp_max_cpus: .quad 0
+
+ap_tramp_gdt:
+	.quad 0
+	.quad 0x00CF9A000000FFFF # 32-bit code
+	.quad 0x00CF92000000FFFF # data
+	.quad 0x00AF9A000000FFFF # 64-bit code
+ap_tramp_gdt_ptr:
+	.word 4*8-1
+	.long TRAMPOLINE_BASE + (ap_tramp_gdt - ap_trampoline_start)
+ap_trampoline_end:
+
+TRAMP_32 = TRAMPOLINE_BASE + (ap_tramp_32 - ap_trampoline_start)
+TRAMP_64 = TRAMPOLINE_BASE + (ap_tramp_64 - ap_trampoline_start)
+TRAMP_GDT_PTR = TRAMPOLINE_BASE + (ap_tramp_gdt_ptr - ap_trampoline_start)
+TRAMP_CR3 = TRAMPOLINE_BASE + (ap_tramp_cr3 - ap_trampoline_start)
+TRAMP_CR4 = TRAMPOLINE_BASE + (ap_tramp_cr4 - ap_trampoline_start)
+TRAMP_CR0 = TRAMPOLINE_BASE + (ap_tramp_cr0 - ap_trampoline_start)
+TRAMP_EFER = TRAMPOLINE_BASE + (ap_tramp_efer - ap_trampoline_start)
+TRAMP_ENTRY = TRAMPOLINE_BASE + (ap_tramp_entry - ap_trampoline_start)
+TRAMP_STACK_BASE = TRAMPOLINE_BASE + (ap_tramp_stack_base - ap_trampoline_start)
+TRAMP_STACK_SIZE = TRAMPOLINE_BASE + (ap_tramp_stack_size - ap_trampoline_start)
+TRAMP_NEXT_ID = TRAMPOLINE_BASE + (ap_tramp_next_id - ap_trampoline_start)
+TRAMP_MAX_CPUS = TRAMPOLINE_BASE + (ap_tramp_max_cpus - ap_trampoline_start)
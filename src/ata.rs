@@ -1,9 +1,9 @@
-use core::{mem, cell::RefCell};
-use alloc::{rc::Rc, vec::Vec};
+use core::{mem, cell::RefCell, alloc::Layout, sync::atomic::{compiler_fence, Ordering}};
+use alloc::{rc::Rc, boxed::Box};
 
-use crate::{virtmem::KernPointer, vfs::IFile};
+use crate::{virtmem::KernPointer, vfs::{IFile, IOError}, pci, interrupts::{self, InterruptStackFrame}};
 
-struct IORegistersLBA28 {
+struct IORegisters {
     pub data: KernPointer<u16>,
     err_features: KernPointer<u8>,
     pub sector_count: KernPointer<u8>,
@@ -14,9 +14,9 @@ struct IORegistersLBA28 {
     stat_command: KernPointer<u8>
 }
 
-impl IORegistersLBA28{
+impl IORegisters{
     unsafe fn new(base: KernPointer<u8>) -> Self{
-        IORegistersLBA28{
+        IORegisters{
             data: mem::transmute::<KernPointer<u8>, _>(base),
             err_features: base.offset(1),
             sector_count: base.offset(2),
@@ -45,16 +45,14 @@ impl IORegistersLBA28{
     }
 }
 
-struct ControlRegistersLBA28 {
-    alt_stat_device_ctrl: KernPointer<u8>,
-    drive_addr: KernPointer<u8>
+struct ControlRegisters {
+    alt_stat_device_ctrl: KernPointer<u8>
 }
 
-impl ControlRegistersLBA28 {
+impl ControlRegisters {
     unsafe fn new(base: KernPointer<u8>) -> Self{
-        ControlRegistersLBA28{
-            alt_stat_device_ctrl: base,
-            drive_addr: base.offset(1)
+        ControlRegisters{
+            alt_stat_device_ctrl: base
         }
     }
 
@@ -65,13 +63,15 @@ impl ControlRegistersLBA28 {
     unsafe fn write_device_ctrl(&mut self, d: u8){
         self.alt_stat_device_ctrl.write(d)
     }
-
-    unsafe fn read_drive_addr(&self) -> u8{
-        self.drive_addr.read()
-    }
 }
 
 pub const SECTOR_SIZE_IN_BYTES: usize = 256*core::mem::size_of::<u16>();
+// The sector count register is 8 bits wide for LBA28 commands, with 0 meaning 256,
+// and is written twice for 16 bits worth of sectors for LBA48 commands, with 0 meaning 65536
+pub const MAX_SECTORS_PER_LBA28_COMMAND: usize = 256;
+pub const MAX_SECTORS_PER_LBA48_COMMAND: usize = 65536;
+// First sector which can't be addressed by LBA28
+const LBA28_LIMIT: u64 = 1 << 28;
 type Sector = [u16; SECTOR_SIZE_IN_BYTES/core::mem::size_of::<u16>()];
 
 #[derive(Clone, Copy)]
@@ -89,37 +89,98 @@ impl BUSType{
     }
 }
 
-pub struct ATABus{
-    io: IORegistersLBA28,
-    control: ControlRegistersLBA28,
-    master_sector_count: Option<u32>,
-    slave_sector_count: Option<u32>,
-    bus_type: BUSType
+// A physical region descriptor, tells the bus master controller where in memory to transfer to/from
+// Source: https://wiki.osdev.org/ATA/ATAPI_using_DMA
+#[repr(C, align(8))] // Aligned to it's size so it can never cross a 64kb boundary
+struct PhysicalRegionDescriptor{
+    phys_addr: u32,
+    byte_count: u16, // 0 means 64kb
+    flags: u16 // Bit 15 marks the last entry in the table
 }
 
-#[derive(Clone, Copy)]
+// A single region can't be bigger than 64kb or cross a 64kb boundary, so the bounce buffer is exactly that and aligned to that
+const DMA_BUFFER_SIZE_IN_BYTES: usize = 64*1024;
+const MAX_SECTORS_PER_DMA_TRANSFER: usize = DMA_BUFFER_SIZE_IN_BYTES/SECTOR_SIZE_IN_BYTES;
+
+#[repr(C, align(65536))]
+struct DMABuffer([u8; DMA_BUFFER_SIZE_IN_BYTES]);
 
-pub struct LBA28{
-    pub low: u8,
-    pub mid: u8,
-    pub hi: u8
+/// The bus master IDE registers of one channel of a pci ide controller
+pub struct BusMasterDMA{
+    command: KernPointer<u8>,
+    status: KernPointer<u8>,
+    prdt_addr: KernPointer<u32>,
+    prdt: Box<PhysicalRegionDescriptor>,
+    buffer: Box<DMABuffer>
 }
 
-impl From<u32> for LBA28{
-    fn from(v: u32) -> Self {
-        LBA28{
-            low: ((v >> 0) & 0xff) as u8,
-            mid: ((v >> 8) & 0xff) as u8,
-            hi: ((v >> 16) & 0xff) as u8
-        }
+impl BusMasterDMA{
+    unsafe fn new(port: u16) -> Option<Self>{
+        // NOTE: Box::new would build the 64kb buffer on the stack first, so allocate it directly
+        let buffer_ptr = alloc::alloc::alloc_zeroed(Layout::new::<DMABuffer>()) as *mut DMABuffer;
+        if buffer_ptr.is_null() { return None; }
+        let buffer = Box::from_raw(buffer_ptr);
+        let prdt = Box::new(PhysicalRegionDescriptor{phys_addr: 0, byte_count: 0, flags: 0});
+
+        // NOTE: The controller only understands 32-bit physical addresses, and we assume kernel memory is identity mapped
+        let prdt_end = &*prdt as *const PhysicalRegionDescriptor as usize + mem::size_of::<PhysicalRegionDescriptor>();
+        let buffer_end = buffer_ptr as usize + DMA_BUFFER_SIZE_IN_BYTES;
+        if prdt_end > u32::MAX as usize || buffer_end > u32::MAX as usize { return None; }
+
+        Some(Self{
+            command: KernPointer::<u8>::from_port(port),
+            status: KernPointer::<u8>::from_port(port + 2),
+            prdt_addr: KernPointer::<u32>::from_port(port + 4),
+            prdt,
+            buffer
+        })
     }
-}
 
-impl Into<u32> for LBA28{
-    fn into(self) -> u32 {
-        ((self.low as u32) << 0) | ((self.mid as u32) << 8) | ((self.hi as u32) << 24)
+    /// Transfers byte_count bytes between the drive and the bounce buffer, the ata registers must already be set up for the command
+    /// Returns false if either the drive or the controller reported an error
+    unsafe fn transfer(&mut self, io: &mut IORegisters, command: u8, to_memory: bool, byte_count: usize) -> bool {
+        assert!(byte_count <= DMA_BUFFER_SIZE_IN_BYTES);
+        self.prdt.phys_addr = self.buffer.0.as_ptr() as u32;
+        self.prdt.byte_count = (byte_count & 0xFFFF) as u16; // 64kb wraps around to 0, which is how the controller expects it
+        self.prdt.flags = 1 << 15; // Only entry
+        self.prdt_addr.write(&*self.prdt as *const PhysicalRegionDescriptor as u32);
+
+        self.command.write(if to_memory { 1 << 3 } else { 0 }); // Set direction, with the engine stopped
+        self.status.write(self.status.read() | 0b110); // Clear interrupt and error bits, they are cleared by writing 1's
+        // The port writes don't tell the compiler they touch memory, but the controller is about to read the prdt and maybe the buffer
+        compiler_fence(Ordering::SeqCst);
+        io.write_command(command);
+        self.command.write(self.command.read() | 1); // Start
+
+        // Sleep until the drive's irq, the bus master status still says whether that was us finishing or an error
+        // FIXME: IFile is synchronous so this still blocks the calling task, just without burning the cpu
+        interrupts::wait_until(|| if self.status.read() & 0b110 != 0 { Some(()) } else { None }); // Interrupt or error
+        self.command.write(self.command.read() & !1); // Stop
+        wait_for!(io.read_status() & (1 << 7) == 0); // BSY clears
+        compiler_fence(Ordering::SeqCst);
+
+        let bm_status = self.status.read();
+        self.status.write(bm_status | 0b110);
+        let ata_status = io.read_status(); // Reading the status register also acknowledges the drive's interrupt
+        bm_status & 0b010 == 0 && ata_status & (1 << 0) == 0
     }
 }
+
+// What we learned about a drive from identify
+#[derive(Clone, Copy)]
+struct DeviceInfo{
+    sector_count: u64,
+    lba48: bool,
+    dma: bool
+}
+
+pub struct ATABus{
+    io: IORegisters,
+    control: ControlRegisters,
+    bus_type: BUSType,
+    dma: Option<BusMasterDMA>,
+    devices: [Option<DeviceInfo>; 2] // Indexed by ATADevice, filled in by identify
+}
 impl ATADevice{
     pub fn into_str(self) -> &'static str{
         match self{
@@ -127,13 +188,24 @@ impl ATADevice{
             ATADevice::SLAVE => "slave"
         }    
     }
+
+    fn index(self) -> usize{
+        match self{
+            ATADevice::MASTER => 0,
+            ATADevice::SLAVE => 1
+        }
+    }
 }
 
 #[allow(unused)]
 mod ata_command{
     pub const NOP: u8 = 0x00;
     pub const READ_SECTORS: u8 = 0x20;
+    pub const READ_SECTORS_EXT: u8 = 0x24;
+    pub const READ_DMA_EXT: u8 = 0x25;
     pub const WRITE_SECTORS: u8 = 0x30;
+    pub const WRITE_SECTORS_EXT: u8 = 0x34;
+    pub const WRITE_DMA_EXT: u8 = 0x35;
     pub const READ_DMA: u8 = 0xC8;
     pub const WRITE_DMA: u8 = 0xCA;
     pub const STANDBY_IMMEDIATE: u8 = 0xE0;
@@ -143,11 +215,18 @@ mod ata_command{
     pub const READ_BUFFER: u8 = 0xE4;
     pub const CHECK_POWER_MODE: u8 = 0xE5;
     pub const SLEEP: u8 = 0xE6;
+    pub const CACHE_FLUSH: u8 = 0xE7;
     pub const WRITE_BUFFER: u8 = 0xE8;
     pub const IDENTIYFY_DEVICE: u8 = 0xEC;
     pub const SET_FEATURES: u8 = 0xEF;
 }
 
+/// Handler for the primary bus's irq 14, the secondary bus's irq 15 is taken care of by the spurious irq 15 handler
+/// NOTE: All it has to do is to wake the cpu up, whoever is waiting checks the status registers themselves
+pub extern "x86-interrupt" fn primary_irq_handler(_frame: InterruptStackFrame) {
+    interrupts::end_of_interrupt(interrupts::PRIMARY_ATA_IRQ);
+}
+
 impl ATABus{
     pub unsafe fn primary_x86() -> Option<Self> {
         ATABus::new(KernPointer::<u8>::from_port(0x1F0), KernPointer::<u8>::from_port(0x3F6), BUSType::Primary)
@@ -158,45 +237,54 @@ impl ATABus{
     }
 
     unsafe fn new(io_base: KernPointer<u8>, cntrl_base: KernPointer<u8>, typ: BUSType) -> Option<Self>{
-        let bus = ATABus{
-            io: IORegistersLBA28::new(io_base),
-            control: ControlRegistersLBA28::new(cntrl_base),
-            master_sector_count: None,
-            slave_sector_count: None,
-            bus_type: typ
+        let mut bus = ATABus{
+            io: IORegisters::new(io_base),
+            control: ControlRegisters::new(cntrl_base),
+            bus_type: typ,
+            dma: None,
+            devices: [None; 2]
         };
         // IO bus has pull-up resitors so 0xFF, which is normally an invalid value anyway, probs indicates no drives on the bus
         if bus.io.read_status() == 0xFF {
             None
         }else{
+            bus.control.write_device_ctrl(0); // Clear nIEN, so the drives raise their irq
+
+            bus.dma = Self::find_bus_master(typ);
             Some(bus)
         }
     }
+
+    /// Looks for a pci ide controller which can do bus mastering for this bus, if there is none we just stick to PIO
+    unsafe fn find_bus_master(typ: BUSType) -> Option<BusMasterDMA> {
+        let controller = pci::find_by_class(pci::CLASS_MASS_STORAGE, pci::SUBCLASS_IDE)?;
+        let (_, _, prog_if) = controller.class();
+        if prog_if & (1 << 7) == 0 { return None; } // Not bus master capable
+        // If the channel is in native pci mode it's registers aren't at the legacy ports we are using, so this controller isn't driving our bus
+        let native_mode_bit = match typ { BUSType::Primary => 1 << 0, BUSType::Secondary => 1 << 2 };
+        if prog_if & native_mode_bit != 0 { return None; }
+
+        let bar4 = controller.bar(4);
+        if bar4 & 1 == 0 { return None; } // We only know how to reach the bus master registers through ports
+        controller.enable_bus_mastering();
+        let channel_offset = match typ { BUSType::Primary => 0, BUSType::Secondary => 8 };
+        BusMasterDMA::new((bar4 & 0xFFFC) as u16 + channel_offset)
+    }
+
+    pub fn has_dma(&self) -> bool { self.dma.is_some() }
+
+    /// "primary" or "secondary"
+    pub fn name(&self) -> &'static str { self.bus_type.into_str() }
      
-    pub unsafe fn get_sector_count(&mut self, device: ATADevice) -> Option<u32>{
-        match device{
-            ATADevice::MASTER => {
-                if let Some(sector_count) = self.master_sector_count{
-                    return Some(sector_count);
-                }else if let Some(id) = self.identify(device){
-                    self.master_sector_count = Some(
-                        ((id[61] as u32) << 16) | (id[60] as u32)
-                    );
-                    return self.master_sector_count;
-                }
-            },
-            ATADevice::SLAVE => {
-                if let Some(sector_count) = self.slave_sector_count{
-                    return Some(sector_count);
-                }else if let Some(id) = self.identify(device){
-                    self.slave_sector_count = Some(
-                        ((id[61] as u32) << 16) | (id[60] as u32)
-                    );
-                    return self.slave_sector_count;
-                }
-            }
-        }
-        None
+    pub unsafe fn get_sector_count(&mut self, device: ATADevice) -> Option<u64>{
+        if self.devices[device.index()].is_none() { self.identify(device)?; }
+        self.devices[device.index()].map(|info| info.sector_count)
+    }
+
+    /// How many sectors a single command can transfer from/to the device, bigger runs have to be split up
+    pub unsafe fn max_sectors_per_command(&mut self, device: ATADevice) -> usize{
+        if self.devices[device.index()].is_none() { self.identify(device); }
+        if self.devices[device.index()].map_or(false, |info| info.lba48) { MAX_SECTORS_PER_LBA48_COMMAND } else { MAX_SECTORS_PER_LBA28_COMMAND }
     }
     
     pub unsafe fn identify(&mut self, device: ATADevice) -> Option<Sector> {
@@ -216,48 +304,149 @@ impl ATABus{
         if self.io.read_status() & (1 << 0) != 0 { return None; } // ERR
         let mut a = [0u16; 256];
         a.iter_mut().for_each(|e| *e = self.io.data.read());
+        // Source: ATA/ATAPI-8 ACS, Table 22 - IDENTIFY DEVICE data
+        let lba48 = a[83] & (1 << 10) != 0;
+        self.devices[device.index()] = Some(DeviceInfo{
+            sector_count: if lba48 {
+                ((a[103] as u64) << 48) | ((a[102] as u64) << 32) | ((a[101] as u64) << 16) | (a[100] as u64)
+            } else {
+                ((a[61] as u64) << 16) | (a[60] as u64)
+            },
+            lba48,
+            dma: a[49] & (1 << 8) != 0
+        });
         Some(a)
     }
 
-    pub unsafe fn read_sector(&mut self, device: ATADevice, sector_lba: LBA28) -> Option<Sector> {
-        self.io.drive_sel.write(match device{
-            ATADevice::MASTER => 0xE0,
-            ATADevice::SLAVE => 0xF0
-        } | (sector_lba.hi >> 4) );
+    /// Loads the address and sector count registers, using LBA48 only if the transfer can't be expressed in LBA28
+    /// Returns whether the EXT version of the command has to be used, or None if the drive can't address the transfer
+    unsafe fn setup_transfer(&mut self, device: ATADevice, sector_lba: u64, count: usize) -> Option<bool> {
+        let lba48 = sector_lba + count as u64 > LBA28_LIMIT || count > MAX_SECTORS_PER_LBA28_COMMAND;
+        if lba48 && !self.devices[device.index()].map_or(false, |info| info.lba48) { return None; }
+        assert!(count >= 1 && count <= if lba48 { MAX_SECTORS_PER_LBA48_COMMAND } else { MAX_SECTORS_PER_LBA28_COMMAND }, "Sector count of a single command is out of range!");
+        let slave_bit = match device{
+            ATADevice::MASTER => 0,
+            ATADevice::SLAVE => 1 << 4
+        };
         self.io.write_features(0); // No features
-        self.io.sector_count.write(1); // Read one sector
-        self.io.address_low.write(sector_lba.low);
-        self.io.address_mid.write(sector_lba.mid);
-        self.io.address_hi.write(sector_lba.hi);
-        self.io.write_command(ata_command::READ_SECTORS); // Read sectors command
-        
+        if lba48 {
+            self.io.drive_sel.write(0x40 | slave_bit);
+            // The registers are two bytes deep when doing LBA48, the high order bytes have to go in first
+            self.io.sector_count.write(((count >> 8) & 0xFF) as u8); // NOTE: 65536 wraps around to 0, which the drive interprets as 65536 sectors
+            self.io.address_low.write(((sector_lba >> 24) & 0xFF) as u8);
+            self.io.address_mid.write(((sector_lba >> 32) & 0xFF) as u8);
+            self.io.address_hi.write(((sector_lba >> 40) & 0xFF) as u8);
+        } else {
+            // Bits 24-27 of the address live in the bottom of the drive select register
+            self.io.drive_sel.write(0xE0 | slave_bit | ((sector_lba >> 24) & 0x0F) as u8);
+        }
+        self.io.sector_count.write((count & 0xFF) as u8); // NOTE: 256 wraps around to 0, which the drive interprets as 256 sectors
+        self.io.address_low.write((sector_lba & 0xFF) as u8);
+        self.io.address_mid.write(((sector_lba >> 8) & 0xFF) as u8);
+        self.io.address_hi.write(((sector_lba >> 16) & 0xFF) as u8);
+        Some(lba48)
+    }
+
+    /// Returns false if the drive reported an error instead of being ready for the next sector
+    unsafe fn wait_for_data_request(&self) -> bool {
         wait_for!(self.io.read_status() & (1 << 7) == 0); // BSY clears
         wait_for!(self.io.read_status() & (1 << 3) != 0 || self.io.read_status() & (1 << 0) != 0); // DRQ or ERR sets
-        if self.io.read_status() & (1 << 0) == 1 { return None; } // ERR
+        self.io.read_status() & (1 << 0) == 0 // ERR
+    }
 
-        let mut a = [0u16; 256];
-        a.iter_mut().for_each(|e| *e = self.io.data.read());
-        Some(a)
+    /// Waits for the current command to finish, returns false if the drive reported an error or a device fault
+    unsafe fn wait_for_command_done(&self) -> bool {
+        wait_for!(self.io.read_status() & (1 << 7) == 0); // BSY clears
+        self.io.read_status() & ((1 << 0) | (1 << 5)) == 0 // ERR, DF
     }
 
-    pub unsafe fn write_sector(&mut self, device: ATADevice, sector_lba: LBA28, data: &Sector) {
-        self.io.drive_sel.write(match device{
-            ATADevice::MASTER => 0xE0,
-            ATADevice::SLAVE => 0xF0
-        } | (sector_lba.hi >> 4) );
-        self.io.write_features(0); // No features
-        self.io.sector_count.write(1); // Read one sector
-        self.io.address_low.write(sector_lba.low);
-        self.io.address_mid.write(sector_lba.mid);
-        self.io.address_hi.write(sector_lba.hi);
-        self.io.write_command(ata_command::WRITE_SECTORS); // Write sectors command
+    unsafe fn flush_cache(&mut self) -> Option<()> {
+        self.io.write_command(ata_command::CACHE_FLUSH);
+        if !self.wait_for_command_done() { return None; }
+        Some(())
+    }
 
-        wait_for!(self.io.read_status() & (1 << 7) == 0); // BSY clears
-        wait_for!(self.io.read_status() & (1 << 3) != 0 || self.io.read_status() & (1 << 0) != 0); // DRQ or ERR sets
-        if self.io.read_status() & (1 << 0) == 1 { return; } // ERR
+    fn can_dma(&self, device: ATADevice) -> bool {
+        self.dma.is_some() && self.devices[device.index()].map_or(false, |info| info.dma)
+    }
 
-        data.iter().for_each(|e| self.io.data.write(*e));
+    /// Reads count sectors starting at sector_lba into buf, using DMA if the bus and drive support it, and PIO otherwise
+    pub unsafe fn read_sectors(&mut self, device: ATADevice, sector_lba: u64, count: usize, buf: &mut [u8]) -> Option<()> {
+        trace_span!(AtaRead, count*SECTOR_SIZE_IN_BYTES);
+        if self.can_dma(device) && self.read_sectors_dma(device, sector_lba, count, buf).is_some() { return Some(()); }
+        // Either there is no dma, or it failed for some reason, either way PIO should still work
+        self.read_sectors_pio(device, sector_lba, count, buf)
+    }
+
+    /// Writes count sectors starting at sector_lba from data, using DMA if the bus and drive support it, and PIO otherwise
+    pub unsafe fn write_sectors(&mut self, device: ATADevice, sector_lba: u64, count: usize, data: &[u8]) -> Option<()> {
+        if self.can_dma(device) && self.write_sectors_dma(device, sector_lba, count, data).is_some() { return Some(()); }
+        self.write_sectors_pio(device, sector_lba, count, data)
+    }
+
+    unsafe fn read_sectors_dma(&mut self, device: ATADevice, sector_lba: u64, count: usize, buf: &mut [u8]) -> Option<()> {
+        assert!(buf.len() >= count*SECTOR_SIZE_IN_BYTES, "Buffer should be big enough to fit all the sectors!");
+        let mut done = 0;
+        while done < count {
+            let n = core::cmp::min(count-done, MAX_SECTORS_PER_DMA_TRANSFER);
+            let lba48 = self.setup_transfer(device, sector_lba + done as u64, n)?;
+            let dma = self.dma.as_mut()?;
+            if !dma.transfer(&mut self.io, if lba48 { ata_command::READ_DMA_EXT } else { ata_command::READ_DMA }, true, n*SECTOR_SIZE_IN_BYTES) { return None; }
+            buf[done*SECTOR_SIZE_IN_BYTES..(done+n)*SECTOR_SIZE_IN_BYTES].copy_from_slice(&dma.buffer.0[..n*SECTOR_SIZE_IN_BYTES]);
+            done += n;
+        }
+        Some(())
+    }
+
+    unsafe fn write_sectors_dma(&mut self, device: ATADevice, sector_lba: u64, count: usize, data: &[u8]) -> Option<()> {
+        assert!(data.len() >= count*SECTOR_SIZE_IN_BYTES, "Data should contain all the sectors to be written!");
+        let mut done = 0;
+        while done < count {
+            let n = core::cmp::min(count-done, MAX_SECTORS_PER_DMA_TRANSFER);
+            let lba48 = self.setup_transfer(device, sector_lba + done as u64, n)?;
+            let dma = self.dma.as_mut()?;
+            dma.buffer.0[..n*SECTOR_SIZE_IN_BYTES].copy_from_slice(&data[done*SECTOR_SIZE_IN_BYTES..(done+n)*SECTOR_SIZE_IN_BYTES]);
+            if !dma.transfer(&mut self.io, if lba48 { ata_command::WRITE_DMA_EXT } else { ata_command::WRITE_DMA }, false, n*SECTOR_SIZE_IN_BYTES) { return None; }
+            done += n;
+        }
+        self.flush_cache()
+    }
+
+    /// Reads count sectors starting at sector_lba into buf using one READ SECTORS (EXT) command
+    /// NOTE: The drive still raises DRQ once per sector, but we only pay for the command setup once
+    unsafe fn read_sectors_pio(&mut self, device: ATADevice, sector_lba: u64, count: usize, buf: &mut [u8]) -> Option<()> {
+        assert!(buf.len() >= count*SECTOR_SIZE_IN_BYTES, "Buffer should be big enough to fit all the sectors!");
+        let lba48 = self.setup_transfer(device, sector_lba, count)?;
+        self.io.write_command(if lba48 { ata_command::READ_SECTORS_EXT } else { ata_command::READ_SECTORS });
+
+        for sector in buf.chunks_exact_mut(SECTOR_SIZE_IN_BYTES).take(count) {
+            if !self.wait_for_data_request() { return None; }
+            for word in sector.chunks_exact_mut(core::mem::size_of::<u16>()) {
+                let e = self.io.data.read();
+                word[0] = (e&0xFF) as u8;
+                word[1] = ((e >> 8)&0xFF) as u8;
+            }
+        }
+        Some(())
+    }
+
+    /// Writes count sectors starting at sector_lba from data using one WRITE SECTORS (EXT) command
+    unsafe fn write_sectors_pio(&mut self, device: ATADevice, sector_lba: u64, count: usize, data: &[u8]) -> Option<()> {
+        assert!(data.len() >= count*SECTOR_SIZE_IN_BYTES, "Data should contain all the sectors to be written!");
+        let lba48 = self.setup_transfer(device, sector_lba, count)?;
+        self.io.write_command(if lba48 { ata_command::WRITE_SECTORS_EXT } else { ata_command::WRITE_SECTORS });
+
+        for sector in data.chunks_exact(SECTOR_SIZE_IN_BYTES).take(count) {
+            if !self.wait_for_data_request() { return None; }
+            for word in sector.chunks_exact(core::mem::size_of::<u16>()) {
+                self.io.data.write((word[0] as u16) | ((word[1] as u16) << 8));
+            }
+        }
 
+        // NOTE: The drive ignores commands written while it's still busy with the last sector, so wait for the write to finish first
+        if !self.wait_for_command_done() { return None; }
+        // Make sure the data actually reached the disk before we say we are done
+        self.flush_cache()
     }
 }
 
@@ -268,68 +457,108 @@ pub struct ATADeviceFile{
 }
 
 
+impl ATADeviceFile{
+    /// Reads every sector in first_sector..first_sector+sector_count into buf, using as few commands as possible
+    fn read_sector_run(&self, first_sector: u64, sector_count: usize, buf: &mut [u8]) -> Option<()> {
+      let mut bus = (*self.bus).borrow_mut();
+      let max_sectors = unsafe{ bus.max_sectors_per_command(self.bus_device) };
+      let mut done = 0;
+      while done < sector_count {
+        let n = core::cmp::min(sector_count-done, max_sectors);
+        let lba = first_sector + done as u64;
+        unsafe{ bus.read_sectors(self.bus_device, lba, n, &mut buf[done*SECTOR_SIZE_IN_BYTES..(done+n)*SECTOR_SIZE_IN_BYTES]) }?;
+        done += n;
+      }
+      Some(())
+    }
+
+    fn write_sector_run(&self, first_sector: u64, sector_count: usize, data: &[u8]) -> Option<()> {
+      let mut bus = (*self.bus).borrow_mut();
+      let max_sectors = unsafe{ bus.max_sectors_per_command(self.bus_device) };
+      let mut done = 0;
+      while done < sector_count {
+        let n = core::cmp::min(sector_count-done, max_sectors);
+        let lba = first_sector + done as u64;
+        unsafe{ bus.write_sectors(self.bus_device, lba, n, &data[done*SECTOR_SIZE_IN_BYTES..(done+n)*SECTOR_SIZE_IN_BYTES]) }?;
+        done += n;
+      }
+      Some(())
+    }
+}
+
 impl IFile for ATADeviceFile{
-    fn read(&self, offset_in_bytes: usize, len: usize) -> Option<Vec<u8>> {
+    fn read_into(&self, offset_in_bytes: usize, buf: &mut [u8]) -> Result<usize, IOError> {
+      let size = self.get_size();
+      if offset_in_bytes > size { return Err(IOError::OutOfBounds); }
+      let len = core::cmp::min(buf.len(), size - offset_in_bytes);
+      let buf = &mut buf[..len];
+      let mut sector = (offset_in_bytes / SECTOR_SIZE_IN_BYTES) as u64;
+      let mut done = 0;
+
+      // Sectors which are only partially wanted go through a bounce buffer, whole sectors go straight into buf
       let offset_in_first_sector = offset_in_bytes % SECTOR_SIZE_IN_BYTES;
-      let offset_of_first_sector = offset_in_bytes / SECTOR_SIZE_IN_BYTES;
-      let mut res: Vec<u8> = Vec::with_capacity(len);
-
-      // Deal with first block
-      let first_block_lba = LBA28{hi: ((offset_of_first_sector>>16)&0xFF) as u8, mid: ((offset_of_first_sector>>8)&0xFF) as u8, low: (offset_of_first_sector&0xFF) as u8};
-      let first_block = unsafe{ (*self.bus).borrow_mut().read_sector(self.bus_device, first_block_lba) }?;
-
-      let mut skip_first_byte = offset_in_first_sector%2 == 1;
-      for e in &first_block[offset_in_first_sector/2..] {                 
-          if skip_first_byte {
-            res.push(((e >> 8)&0xFF) as u8); 
-            skip_first_byte = false;
-            continue;
-          } 
-          res.push((e&0xFF) as u8);
-          res.push(((e >> 8)&0xFF) as u8); 
+      if len > 0 && (offset_in_first_sector != 0 || len < SECTOR_SIZE_IN_BYTES) {
+        let mut bounce = [0u8; SECTOR_SIZE_IN_BYTES];
+        self.read_sector_run(sector, 1, &mut bounce).ok_or(IOError::DeviceError)?;
+        let n = core::cmp::min(SECTOR_SIZE_IN_BYTES - offset_in_first_sector, len);
+        buf[..n].copy_from_slice(&bounce[offset_in_first_sector..offset_in_first_sector+n]);
+        done += n;
+        sector += 1;
       }
 
-      // Read continually, until the end is included in res, overreading if necessary
-      let extra_block = if len%SECTOR_SIZE_IN_BYTES != 0 { 1 } else { 0 };
-      for sector_indx in 1..((len/SECTOR_SIZE_IN_BYTES)+extra_block){
-        if res.len() >= len { break; }
-        let offset = offset_of_first_sector+sector_indx;
-        let lba = LBA28{hi: ((offset>>16)&0xFF) as u8, mid: ((offset>>8)&0xFF) as u8, low: (offset&0xFF) as u8};
-        res.append(
-        &mut unsafe{ (*self.bus).borrow_mut().read_sector(self.bus_device, lba) }
-        .map(|val|{
-            let mut v = Vec::with_capacity(SECTOR_SIZE_IN_BYTES);
-            for e in &val{
-                v.push((e&0xFF) as u8);
-                v.push(((e >> 8)&0xFF) as u8);
-            }
-            v
-        })?
-        );
+      let whole_sectors = (len - done) / SECTOR_SIZE_IN_BYTES;
+      if whole_sectors > 0 {
+        self.read_sector_run(sector, whole_sectors, &mut buf[done..done+whole_sectors*SECTOR_SIZE_IN_BYTES]).ok_or(IOError::DeviceError)?;
+        done += whole_sectors*SECTOR_SIZE_IN_BYTES;
+        sector += whole_sectors as u64;
       }
-      // Get rid of overread bytes
-      while res.len() > len { res.pop(); }
-      assert!(res.len() == len);
-      Some(res)
-    }
-
-    fn write(&mut self, offset_in_bytes: usize, data: &[u8]) {
-       let offset_in_first_sector = offset_in_bytes & SECTOR_SIZE_IN_BYTES;
-       let offset_of_first_sector = offset_in_bytes / SECTOR_SIZE_IN_BYTES;
-       let mut i = data.iter();
-       
-       for sector_indx in 0..(data.len()/SECTOR_SIZE_IN_BYTES+1){
-         let offset = offset_of_first_sector+sector_indx;
-         let lba = LBA28{hi: ((offset>>16)&0xFF) as u8, mid: ((offset>>8)&0xFF) as u8, low: (offset&0xFF) as u8};
-         let mut v = unsafe{ (*self.bus).borrow_mut().read_sector(self.bus_device, lba) }.expect("Reading device should work!");
-         let mut ind = 0;
-         if sector_indx == 0 { ind = offset_in_first_sector; }
-         while let (Some(a), Some(b)) = (i.next(), i.next()){
-           v[ind] = ((*a as u16) << 8) | (*b as u16);
-            ind += 1;
-         }
-         unsafe{ (*self.bus).borrow_mut().write_sector(self.bus_device, lba, &v) }
-        }
+
+      if done < len {
+        let mut bounce = [0u8; SECTOR_SIZE_IN_BYTES];
+        self.read_sector_run(sector, 1, &mut bounce).ok_or(IOError::DeviceError)?;
+        let n = len - done;
+        buf[done..].copy_from_slice(&bounce[..n]);
+        done += n;
+      }
+      Ok(done)
+    }
+
+    fn write_from(&mut self, offset_in_bytes: usize, data: &[u8]) -> Result<usize, IOError> {
+      let size = self.get_size();
+      if offset_in_bytes > size { return Err(IOError::OutOfBounds); }
+      let len = core::cmp::min(data.len(), size - offset_in_bytes);
+      let data = &data[..len];
+      let mut sector = (offset_in_bytes / SECTOR_SIZE_IN_BYTES) as u64;
+      let mut done = 0;
+
+      // Sectors can only be written whole, so the ones we only partially overwrite have to be read, patched and written back
+      let offset_in_first_sector = offset_in_bytes % SECTOR_SIZE_IN_BYTES;
+      if len > 0 && (offset_in_first_sector != 0 || len < SECTOR_SIZE_IN_BYTES) {
+        let mut bounce = [0u8; SECTOR_SIZE_IN_BYTES];
+        self.read_sector_run(sector, 1, &mut bounce).ok_or(IOError::DeviceError)?;
+        let n = core::cmp::min(SECTOR_SIZE_IN_BYTES - offset_in_first_sector, len);
+        bounce[offset_in_first_sector..offset_in_first_sector+n].copy_from_slice(&data[..n]);
+        self.write_sector_run(sector, 1, &bounce).ok_or(IOError::DeviceError)?;
+        done += n;
+        sector += 1;
+      }
+
+      let whole_sectors = (len - done) / SECTOR_SIZE_IN_BYTES;
+      if whole_sectors > 0 {
+        self.write_sector_run(sector, whole_sectors, &data[done..done+whole_sectors*SECTOR_SIZE_IN_BYTES]).ok_or(IOError::DeviceError)?;
+        done += whole_sectors*SECTOR_SIZE_IN_BYTES;
+        sector += whole_sectors as u64;
+      }
+
+      if done < len {
+        let mut bounce = [0u8; SECTOR_SIZE_IN_BYTES];
+        self.read_sector_run(sector, 1, &mut bounce).ok_or(IOError::DeviceError)?;
+        let n = len - done;
+        bounce[..n].copy_from_slice(&data[done..]);
+        self.write_sector_run(sector, 1, &bounce).ok_or(IOError::DeviceError)?;
+        done += n;
+      }
+      Ok(done)
     }
 
     fn get_size(&self) -> usize{
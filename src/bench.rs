@@ -0,0 +1,186 @@
+use core::{cell::RefCell, fmt::Write};
+
+use alloc::{boxed::Box, rc::Rc, string::String, vec, vec::Vec};
+
+use crate::{vfs::{self, IFolder, Node}, ext2, dcache, mem, trace, uart_16550, primitives::read_tsc, virtmem::KernPointer, TERMINAL};
+
+// Everything goes out the serial port as "bench,<name>,<value>,<unit>" lines, bench.sh picks those up
+// NOTE: The workloads are fixed ( and the "random" ones seeded ) so runs can be compared against each other
+
+// qemu's isa-debug-exit device, see bench.sh
+const DEBUG_EXIT_PORT: u16 = 0xF4;
+// The disk bench.sh makes, as the primary slave
+const BENCH_DISK: &str = "/dev/hdb";
+const BENCH_MOUNTPOINT: &str = "bench";
+const LARGE_FILE: &str = "/bench/large.bin";
+const DIR_PATH: &str = "/bench/dir";
+const DIR_ENTRIES: usize = 10_000;
+// Has to fit in the dentry cache with room to spare, otherwise it starts over halfway through the warm pass
+const DIR_LOOKUPS: usize = dcache::MAX_ENTRIES/2;
+const RANDOM_READS: usize = 1024;
+const RANDOM_READ_SIZE: usize = 4096;
+const SEQ_CHUNK_SIZE: usize = 64*1024;
+const ALLOC_CHURN_OPS: usize = 100_000;
+const TERMINAL_LINES: usize = 1000;
+
+/// Whether the kernel should run the suite instead of the shell, the bench feature or "bench" on the kernel command line turn it on
+pub fn is_bench_mode(cmdline: &str) -> bool {
+    cfg!(feature = "bench") || cmdline.split_whitespace().any(|arg| arg == "bench")
+}
+
+fn report(name: &str, value: u64, unit: &str) {
+    klog!(Info, "bench,{},{},{}", name, value, unit);
+    // Never outside of something being timed, and a full log ring would drop results
+    uart_16550::flush_log_blocking();
+}
+
+fn ns_since(start: u64) -> u64 { trace::cycles_to_ns(read_tsc() - start) }
+
+/// Same numbers every run
+struct XorShift(u64);
+
+impl XorShift {
+    fn next(&mut self) -> u64 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        self.0
+    }
+}
+
+/// Exits qemu with status (code << 1) | 1, if it has the device, otherwise it just hangs
+fn exit_qemu(code: u32) -> ! {
+    uart_16550::flush_log_blocking();
+    unsafe { KernPointer::<u32>::from_port(DEBUG_EXIT_PORT).write(code); }
+    loop {}
+}
+
+fn mount_bench_disk() -> Option<()> {
+    let file = if let Node::File(file) = vfs::lookup_path(BENCH_DISK)? { file } else { return None; };
+    let e2fs = Rc::new(RefCell::new(ext2::Ext2FS::new(file)?));
+    let root_inode = (*e2fs).borrow().get_inode(2)?;
+    let root = root_inode.as_vfs_node(2, e2fs.clone())?.expect_folder();
+    let mountpoint = vfs::VFSNode::new_folder(vfs::VFS_ROOT.lock().clone(), BENCH_MOUNTPOINT);
+    (*mountpoint).borrow_mut().set_mountpoint(Some(root));
+    Some(())
+}
+
+fn bench_ext2_reads() -> Option<()> {
+    let file = if let Node::File(file) = vfs::lookup_path(LARGE_FILE)? { file } else { return None; };
+    let size = (*file).borrow().get_size();
+    let mut buf = vec![0u8; SEQ_CHUNK_SIZE];
+
+    let start = read_tsc();
+    let mut offset = 0;
+    while offset < size {
+        offset += (*file).borrow().read_into(offset, &mut buf).ok()?;
+    }
+    let ns = ns_since(start);
+    report("ext2_seq_read_bytes", size as u64, "bytes");
+    report("ext2_seq_read", ns, "ns");
+    report("ext2_seq_read_throughput", size as u64*1_000_000_000/core::cmp::max(ns, 1)/1024, "kb/s");
+
+    let mut rng = XorShift(0x5EED);
+    let blocks = size/RANDOM_READ_SIZE;
+    if blocks == 0 { return None; }
+    let start = read_tsc();
+    for _ in 0..RANDOM_READS {
+        let offset = (rng.next() as usize % blocks)*RANDOM_READ_SIZE;
+        (*file).borrow().read_into(offset, &mut buf[..RANDOM_READ_SIZE]).ok()?;
+    }
+    report("ext2_random_read_4k", ns_since(start)/RANDOM_READS as u64, "ns/read");
+    Some(())
+}
+
+fn bench_dir_lookups() -> Option<()> {
+    let folder: Rc<RefCell<dyn IFolder>> = if let Node::Folder(folder) = vfs::lookup_path(DIR_PATH)? { folder } else { return None; };
+    // One name out of every DIR_ENTRIES/DIR_LOOKUPS, so they are all different and spread over the whole folder
+    let mut rng = XorShift(0xD1);
+    let stride = DIR_ENTRIES/DIR_LOOKUPS;
+    let names: Vec<String> = (0..DIR_LOOKUPS).map(|i| {
+        let mut name = String::new();
+        write!(name, "f{}", i*stride + rng.next() as usize % stride).unwrap();
+        name
+    }).collect();
+
+    // First time around everything goes to ext2, the second time it's all dentry cache hits
+    // NOTE: Starts from an empty cache, so what looking up the folder itself cached doesn't count against MAX_ENTRIES
+    dcache::invalidate();
+    for pass in ["dir_lookup_cold", "dir_lookup_warm"].iter() {
+        let start = read_tsc();
+        for name in names.iter() { dcache::lookup(&folder, name)?; }
+        report(pass, ns_since(start)/DIR_LOOKUPS as u64, "ns/lookup");
+    }
+    Some(())
+}
+
+fn bench_alloc_churn() {
+    // A window of live allocations of mixed sizes, each step frees the oldest one and allocates a new one
+    const LIVE: usize = 64;
+    const SIZES: [usize; 8] = [8, 16, 24, 64, 100, 256, 1024, 4000];
+    let mut live: Vec<Option<Box<[u8]>>> = (0..LIVE).map(|_| None).collect();
+    let mut rng = XorShift(0xA110C);
+    let start = read_tsc();
+    for i in 0..ALLOC_CHURN_OPS {
+        let size = SIZES[rng.next() as usize % SIZES.len()];
+        live[i % LIVE] = Some(core::hint::black_box(vec![0u8; size].into_boxed_slice()));
+    }
+    drop(live);
+    report("alloc_churn", ns_since(start)/ALLOC_CHURN_OPS as u64, "ns/op");
+}
+
+fn bench_terminal() {
+    // Every line scrolls once the screen is full, and gets drawn like the shell would draw it
+    let start = read_tsc();
+    for i in 0..TERMINAL_LINES {
+        let mut term = TERMINAL.lock();
+        writeln!(term, "{:04} The quick brown fox jumps over the lazy dog, 0123456789 !?", i).unwrap();
+        term.repaint();
+    }
+    report("terminal_line_scroll", ns_since(start)/TERMINAL_LINES as u64, "ns/line");
+}
+
+fn bench_memcpy() {
+    const MAX_SIZE: usize = 1024*1024;
+    let src = vec![0x5Au8; MAX_SIZE];
+    let mut dest = vec![0u8; MAX_SIZE];
+    let mut size = 16;
+    while size <= MAX_SIZE {
+        let iters = core::cmp::max(1, core::cmp::min(100_000, 16*MAX_SIZE/size));
+        let (s, d) = (src.as_ptr(), dest.as_mut_ptr());
+        let start = read_tsc();
+        for _ in 0..iters { unsafe { mem::memcpy(core::hint::black_box(d), s, size); } }
+        let mut name = String::new();
+        write!(name, "memcpy_{}", size).unwrap();
+        report(&name, (read_tsc() - start)/iters as u64, "cycles/call");
+        size *= 4;
+    }
+}
+
+/// Runs every benchmark, prints the results over serial and exits qemu
+/// boot_cycles is how long main took to get to where the shell would start
+pub fn run_suite(boot_cycles: u64) -> ! {
+    klog!(Info, "bench,start");
+    report("tsc_hz", trace::get_tsc_hz(), "hz");
+    report("boot_to_prompt", trace::cycles_to_ns(boot_cycles)/1000, "us");
+    report("since_reset", trace::now_ns()/1000, "us");
+    trace::reset();
+
+    if mount_bench_disk().is_some() {
+        if bench_ext2_reads().is_none() { klog!(Info, "bench,skipped,ext2_reads"); }
+        if bench_dir_lookups().is_none() { klog!(Info, "bench,skipped,dir_lookups"); }
+    } else {
+        klog!(Info, "bench,skipped,no ext2 fs on {}", BENCH_DISK);
+    }
+    bench_alloc_churn();
+    bench_terminal();
+    bench_memcpy();
+
+    // Where the time went, by trace point
+    for (point, stats) in trace::get_all_point_stats().iter() {
+        klog!(Info, "perf,{},{},{},{},{},{}", point.name(), stats.calls, stats.bytes, stats.cycles, stats.p50_cycles, stats.p99_cycles);
+        uart_16550::flush_log_blocking();
+    }
+    klog!(Info, "bench,done");
+    exit_qemu(0);
+}
@@ -0,0 +1,271 @@
+use core::cell::RefCell;
+
+use alloc::{rc::Rc, vec::Vec, vec};
+
+use crate::{primitives::{Mutex, LazyInitialised}, vfs::{IFile, IOError}, mmap};
+
+// NOTE: 8 sectors, so a miss costs one multi-sector command
+// ext2 blocks ( 1k-4k ) only line up with cache blocks if the filesystem starts 4 kb aligned, on a partition at sector 63 ( old mbr layout ) every 4k block straddles two of them
+// Reads and writes go cache block by cache block so that's still correct, it just costs twice the lookups
+pub const CACHE_BLOCK_SIZE: usize = 4096;
+// NOTE: The cache is sized from how much ram there is, but stays between these ( 128 kb - 1 mb ) so lookups can stay a linear scan
+pub const MIN_CACHE_BLOCK_COUNT: usize = 32;
+pub const MAX_CACHE_BLOCK_COUNT: usize = 256;
+// NOTE: 64 kb, which is as much as one dma transfer can do
+const MAX_PREFETCH_BLOCKS: usize = 16;
+
+pub static BLOCK_CACHE: Mutex<LazyInitialised<BlockCache>> = Mutex::from(LazyInitialised::uninit());
+
+#[derive(Debug, Clone, Copy)]
+struct CacheEntry{
+    device: usize,
+    block: u64,
+    valid_len: usize, // The last block of a device can be smaller than CACHE_BLOCK_SIZE
+    dirty: bool,
+    referenced: bool // Second chance bit for CLOCK
+}
+
+#[derive(Debug, Clone, Copy, Default)]
+pub struct CacheStats{
+    pub hits: usize,
+    pub misses: usize,
+    pub writebacks: usize,
+    pub failed_writebacks: usize,
+    pub prefetched: usize,
+    pub used_blocks: usize,
+    pub dirty_blocks: usize,
+    pub total_blocks: usize
+}
+
+/// One cache shared by every block device, keyed by (device id, block number)
+/// Replacement is done with CLOCK, dirty blocks are written back when evicted or on sync()
+pub struct BlockCache{
+    devices: Vec<Rc<RefCell<dyn IFile>>>,
+    entries: Vec<Option<CacheEntry>>,
+    // NOTE: One big allocation up front instead of one per block, the allocator really doesn't like lots of small long lived allocations
+    data: Vec<u8>,
+    // Prefetched blocks are read in one go into here first, the slots they end up in are almost never next to each other
+    staging: Vec<u8>,
+    clock_hand: usize,
+    hits: usize,
+    misses: usize,
+    writebacks: usize,
+    failed_writebacks: usize, // Evictions that couldn't write a dirty block back, it stays cached ( and dirty ) then
+    prefetched: usize
+}
+
+// NOTE: Rc isn't Send, but we only have one core for now and the Mutex is there anyways
+impl core::fmt::Debug for BlockCache{
+    fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
+        f.debug_struct("BlockCache").field("devices", &self.devices.len()).field("entries", &self.entries).field("clock_hand", &self.clock_hand).finish()
+    }
+}
+
+impl BlockCache{
+    pub fn new(block_count: usize) -> Self{
+        let block_count = block_count.clamp(MIN_CACHE_BLOCK_COUNT, MAX_CACHE_BLOCK_COUNT);
+        Self{
+            devices: Vec::new(),
+            entries: vec![None; block_count],
+            data: vec![0; block_count*CACHE_BLOCK_SIZE],
+            staging: vec![0; MAX_PREFETCH_BLOCKS*CACHE_BLOCK_SIZE],
+            clock_hand: 0,
+            hits: 0,
+            misses: 0,
+            writebacks: 0,
+            failed_writebacks: 0,
+            prefetched: 0
+        }
+    }
+
+    /// Returns the id the device is cached under
+    pub fn register_device(&mut self, dev: Rc<RefCell<dyn IFile>>) -> usize{
+        self.devices.push(dev);
+        self.devices.len()-1
+    }
+
+    fn slot_data(&mut self, slot: usize) -> &mut [u8]{
+        &mut self.data[slot*CACHE_BLOCK_SIZE..(slot+1)*CACHE_BLOCK_SIZE]
+    }
+
+    fn lookup(&self, device: usize, block: u64) -> Option<usize>{
+        // NOTE: A linear scan over a couple hundred entries is cheap enough and doesn't allocate, unlike a map
+        self.entries.iter().position(|e| matches!(e, Some(e) if e.device == device && e.block == block))
+    }
+
+    fn writeback(&mut self, slot: usize) -> Result<(), IOError>{
+        if let Some(entry) = self.entries[slot]{
+            if !entry.dirty { return Ok(()); }
+            let dev = self.devices[entry.device].clone();
+            let written = (*dev).borrow_mut().write_from(entry.block as usize*CACHE_BLOCK_SIZE, &self.slot_data(slot)[..entry.valid_len])?;
+            if written != entry.valid_len { return Err(IOError::DeviceError); }
+            self.writebacks += 1;
+            self.entries[slot] = Some(CacheEntry{dirty: false, ..entry});
+        }
+        Ok(())
+    }
+
+    /// Finds a slot to put a new block in, writing back whatever was there if needed
+    /// A dirty block that can't be written back is skipped, this only fails if that's true for every block
+    fn evict(&mut self) -> Result<usize, IOError>{
+        // NOTE: Two sweeps, the first one might only be clearing referenced bits
+        for _ in 0..2*self.entries.len(){
+            let slot = self.clock_hand;
+            self.clock_hand = (self.clock_hand+1)%self.entries.len();
+            match self.entries[slot]{
+                None => return Ok(slot),
+                Some(e) if e.referenced => self.entries[slot] = Some(CacheEntry{referenced: false, ..e}),
+                Some(e) => {
+                    if let Err(err) = self.writeback(slot) {
+                        self.failed_writebacks += 1;
+                        klog!(Warn, "Couldn't write back block {} of device {}: {:?}", e.block, e.device, err);
+                        continue;
+                    }
+                    self.entries[slot] = None;
+                    return Ok(slot);
+                }
+            }
+        }
+        Err(IOError::DeviceError)
+    }
+
+    /// Returns the slot holding the block, reading it from the device if it's not cached
+    /// If fill is false the caller promises to overwrite the whole block, so there's no point in reading it
+    fn get_slot(&mut self, device: usize, block: u64, valid_len: usize, fill: bool) -> Result<usize, IOError>{
+        if let Some(slot) = self.lookup(device, block){
+            self.hits += 1;
+            if let Some(e) = &mut self.entries[slot] { e.referenced = true; }
+            return Ok(slot);
+        }
+        self.misses += 1;
+        let slot = self.evict()?;
+        if fill {
+            let dev = self.devices[device].clone();
+            let read = (*dev).borrow().read_into(block as usize*CACHE_BLOCK_SIZE, &mut self.slot_data(slot)[..valid_len])?;
+            if read != valid_len { return Err(IOError::DeviceError); }
+        }
+        self.entries[slot] = Some(CacheEntry{device, block, valid_len, dirty: false, referenced: true});
+        Ok(slot)
+    }
+
+    /// Reads every block in [first_block, first_block+count) that isn't cached yet, batching runs of missing blocks into one device read
+    /// NOTE: Errors are ignored, this is only a hint
+    fn prefetch(&mut self, device: usize, device_size: usize, first_block: u64, count: usize){
+        let end_block = first_block + count as u64;
+        let mut block = first_block;
+        while block < end_block {
+            if self.lookup(device, block).is_some() { block += 1; continue; }
+
+            let run_start = block;
+            while block < end_block && block - run_start < MAX_PREFETCH_BLOCKS as u64 && self.lookup(device, block).is_none() { block += 1; }
+            let run_start_offset = run_start as usize*CACHE_BLOCK_SIZE;
+            let run_bytes = core::cmp::min(block as usize*CACHE_BLOCK_SIZE, device_size) - run_start_offset;
+
+            let dev = self.devices[device].clone();
+            let mut staging = core::mem::take(&mut self.staging);
+            let read = (*dev).borrow().read_into(run_start_offset, &mut staging[..run_bytes]);
+            if read == Ok(run_bytes) {
+                for (i, chunk) in staging[..run_bytes].chunks(CACHE_BLOCK_SIZE).enumerate(){
+                    let slot = if let Ok(slot) = self.evict() { slot } else { break; };
+                    self.slot_data(slot)[..chunk.len()].copy_from_slice(chunk);
+                    // NOTE: Not referenced yet, so read-ahead that never gets used is the first thing to go
+                    self.entries[slot] = Some(CacheEntry{device, block: run_start + i as u64, valid_len: chunk.len(), dirty: false, referenced: false});
+                    self.prefetched += 1;
+                }
+            }
+            self.staging = staging;
+            if read != Ok(run_bytes) { return; }
+        }
+    }
+
+    /// Writes back every dirty block
+    pub fn sync(&mut self) -> Result<(), IOError>{
+        for slot in 0..self.entries.len() { self.writeback(slot)?; }
+        Ok(())
+    }
+
+    pub fn stats(&self) -> CacheStats{
+        CacheStats{
+            hits: self.hits,
+            misses: self.misses,
+            writebacks: self.writebacks,
+            failed_writebacks: self.failed_writebacks,
+            prefetched: self.prefetched,
+            used_blocks: self.entries.iter().filter(|e| e.is_some()).count(),
+            dirty_blocks: self.entries.iter().filter(|e| matches!(e, Some(e) if e.dirty)).count(),
+            total_blocks: self.entries.len()
+        }
+    }
+}
+
+/// A device file whose reads and writes go through BLOCK_CACHE
+pub struct CachedDevice{
+    id: usize,
+    size: usize
+}
+
+impl CachedDevice{
+    pub fn new(dev: Rc<RefCell<dyn IFile>>) -> Self{
+        let size = (*dev).borrow().get_size();
+        Self{
+            id: BLOCK_CACHE.lock().register_device(dev),
+            size
+        }
+    }
+
+    fn block_len(&self, block: u64) -> usize{
+        core::cmp::min(CACHE_BLOCK_SIZE, self.size - block as usize*CACHE_BLOCK_SIZE)
+    }
+}
+
+impl IFile for CachedDevice{
+    fn read_into(&self, offset: usize, buf: &mut [u8]) -> Result<usize, IOError> {
+        if offset > self.size { return Err(IOError::OutOfBounds); }
+        let len = core::cmp::min(buf.len(), self.size - offset);
+        let mut cache = BLOCK_CACHE.lock();
+        let mut done = 0;
+        while done < len {
+            let pos = offset + done;
+            let block = (pos/CACHE_BLOCK_SIZE) as u64;
+            let offset_in_block = pos%CACHE_BLOCK_SIZE;
+            let n = core::cmp::min(CACHE_BLOCK_SIZE - offset_in_block, len - done);
+            let slot = cache.get_slot(self.id, block, self.block_len(block), true)?;
+            buf[done..done+n].copy_from_slice(&cache.slot_data(slot)[offset_in_block..offset_in_block+n]);
+            done += n;
+        }
+        Ok(done)
+    }
+
+    fn write_from(&mut self, offset: usize, data: &[u8]) -> Result<usize, IOError> {
+        if offset > self.size { return Err(IOError::OutOfBounds); }
+        let len = core::cmp::min(data.len(), self.size - offset);
+        // Whatever is on the device might be mapped through a file on it
+        mmap::note_file_write();
+        let mut cache = BLOCK_CACHE.lock();
+        let mut done = 0;
+        while done < len {
+            let pos = offset + done;
+            let block = (pos/CACHE_BLOCK_SIZE) as u64;
+            let offset_in_block = pos%CACHE_BLOCK_SIZE;
+            let block_len = self.block_len(block);
+            let n = core::cmp::min(CACHE_BLOCK_SIZE - offset_in_block, len - done);
+            let slot = cache.get_slot(self.id, block, block_len, !(offset_in_block == 0 && n == block_len))?;
+            cache.slot_data(slot)[offset_in_block..offset_in_block+n].copy_from_slice(&data[done..done+n]);
+            if let Some(e) = &mut cache.entries[slot] { e.dirty = true; }
+            done += n;
+        }
+        Ok(done)
+    }
+
+    fn get_size(&self) -> usize {
+        self.size
+    }
+
+    fn prefetch(&self, offset: usize, len: usize) {
+        if offset >= self.size || len == 0 { return; }
+        let len = core::cmp::min(len, self.size - offset);
+        let first_block = offset/CACHE_BLOCK_SIZE;
+        let last_block = (offset+len-1)/CACHE_BLOCK_SIZE;
+        BLOCK_CACHE.lock().prefetch(self.id, self.size, first_block as u64, last_block-first_block+1);
+    }
+}
@@ -1,11 +1,92 @@
-use crate::framebuffer::{FrameBuffer, Pixel};
+use alloc::{vec, vec::Vec};
+
+use crate::{framebuffer::{FrameBuffer, Pixel}, primitives::Mutex};
 
 pub trait CharDevice{
     fn get_rows(&self) -> usize;
     fn get_cols(&self) -> usize;
     fn write_char(&mut self, x: usize, y: usize, c: char, color: Pixel) -> Option<()>;
+
+    /// Writes s starting at (x, y) going right, stops at the end of the line, returns how many chars fit
+    fn write_str(&mut self, x: usize, y: usize, s: &str, color: Pixel) -> usize{
+        let mut written = 0;
+        for (i, c) in s.chars().enumerate(){
+            if x+i >= self.get_cols() { break; }
+            self.write_char(x+i, y, c, color);
+            written += 1;
+        }
+        written
+    }
+}
+
+const GLYPH_WIDTH: usize = 8;
+const GLYPH_HEIGHT: usize = 16;
+const GLYPH_PIXELS: usize = GLYPH_WIDTH*GLYPH_HEIGHT;
+const GLYPH_COUNT: usize = 128; // Just ascii
+// NOTE: The terminal only uses a couple of color pairs, so past this many the oldest pair just gets thrown away
+const MAX_GLYPH_SETS: usize = 4;
+
+/// Every ascii glyph for one (fg, bg) pair, in native pixels, expanded the first time it's drawn
+struct GlyphSet{
+    fg: u32,
+    bg: u32,
+    expanded: u128, // Bit n is set once glyph n is in glyphs
+    glyphs: Vec<[u32; GLYPH_PIXELS]> // GLYPH_COUNT of them
+}
+
+impl GlyphSet{
+    fn new(fg: u32, bg: u32) -> Self{
+        // NOTE: vec! so the 64 kb don't go through the stack first
+        Self{ fg, bg, expanded: 0, glyphs: vec![[0; GLYPH_PIXELS]; GLYPH_COUNT] }
+    }
+
+    fn get(&mut self, c: u8) -> &[u32; GLYPH_PIXELS]{
+        let c = c as usize;
+        if self.expanded & (1 << c) == 0 {
+            let glyph = &mut self.glyphs[c];
+            for i in 0..GLYPH_HEIGHT{
+                let line = FONT_8X16[c * GLYPH_HEIGHT + i];
+                for j in 0..GLYPH_WIDTH{
+                    glyph[i*GLYPH_WIDTH + j] = if line & (1 << (7-j)) != 0 { self.fg } else { self.bg };
+                }
+            }
+            self.expanded |= 1 << c;
+        }
+        &self.glyphs[c]
+    }
+}
+
+pub struct GlyphCache{
+    sets: Vec<GlyphSet>
 }
 
+impl core::fmt::Debug for GlyphCache{
+    fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
+        f.debug_struct("GlyphCache").field("sets", &self.sets.len()).finish()
+    }
+}
+
+impl GlyphCache{
+    pub const fn new() -> Self{
+        Self{ sets: Vec::new() }
+    }
+
+    fn get_set(&mut self, fg: u32, bg: u32) -> &mut GlyphSet{
+        let ind = match self.sets.iter().position(|set| set.fg == fg && set.bg == bg){
+            Some(ind) => ind,
+            None => {
+                if self.sets.len() >= MAX_GLYPH_SETS { self.sets.remove(0); }
+                self.sets.push(GlyphSet::new(fg, bg));
+                self.sets.len()-1
+            }
+        };
+        &mut self.sets[ind]
+    }
+}
+
+// NOTE: Keyed by native pixel values, which is fine as long as there is only one kind of framebuffer at a time
+pub static GLYPH_CACHE: Mutex<GlyphCache> = Mutex::from(GlyphCache::new());
+
 const FONT_8X16: [u8; 4096] = [
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
     0x00, 0x00, 0x00, 0x7E, 0x81, 0xA5, 0x81, 0x81, 0xBD, 0x99, 0x81, 0x81, 0x7E, 0x00, 0x00,
@@ -285,23 +366,29 @@ const FONT_8X16: [u8; 4096] = [
 
 impl CharDevice for &mut dyn FrameBuffer{
     fn write_char(&mut self, x: usize, y: usize, c: char, color: Pixel) -> Option<()>{
+        trace_span!(WriteChar, 1);
         if !c.is_ascii() { return None }
-        let c = c as u8;
-        let x = x*8;
-        let y = y*16;
-        for i in y..y+16{
-            let line = FONT_8X16[c as usize * 16 + (i-y)];
-            for j in x..x+8{
-                if line & (1 << (7-(j-x))) != 0 {
-                    self.set_pixel(j, i, color);
-                }else{
-                   self.set_pixel(j, i, Pixel{r: 0, g: 0, b: 0});
-                }
-            }
-        }
+        let (fg, bg) = (self.to_native(color), self.to_native(Pixel{r: 0, g: 0, b: 0}));
+        let mut cache = GLYPH_CACHE.lock();
+        self.blit(x*GLYPH_WIDTH, y*GLYPH_HEIGHT, GLYPH_WIDTH, GLYPH_HEIGHT, cache.get_set(fg, bg).get(c as u8), GLYPH_WIDTH);
         Some(())
     }
 
+    fn write_str(&mut self, x: usize, y: usize, s: &str, color: Pixel) -> usize{
+        trace_span!(WriteStr, s.len());
+        // Colors get converted and the cache locked once for the whole string
+        let (fg, bg) = (self.to_native(color), self.to_native(Pixel{r: 0, g: 0, b: 0}));
+        let mut cache = GLYPH_CACHE.lock();
+        let set = cache.get_set(fg, bg);
+        let mut written = 0;
+        for (i, c) in s.chars().enumerate(){
+            if x+i >= self.get_cols() { break; }
+            if c.is_ascii() { self.blit((x+i)*GLYPH_WIDTH, y*GLYPH_HEIGHT, GLYPH_WIDTH, GLYPH_HEIGHT, set.get(c as u8), GLYPH_WIDTH); }
+            written += 1;
+        }
+        written
+    }
+
     fn get_rows(&self) -> usize {
         self.get_height()/16
     }
@@ -0,0 +1,91 @@
+use core::cell::RefCell;
+
+use alloc::{rc::Rc, string::String, vec::Vec, borrow::ToOwned};
+
+use crate::{primitives::{Mutex, LazyInitialised}, vfs::{IFolder, Node}};
+
+const BUCKET_COUNT: usize = 64;
+// NOTE: Past this many cached names we just throw everything away, that's way simpler than tracking what is least recently used
+pub const MAX_ENTRIES: usize = 256;
+
+pub static DENTRY_CACHE: Mutex<LazyInitialised<DentryCache>> = Mutex::from(LazyInitialised::uninit());
+
+struct Dentry{
+    parent_id: usize,
+    // NOTE: Holding on to the parent means it's address can't get reused by some other folder while this entry exists
+    _parent: Rc<RefCell<dyn IFolder>>,
+    name: String,
+    node: Option<Node> // None is a negative entry, a.k.a we already looked and there's nothing with that name
+}
+
+/// Caches (parent folder, name) -> Node so walking a path doesn't have to ask every folder on the way
+/// NOTE: Anything that changes what a folder contains (mounting, making or removing folders, creating files) has to call invalidate()
+pub struct DentryCache{
+    buckets: Vec<Vec<Dentry>>,
+    entries: usize,
+    hits: usize,
+    misses: usize
+}
+
+impl core::fmt::Debug for DentryCache{
+    fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
+        f.debug_struct("DentryCache").field("entries", &self.entries).field("hits", &self.hits).field("misses", &self.misses).finish()
+    }
+}
+
+// FNV-1a
+fn hash(parent: usize, name: &str) -> usize{
+    let mut h: u64 = 0xcbf29ce484222325;
+    for b in parent.to_le_bytes().iter().chain(name.as_bytes()){
+        h ^= *b as u64;
+        h = h.wrapping_mul(0x100000001b3);
+    }
+    h as usize
+}
+
+fn folder_id(folder: &Rc<RefCell<dyn IFolder>>) -> usize{
+    Rc::as_ptr(folder) as *const () as usize
+}
+
+impl DentryCache{
+    pub fn new() -> Self{
+        let mut buckets = Vec::with_capacity(BUCKET_COUNT);
+        for _ in 0..BUCKET_COUNT { buckets.push(Vec::new()); }
+        Self{ buckets, entries: 0, hits: 0, misses: 0 }
+    }
+
+    /// Outer None means not cached, inner None means cached as not existing
+    fn get(&mut self, parent: usize, name: &str) -> Option<Option<Node>>{
+        let res = self.buckets[hash(parent, name)%BUCKET_COUNT].iter().find(|d| d.parent_id == parent && d.name == name).map(|d| d.node.clone());
+        if res.is_some() { self.hits += 1; } else { self.misses += 1; }
+        res
+    }
+
+    fn insert(&mut self, parent: &Rc<RefCell<dyn IFolder>>, name: &str, node: Option<Node>){
+        if self.entries >= MAX_ENTRIES { self.invalidate(); }
+        let parent_id = folder_id(parent);
+        self.buckets[hash(parent_id, name)%BUCKET_COUNT].push(Dentry{parent_id, _parent: parent.clone(), name: name.to_owned(), node});
+        self.entries += 1;
+    }
+
+    pub fn invalidate(&mut self){
+        for b in &mut self.buckets { b.clear(); }
+        self.entries = 0;
+    }
+
+    pub fn get_stats(&self) -> (usize, usize, usize) { (self.hits, self.misses, self.entries) }
+}
+
+/// Resolves one path component, asking the folder only if the answer isn't cached already
+pub fn lookup(folder: &Rc<RefCell<dyn IFolder>>, name: &str) -> Option<Node>{
+    let id = folder_id(folder);
+    if let Some(cached) = DENTRY_CACHE.lock().get(id, name) { return cached; }
+    // NOTE: Don't hold the lock while the folder does it's thing, it might be slow and it might end up wanting the cache too
+    let res = (**folder).borrow().lookup(name);
+    DENTRY_CACHE.lock().insert(folder, name, res.clone());
+    res
+}
+
+pub fn invalidate(){
+    DENTRY_CACHE.lock().invalidate();
+}
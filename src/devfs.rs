@@ -2,7 +2,7 @@ use core::cell::RefCell;
 
 use alloc::{vec::Vec, string::String, rc::Rc};
 
-use crate::vfs::{self, IFile, Node};
+use crate::{vfs::{self, IFile, Node}, dcache};
 
 pub struct DevFS{
   disk_devices: Vec<(String, Rc<RefCell<dyn IFile>>)>
@@ -16,7 +16,8 @@ impl DevFS{
   }
 
   pub fn add_device_file(&mut self, dev: Rc<RefCell<dyn IFile>>, name: String) {
-    self.disk_devices.push((name, dev))
+    self.disk_devices.push((name, dev));
+    dcache::invalidate();
   }
 }
 
@@ -28,4 +29,8 @@ impl vfs::IFolder for DevFS{
        }
        v
     }
+
+    fn lookup(&self, name: &str) -> Option<Node> {
+       self.disk_devices.iter().find(|c| c.0 == name).map(|c| Node::File(c.1.clone()))
+    }
 }
\ No newline at end of file
@@ -0,0 +1,138 @@
+use core::{cell::RefCell, ptr};
+
+use alloc::{rc::Rc, vec::Vec};
+
+use crate::{vfs::IFile, mmap::{self, MAPPINGS}, virtmem::{PAGE_SIZE, HUGE_PAGE_SIZE}, primitives::read_tsc};
+
+const ELF_MAGIC: [u8; 4] = [0x7F, b'E', b'L', b'F'];
+const ELF_CLASS_64: u8 = 2;
+const ELF_DATA_LITTLE_ENDIAN: u8 = 1;
+const ELF_VERSION_CURRENT: u32 = 1;
+const ELF_MACHINE_X86_64: u16 = 0x3E;
+const ELF_TYPE_DYN: u16 = 3;
+const PT_LOAD: u32 = 1;
+const PF_W: u32 = 1 << 1;
+const MAX_PROGRAM_HEADERS: usize = 64;
+
+#[derive(Debug, Clone)]
+#[repr(packed)]
+pub struct Elf64Header {
+    ident: [u8; 16],
+    kind: u16,
+    machine: u16,
+    version: u32,
+    entry: u64,
+    program_header_offset: u64,
+    // Sections don't matter for loading
+    _section_header_offset: u64,
+    _flags: u32,
+    header_size: u16,
+    program_header_size: u16,
+    no_of_program_headers: u16,
+    _section_header_size: u16,
+    _no_of_section_headers: u16,
+    _section_names_index: u16
+}
+
+#[derive(Debug, Clone)]
+#[repr(packed)]
+pub struct Elf64ProgramHeader {
+    kind: u32,
+    flags: u32,
+    offset: u64,
+    vaddr: u64,
+    _paddr: u64, // Nothing to do with where it ends up for us
+    file_size: u64,
+    mem_size: u64,
+    align: u64
+}
+
+/// An executable that's mapped in and ready to be jumped to
+#[derive(Debug)]
+pub struct LoadedElf {
+    pub base: usize, // What was added to every address in the file
+    pub entry: usize,
+    segments: Vec<*mut u8>,
+    pub cycles_to_entry: u64, // From opening the headers to the entry point's page being in memory
+    pub pages_faulted: usize
+}
+
+impl LoadedElf {
+    pub fn get_segment_count(&self) -> usize { self.segments.len() }
+
+    pub fn unload(self) {
+        for segment in self.segments { mmap::munmap(segment); }
+    }
+}
+
+fn read_header<T>(file: &dyn IFile, offset: usize) -> Option<T> {
+    let mut raw = [0u8; 64];
+    let size = core::mem::size_of::<T>();
+    if size > raw.len() || file.read_into(offset, &mut raw[..size]) != Ok(size) { return None; }
+    Some(unsafe { ptr::read_unaligned(raw.as_ptr() as *const T) })
+}
+
+/// Maps the PT_LOAD segments of an elf64 executable, nothing but the headers is read up front
+/// Read only segments map the file's shared pages, writable ones get private copies, and bss is zero pages made on the first touch
+/// NOTE: Everything shares the kernel's identity mapped address space, so only position independent executables ( ET_DYN ) can be put somewhere free,
+/// and relocations are left to the executable ( static-pie does that itself )
+pub fn load(file: Rc<RefCell<dyn IFile>>) -> Option<LoadedElf> {
+    let start = read_tsc();
+    let (faults_before, _) = MAPPINGS.lock().get_fault_stats();
+
+    let (header, program_headers) = {
+        let f = (*file).borrow();
+        let header: Elf64Header = read_header(&*f, 0)?;
+        if header.ident[..4] != ELF_MAGIC || header.ident[4] != ELF_CLASS_64 || header.ident[5] != ELF_DATA_LITTLE_ENDIAN { return None; }
+        let (kind, machine, version) = (header.kind, header.machine, header.version);
+        if machine != ELF_MACHINE_X86_64 || kind != ELF_TYPE_DYN || version != ELF_VERSION_CURRENT { return None; }
+        if header.header_size as usize != core::mem::size_of::<Elf64Header>() { return None; }
+        if header.program_header_size as usize != core::mem::size_of::<Elf64ProgramHeader>() || header.no_of_program_headers as usize > MAX_PROGRAM_HEADERS { return None; }
+        let mut program_headers = Vec::with_capacity(header.no_of_program_headers as usize);
+        for i in 0..header.no_of_program_headers as usize {
+            let ph: Elf64ProgramHeader = read_header(&*f, header.program_header_offset as usize + i*core::mem::size_of::<Elf64ProgramHeader>())?;
+            let (kind, offset, vaddr, file_size, mem_size, align) = (ph.kind, ph.offset, ph.vaddr, ph.file_size, ph.mem_size, ph.align);
+            if kind != PT_LOAD || mem_size == 0 { continue; }
+            if align > 1 && (!align.is_power_of_two() || align > HUGE_PAGE_SIZE as u64 || offset % align != vaddr % align) { return None; }
+            if file_size > mem_size || vaddr.checked_add(mem_size).is_none() || offset % PAGE_SIZE as u64 != vaddr % PAGE_SIZE as u64 { return None; }
+            if offset.checked_add(file_size)? > f.get_size() as u64 { return None; }
+            program_headers.push(ph);
+        }
+        (header, program_headers)
+    };
+    if program_headers.is_empty() { return None; }
+
+    // The whole image goes in one reservation so the segments stay where they are relative to each other
+    let lowest = program_headers.iter().map(|ph| ph.vaddr as usize).min()? / PAGE_SIZE * PAGE_SIZE;
+    // Reservations start 2 mb aligned, so base keeps every segment's alignment as long as lowest has it too
+    let max_align = program_headers.iter().map(|ph| ph.align as usize).max()?;
+    if max_align > 1 && lowest % max_align != 0 { return None; }
+    let highest = program_headers.iter().map(|ph| (ph.vaddr + ph.mem_size) as usize).max()?;
+    let base = mmap::reserve(highest - lowest) - lowest;
+
+    let mut segments = Vec::with_capacity(program_headers.len());
+    for ph in program_headers.iter() {
+        let padding = ph.vaddr as usize % PAGE_SIZE;
+        let virt = base + ph.vaddr as usize - padding;
+        let writable = ph.flags & PF_W != 0;
+        let mapped = mmap::mmap_at(virt, file.clone(), ph.offset as usize - padding, ph.file_size as usize + padding, ph.mem_size as usize + padding, writable, writable);
+        if let Some(segment) = mapped {
+            segments.push(segment);
+        } else {
+            // Segments sharing a page end up here too
+            for segment in segments { mmap::munmap(segment); }
+            return None;
+        }
+    }
+
+    let entry = base + header.entry as usize;
+    if !program_headers.iter().any(|ph| entry >= base + ph.vaddr as usize && entry < base + (ph.vaddr + ph.mem_size) as usize) {
+        for segment in segments { mmap::munmap(segment); }
+        return None;
+    }
+    // Fetching the first instruction is what jumping there would fault in first
+    unsafe { ptr::read_volatile(entry as *const u8); }
+
+    let (faults_after, _) = MAPPINGS.lock().get_fault_stats();
+    Some(LoadedElf { base, entry, segments, cycles_to_entry: read_tsc() - start, pages_faulted: faults_after - faults_before })
+}
@@ -0,0 +1,147 @@
+use core::{cell::UnsafeCell, future::Future, pin::Pin, sync::atomic::{AtomicU64, AtomicU8, Ordering}, task::{Context, Poll, RawWaker, RawWakerVTable, Waker}};
+
+use alloc::{boxed::Box, vec::Vec};
+
+use crate::{primitives::disable_interrupts, ring_buffer::SpscRing};
+
+// NOTE: One bit per task in WOKEN, so waking is a single atomic or and is fine to do from an irq handler
+pub const MAX_TASKS: usize = 64;
+
+static WOKEN: AtomicU64 = AtomicU64::new(0);
+
+fn wake_task(id: usize) {
+    WOKEN.fetch_or(1 << id, Ordering::Release);
+}
+
+// The waker's data is just the task id, so there is nothing to clone or drop
+unsafe fn waker_clone(data: *const ()) -> RawWaker { RawWaker::new(data, &WAKER_VTABLE) }
+unsafe fn waker_wake(data: *const ()) { wake_task(data as usize); }
+unsafe fn waker_drop(_data: *const ()) {}
+static WAKER_VTABLE: RawWakerVTable = RawWakerVTable::new(waker_clone, waker_wake, waker_wake, waker_drop);
+
+fn task_waker(id: usize) -> Waker {
+    unsafe { Waker::from_raw(RawWaker::new(id as *const (), &WAKER_VTABLE)) }
+}
+
+// IrqWaker states, WAKING can be set on top of REGISTERING
+const WAITING: u8 = 0;
+const REGISTERING: u8 = 1;
+const WAKING: u8 = 2;
+
+/// Lets an irq handler wake whichever task is waiting on it, without locking anything
+/// The state says who gets to touch the waker, so wake() from an irq that came in during register() never sees half a waker
+/// NOTE: Only one task can wait on it at a time, a second register() replaces the first
+/// NOTE: wake() drops the waker in the irq handler, that's fine for ours since dropping them does nothing
+pub struct IrqWaker {
+    state: AtomicU8,
+    waker: UnsafeCell<Option<Waker>>
+}
+
+// NOTE: The waker is only ever touched by whoever moved state away from WAITING
+unsafe impl Sync for IrqWaker {}
+
+impl IrqWaker {
+    pub const fn new() -> Self {
+        Self { state: AtomicU8::new(WAITING), waker: UnsafeCell::new(None) }
+    }
+
+    /// Remembers the waker of the task being polled, so the next wake() wakes it
+    pub fn register(&self, cx: &Context) {
+        match self.state.compare_exchange(WAITING, REGISTERING, Ordering::Acquire, Ordering::Acquire) {
+            Ok(_) => {
+                let slot = unsafe { &mut *self.waker.get() };
+                if !slot.as_ref().map_or(false, |w| w.will_wake(cx.waker())) { *slot = Some(cx.waker().clone()); }
+                if self.state.compare_exchange(REGISTERING, WAITING, Ordering::AcqRel, Ordering::Acquire).is_err() {
+                    // wake() came in while we were at it and left the waking to us
+                    let waker = slot.take();
+                    self.state.store(WAITING, Ordering::Release);
+                    if let Some(waker) = waker { waker.wake(); }
+                }
+            },
+            // An irq is waking right now, it might have missed the new waker so just poll again
+            Err(_) => cx.waker().wake_by_ref()
+        }
+    }
+
+    pub fn wake(&self) {
+        if self.state.fetch_or(WAKING, Ordering::AcqRel) != WAITING { return; } // register() will see WAKING and do it
+        let waker = unsafe { (*self.waker.get()).take() };
+        self.state.fetch_and(!WAKING, Ordering::Release);
+        if let Some(waker) = waker { waker.wake(); }
+    }
+}
+
+/// Completes with the next value an irq handler puts in ring, the handler has to call waker.wake() after pushing
+pub struct RingFuture<'a, T: Copy, const N: usize> {
+    ring: &'a SpscRing<T, N>,
+    waker: &'a IrqWaker
+}
+
+impl<'a, T: Copy, const N: usize> RingFuture<'a, T, N> {
+    pub fn new(ring: &'a SpscRing<T, N>, waker: &'a IrqWaker) -> Self {
+        Self { ring, waker }
+    }
+}
+
+impl<'a, T: Copy, const N: usize> Future for RingFuture<'a, T, N> {
+    type Output = T;
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<T> {
+        if let Some(val) = self.ring.pop() { return Poll::Ready(val); }
+        self.waker.register(cx);
+        // Check again, the irq might have come in between popping and registering
+        match self.ring.pop() {
+            Some(val) => Poll::Ready(val),
+            None => Poll::Pending
+        }
+    }
+}
+
+/// Single core cooperative executor, tasks run until they await something that isn't ready
+/// When nothing is woken the cpu sleeps until the next interrupt
+pub struct Executor {
+    tasks: Vec<Option<Pin<Box<dyn Future<Output = ()>>>>>
+}
+
+impl Executor {
+    pub fn new() -> Self {
+        Self { tasks: Vec::new() }
+    }
+
+    /// Returns None if there are already MAX_TASKS tasks
+    pub fn spawn(&mut self, fut: impl Future<Output = ()> + 'static) -> Option<usize> {
+        let id = match self.tasks.iter().position(|t| t.is_none()) {
+            Some(id) => id,
+            None if self.tasks.len() < MAX_TASKS => { self.tasks.push(None); self.tasks.len()-1 },
+            None => return None
+        };
+        self.tasks[id] = Some(Box::pin(fut));
+        wake_task(id); // Every task gets polled at least once
+        Some(id)
+    }
+
+    /// Runs until every task is done
+    /// NOTE: Everything a task can wait on is woken from an irq, so this turns interrupts on even if they were off when it was called
+    pub fn run(&mut self) {
+        while self.tasks.iter().any(|t| t.is_some()) {
+            let woken = WOKEN.swap(0, Ordering::Acquire);
+            if woken == 0 {
+                // NOTE: Check with interrupts off, then sti; hlt, so a wake from an irq can't slip in between
+                disable_interrupts();
+                if WOKEN.load(Ordering::Acquire) == 0 {
+                    unsafe { core::arch::asm!("sti", "hlt", options(nomem, nostack)); }
+                } else {
+                    unsafe { core::arch::asm!("sti", options(nomem, nostack)); }
+                }
+                continue;
+            }
+            for id in 0..self.tasks.len() {
+                if woken & (1 << id) == 0 { continue; }
+                if let Some(task) = &mut self.tasks[id] {
+                    let waker = task_waker(id);
+                    let mut cx = Context::from_waker(&waker);
+                    if task.as_mut().poll(&mut cx).is_ready() { self.tasks[id] = None; }
+                }
+            }
+        }
+    }
+}
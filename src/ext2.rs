@@ -1,8 +1,8 @@
-use core::{cell::RefCell, str::from_utf8};
+use core::{cell::RefCell, str::from_utf8, ptr};
 
-use alloc::{rc::Rc, vec::Vec, borrow::ToOwned};
+use alloc::{rc::{Rc, Weak}, vec::Vec, vec, borrow::ToOwned, string::String};
 
-use crate::{vfs::{IFile, self, IFolder}, UART};
+use crate::{vfs::{IFile, self, IFolder}, dcache, mmap, arena::{Arena, ArenaVec, ArenaString}};
 
 
 #[derive(Debug, Clone)]
@@ -105,116 +105,524 @@ pub struct Ext2DirectoryEntry {
     entry_type: u8
 }
 
-impl Ext2RawInode{
-    pub fn read_raw_block(&self, mut block_number: usize, fs: &Ext2FS) -> Option<Vec<u8>> {
+/// A run of blocks which are next to each other both in the file and on disk
+#[derive(Debug, Clone, Copy)]
+struct BlockRun{
+    logical_start: usize,
+    physical_start: u32, // 0 means the whole run is a hole
+    len: usize
+}
+
+/// Per open file cache of logical -> physical block mappings, built lazily as the file is read
+pub struct BlockMap{
+    runs: Vec<BlockRun>, // Sorted, covers logical blocks 0..mapped_blocks with no gaps
+    mapped_blocks: usize,
+    // The pointer block last used at each level of indirection, index 0 holds pointers to data blocks
+    pointer_blocks: [Option<(u32, Vec<u32>)>; 3]
+}
+
+impl BlockMap{
+    pub fn new() -> Self{
+        Self{ runs: Vec::new(), mapped_blocks: 0, pointer_blocks: [None, None, None] }
+    }
+
+    fn read_pointer(&mut self, level: usize, block: u32, index: usize, fs: &Ext2FS) -> Option<u32>{
+        // NOTE: 0 is used in block pointers in inodes to denote invalid/unused pointers to blocks, so everything under it is a hole too
+        if block == 0 { return Some(0); }
+        let is_cached = matches!(&self.pointer_blocks[level], Some((addr, _)) if *addr == block);
+        if !is_cached {
+            let raw = fs.read_block(block)?;
+            let pointers = raw.chunks_exact(core::mem::size_of::<u32>()).map(|c| u32::from_le_bytes([c[0], c[1], c[2], c[3]])).collect();
+            self.pointer_blocks[level] = Some((block, pointers));
+        }
+        self.pointer_blocks[level].as_ref().and_then(|(_, pointers)| pointers.get(index).copied())
+    }
+
+    /// Resolves the index of a block in the file to the address of the block on disk, 0 means the block is a hole (sparse file)
+    fn resolve(&mut self, inode: &Ext2RawInode, mut block_index: usize, fs: &Ext2FS) -> Option<u32>{
         // TODO: Test all posibilites of this function!!!
         // Direct data
-        if block_number <= 11 {
-            return fs.read_block(self.direct_block_pointers[block_number]);
+        if block_index <= 11 {
+            return Some(inode.direct_block_pointers[block_index]);
         }
 
         let pointers_per_block = fs.get_block_size() as usize/core::mem::size_of::<u32>();
         // Singly indirect data
-        block_number -= 12;
-        if block_number < pointers_per_block {
-            // direct_pointer_block is a block of tightly packed block pointers
-            let block_of_direct_pointers = fs.read_block(self.singly_indirect_block_pointer)?.as_ptr() as *const u32;
-            return fs.read_block(unsafe{*block_of_direct_pointers.add(block_number)});
+        block_index -= 12;
+        if block_index < pointers_per_block {
+            // singly_indirect_block_pointer points to a block of tightly packed block pointers
+            return self.read_pointer(0, inode.singly_indirect_block_pointer, block_index, fs);
         }
 
         // Doubly indirect data
-        block_number -= pointers_per_block;
-        if block_number < pointers_per_block*pointers_per_block{
-            let singly_indirect_block_index = block_number/pointers_per_block;
-            let direct_block_index = block_number%pointers_per_block;
-            let block_of_singly_indirect_pointers = fs.read_block(self.doubly_indirect_block_pointer)?.as_ptr() as *const u32;
-            let block_of_direct_pointers = fs.read_block(unsafe{*block_of_singly_indirect_pointers.add(singly_indirect_block_index)})?.as_ptr() as *const u32;
-            return fs.read_block(unsafe{*block_of_direct_pointers.add(direct_block_index)});
+        block_index -= pointers_per_block;
+        if block_index < pointers_per_block*pointers_per_block{
+            let singly_indirect_block_index = block_index/pointers_per_block;
+            let direct_block_index = block_index%pointers_per_block;
+            let block_of_direct_pointers = self.read_pointer(1, inode.doubly_indirect_block_pointer, singly_indirect_block_index, fs)?;
+            return self.read_pointer(0, block_of_direct_pointers, direct_block_index, fs);
         }
 
         // Triply indirect data
-        block_number -= pointers_per_block*pointers_per_block;
-        if block_number < pointers_per_block*pointers_per_block*pointers_per_block{
-            let doubly_indirect_block_index = block_number/(pointers_per_block*pointers_per_block);
-            let singly_indirect_block_index = (block_number%(pointers_per_block*pointers_per_block))/pointers_per_block;
-            let direct_block_index = (block_number%(pointers_per_block*pointers_per_block))%pointers_per_block;
-            let block_of_doubly_indirect_pointers = fs.read_block(self.triply_indirect_block_pointer)?.as_ptr() as *const u32;
-            let block_of_singly_indirect_pointers = fs.read_block(unsafe{*block_of_doubly_indirect_pointers.add(doubly_indirect_block_index)})?.as_ptr() as *const u32;
-            let block_of_direct_pointers = fs.read_block(unsafe{*block_of_singly_indirect_pointers.add(singly_indirect_block_index)})?.as_ptr() as *const u32;
-            return fs.read_block(unsafe{*block_of_direct_pointers.add(direct_block_index)});
+        block_index -= pointers_per_block*pointers_per_block;
+        if block_index < pointers_per_block*pointers_per_block*pointers_per_block{
+            let doubly_indirect_block_index = block_index/(pointers_per_block*pointers_per_block);
+            let singly_indirect_block_index = (block_index%(pointers_per_block*pointers_per_block))/pointers_per_block;
+            let direct_block_index = (block_index%(pointers_per_block*pointers_per_block))%pointers_per_block;
+            let block_of_singly_indirect_pointers = self.read_pointer(2, inode.triply_indirect_block_pointer, doubly_indirect_block_index, fs)?;
+            let block_of_direct_pointers = self.read_pointer(1, block_of_singly_indirect_pointers, singly_indirect_block_index, fs)?;
+            return self.read_pointer(0, block_of_direct_pointers, direct_block_index, fs);
         }
         None
     }
 
-    pub fn read_bytes(&self, offset: usize, len: usize, e2fs: &Ext2FS) -> Option<Vec<u8>> {
-        let starting_block_index = offset/(e2fs.get_block_size() as usize);
-        let starting_block_offset = offset%(e2fs.get_block_size() as usize);
-        let mut res: Vec<u8> = Vec::with_capacity(len);
-        let first_block = self.read_raw_block(starting_block_index, e2fs)?;
-        for e in &first_block[starting_block_offset..] { res.push(*e); }
-        let extra_block = if len%e2fs.get_block_size() as usize != 0 { 1 } else { 0 };
-        for block_ind in 1..(len/e2fs.get_block_size() as usize+extra_block) {
-            res.append(
-                &mut self.read_raw_block(starting_block_index+block_ind, e2fs)?
-            );
+    fn push(&mut self, physical: u32){
+        if let Some(last) = self.runs.last_mut(){
+            let continues_hole = last.physical_start == 0 && physical == 0;
+            let continues_run = last.physical_start != 0 && physical == last.physical_start + last.len as u32;
+            if continues_hole || continues_run {
+                last.len += 1;
+                self.mapped_blocks += 1;
+                return;
+            }
         }
+        self.runs.push(BlockRun{logical_start: self.mapped_blocks, physical_start: physical, len: 1});
+        self.mapped_blocks += 1;
+    }
 
-        while res.len() > len { res.pop(); }
-        Some(res)
+    /// Returns the physical address of the logical block ( 0 for holes ) and how many blocks, starting with it, are contiguous on disk
+    /// NOTE: Only looks wanted_blocks ahead, so the returned run length is at most that
+    pub fn lookup(&mut self, inode: &Ext2RawInode, logical: usize, wanted_blocks: usize, fs: &Ext2FS) -> Option<(u32, usize)>{
+        while self.mapped_blocks < logical+wanted_blocks{
+            let physical = self.resolve(inode, self.mapped_blocks, fs)?;
+            self.push(physical);
+        }
+        let run = self.runs[self.runs.partition_point(|r| r.logical_start + r.len <= logical)];
+        let offset_in_run = logical - run.logical_start;
+        let physical = if run.physical_start == 0 { 0 } else { run.physical_start + offset_in_run as u32 };
+        Some((physical, core::cmp::min(run.len - offset_in_run, wanted_blocks)))
     }
-    
-    pub fn as_vfs_node(self, fs: Rc<RefCell<Ext2FS>>) -> Option<vfs::Node> {
+}
+
+impl Ext2RawInode{
+    /// Reads straight into buf, returns how many bytes were read
+    /// NOTE: Does not care about the size of the inode, that's up to the caller
+    pub fn read_bytes_into(&self, offset: usize, buf: &mut [u8], e2fs: &Ext2FS, map: &mut BlockMap) -> Option<usize> {
+        let block_size = e2fs.get_block_size() as usize;
+        let mut done = 0;
+        while done < buf.len() {
+            let pos = offset + done;
+            let block_index = pos/block_size;
+            let offset_in_block = pos%block_size;
+            let wanted_blocks = (offset_in_block + buf.len() - done + block_size - 1)/block_size;
+            let (physical, run_len) = map.lookup(self, block_index, wanted_blocks, e2fs)?;
+            // Whole runs go to the device in one go
+            let n = core::cmp::min(run_len*block_size - offset_in_block, buf.len() - done);
+
+            if physical == 0 {
+                // Holes read as zeros
+                for b in &mut buf[done..done+n] { *b = 0; }
+            }else{
+                e2fs.read_into(physical as usize*block_size + offset_in_block, &mut buf[done..done+n])?;
+            }
+            done += n;
+        }
+        Some(done)
+    }
+
+    /// Writes data over blocks that are already allocated, holes are skipped so allocate before calling this
+    pub fn write_bytes_from(&self, offset: usize, data: &[u8], e2fs: &Ext2FS, map: &mut BlockMap) -> Option<usize> {
+        let block_size = e2fs.get_block_size() as usize;
+        let mut done = 0;
+        while done < data.len() {
+            let pos = offset + done;
+            let block_index = pos/block_size;
+            let offset_in_block = pos%block_size;
+            let wanted_blocks = (offset_in_block + data.len() - done + block_size - 1)/block_size;
+            let (physical, run_len) = map.lookup(self, block_index, wanted_blocks, e2fs)?;
+            let n = core::cmp::min(run_len*block_size - offset_in_block, data.len() - done);
+            if physical != 0 { e2fs.write_into(physical as usize*block_size + offset_in_block, &data[done..done+n])?; }
+            done += n;
+        }
+        Some(done)
+    }
+
+    /// Makes sure every block in [first_block, end_block) is backed by an allocated block
+    /// New blocks are allocated in runs right after the block before them so the file stays contiguous
+    /// keep_from..keep_to is about to be overwritten anyways so new blocks completely inside it aren't zeroed
+    /// Returns whether anything was allocated, if so map is stale
+    fn allocate_range(&mut self, inode_addr: u32, first_block: usize, end_block: usize, keep_from: usize, keep_to: usize, e2fs: &mut Ext2FS, map: &mut BlockMap) -> Result<bool, vfs::IOError> {
+        let block_size = e2fs.get_block_size() as usize;
+        // Start looking right after whatever comes before, or at the start of the group of the inode
+        let mut goal = e2fs.sb.superblock_block_number + ((inode_addr-1)/e2fs.sb.inodes_per_block_group)*e2fs.sb.blocks_per_block_group;
+        if first_block > 0 {
+            if let Some((physical, _)) = map.lookup(self, first_block-1, 1, e2fs) { if physical != 0 { goal = physical+1; } }
+        }
+
+        let mut allocated_any = false;
+        let mut zeros = Vec::new();
+        let mut logical = first_block;
+        while logical < end_block {
+            let (physical, run_len) = map.lookup(self, logical, end_block-logical, e2fs).ok_or(vfs::IOError::DeviceError)?;
+            if physical != 0 { goal = physical + run_len as u32; logical += run_len; continue; }
+
+            // A hole, fill it with as few runs as we can get
+            let hole_end = logical + run_len;
+            while logical < hole_end {
+                let (start, len) = e2fs.alloc_blocks(goal, hole_end-logical).ok_or(vfs::IOError::NoSpace)?;
+                for i in 0..len {
+                    e2fs.set_block_address(self, logical+i, start + i as u32).ok_or(vfs::IOError::DeviceError)?;
+                    let block_start = (logical+i)*block_size;
+                    if block_start < keep_from || block_start+block_size > keep_to {
+                        if zeros.len() == 0 { zeros = vec![0; block_size]; }
+                        e2fs.write_into((start as usize + i)*block_size, &zeros).ok_or(vfs::IOError::DeviceError)?;
+                    }
+                }
+                self.disk_sectors_used = self.disk_sectors_used + (len*block_size/512) as u32;
+                logical += len;
+                goal = start + len as u32;
+                allocated_any = true;
+            }
+        }
+        Ok(allocated_any)
+    }
+
+    /// Tells the device which blocks back [offset, offset+len), holes and unmappable blocks are skipped
+    pub fn prefetch_bytes(&self, offset: usize, len: usize, e2fs: &Ext2FS, map: &mut BlockMap) {
+        let block_size = e2fs.get_block_size() as usize;
+        let mut done = 0;
+        while done < len {
+            let pos = offset + done;
+            let block_index = pos/block_size;
+            let offset_in_block = pos%block_size;
+            let wanted_blocks = (offset_in_block + len - done + block_size - 1)/block_size;
+            let (physical, run_len) = if let Some(val) = map.lookup(self, block_index, wanted_blocks, e2fs) { val } else { return; };
+            let n = core::cmp::min(run_len*block_size - offset_in_block, len - done);
+            if physical != 0 { e2fs.prefetch(physical as usize*block_size + offset_in_block, n); }
+            done += n;
+        }
+    }
+
+    pub fn as_vfs_node(self, inode_addr: u32, fs: Rc<RefCell<Ext2FS>>) -> Option<vfs::Node> {
         if self.type_and_perm & 0xF000 == 0x4000 { 
-            return Some(vfs::Node::Folder(Rc::new(RefCell::new(Ext2Folder{inode: self, fs})) as Rc<RefCell<dyn IFolder>>));
+            let state = fs.borrow().open_inode(inode_addr, self);
+            return Some(vfs::Node::Folder(Rc::new(RefCell::new(Ext2Folder{state, inode_addr, fs})) as Rc<RefCell<dyn IFolder>>));
         }
         if self.type_and_perm & 0xF000 == 0x8000 {
-            return Some(vfs::Node::File(Rc::new(RefCell::new(Ext2File{inode: self, fs})) as Rc<RefCell<dyn IFile>>));
+            let state = fs.borrow().open_inode(inode_addr, self);
+            return Some(vfs::Node::File(Rc::new(RefCell::new(Ext2File{state, inode_addr, fs, readahead: RefCell::new(ReadAhead{next_offset: 0, window: 0, prefetched_up_to: 0})})) as Rc<RefCell<dyn IFile>>));
         }
         None
     }
 }
 
-pub struct Ext2File {
+// NOTE: In bytes, the block cache is only 128 kb big so we don't want one file hogging all of it
+const MIN_READAHEAD_WINDOW: usize = 8*1024;
+const MAX_READAHEAD_WINDOW: usize = 64*1024;
+
+/// Keeps track of whether a file is being read sequentially, and how far ahead of the reader we already prefetched
+struct ReadAhead{
+    next_offset: usize, // Where the next read starts if the reader is sequential
+    window: usize, // 0 if the reader isn't sequential
+    prefetched_up_to: usize
+}
+
+/// What every node for the same inode shares, so a second node for it ( the dentry cache makes those all the time ) never works off a stale copy
+pub struct InodeState{
     inode: Ext2RawInode,
+    block_map: BlockMap
+}
+
+pub struct Ext2File {
+    state: Rc<RefCell<InodeState>>,
+    inode_addr: u32,
     fs: Rc<RefCell<Ext2FS>>,
+    readahead: RefCell<ReadAhead>
+}
+
+impl Ext2File {
+    /// Grows the window while reads are sequential and prefetches ahead of the reader once less than half a window is left
+    fn update_readahead(&self, offset: usize, len: usize) {
+        let mut ra = self.readahead.borrow_mut();
+        if offset == ra.next_offset {
+            ra.window = if ra.window == 0 { MIN_READAHEAD_WINDOW } else { core::cmp::min(ra.window*2, MAX_READAHEAD_WINDOW) };
+        }else{
+            ra.window = 0;
+            ra.prefetched_up_to = 0;
+        }
+        let end = offset+len;
+        ra.next_offset = end;
+        if ra.window == 0 { return; }
+
+        let start = core::cmp::max(end, ra.prefetched_up_to);
+        if start - end >= ra.window/2 { return; }
+        let prefetch_end = core::cmp::min(end+ra.window, self.get_size());
+        if prefetch_end <= start { return; }
+        let state = &mut *self.state.borrow_mut();
+        state.inode.prefetch_bytes(start, prefetch_end-start, &*self.fs.borrow(), &mut state.block_map);
+        ra.prefetched_up_to = prefetch_end;
+    }
 }
 
 impl vfs::IFile for Ext2File{
-    fn read(&self, offset: usize, len: usize) -> Option<Vec<u8>> {
-        self.inode.read_bytes(offset, len, &*self.fs.borrow())
+    fn read_into(&self, offset: usize, buf: &mut [u8]) -> Result<usize, vfs::IOError> {
+        let size = self.get_size();
+        if offset > size { return Err(vfs::IOError::OutOfBounds); }
+        let len = core::cmp::min(buf.len(), size - offset);
+        let read = {
+            let state = &mut *self.state.borrow_mut();
+            state.inode.read_bytes_into(offset, &mut buf[..len], &*self.fs.borrow(), &mut state.block_map).ok_or(vfs::IOError::DeviceError)?
+        };
+        self.update_readahead(offset, read);
+        Ok(read)
     }
 
-    fn write(&mut self, offset: usize, data: &[u8]) {
-        todo!()
+    fn write_from(&mut self, offset: usize, data: &[u8]) -> Result<usize, vfs::IOError> {
+        let size = self.get_size();
+        if offset > size { return Err(vfs::IOError::OutOfBounds); }
+        if data.len() == 0 { return Ok(0); }
+        // NOTE: We only do the low 32 bits of the size
+        let end = offset + data.len();
+        if end > u32::MAX as usize { return Err(vfs::IOError::NoSpace); }
+
+        let mut fs = self.fs.borrow_mut();
+        if !fs.is_writable() { return Err(vfs::IOError::Unsupported); }
+        mmap::note_file_write();
+        let block_size = fs.get_block_size() as usize;
+        let state = &mut *self.state.borrow_mut();
+
+        let allocated = state.inode.allocate_range(self.inode_addr, offset/block_size, (end+block_size-1)/block_size, offset, end, &mut fs, &mut state.block_map)?;
+        if allocated { state.block_map = BlockMap::new(); }
+        let written = state.inode.write_bytes_from(offset, data, &fs, &mut state.block_map).ok_or(vfs::IOError::DeviceError)?;
+
+        if end > size { state.inode.low32_size = end as u32; }
+        if allocated || end > size { fs.write_inode(self.inode_addr, &state.inode).ok_or(vfs::IOError::DeviceError)?; }
+        fs.flush_metadata().ok_or(vfs::IOError::DeviceError)?;
+        Ok(written)
     }
 
     fn get_size(&self) -> usize {
-        self.inode.low32_size as usize
+        self.state.borrow().inode.low32_size as usize
+    }
+
+    fn get_id(&self) -> Option<(usize, usize)> {
+        Some((Rc::as_ptr(&self.fs) as usize, self.inode_addr as usize))
     }
 }
 
 pub struct Ext2Folder {
-    inode: Ext2RawInode, 
+    state: Rc<RefCell<InodeState>>,
+    inode_addr: u32,
     fs: Rc<RefCell<Ext2FS>>
 }
 
+/// What the directory entry itself says about a child, no inode has been read to get this
+pub struct Ext2DirEntry{
+    pub name: String,
+    pub inode_addr: u32
+}
+
+impl Ext2DirEntry{
+    /// Reads the inode and wraps it, only do this for entries you actually care about
+    pub fn into_node(self, fs: Rc<RefCell<Ext2FS>>) -> Option<vfs::Node>{
+        let inode = fs.borrow().get_inode(self.inode_addr)?;
+        inode.as_vfs_node(self.inode_addr, fs)
+    }
+}
+
+/// Walks a directory one block at a time
+/// NOTE: Directory entries never cross block boundaries, so one block worth of buffer is enough
+pub struct Ext2DirIter<'a>{
+    folder: &'a Ext2Folder,
+    block_buf: Vec<u8>,
+    block_offset: usize, // Offset in the directory file of the block in block_buf
+    offset_in_block: usize,
+    block_len: usize // 0 if nothing has been read into block_buf yet
+}
+
+impl<'a> Ext2DirIter<'a>{
+    /// Like next() but the name is left in the block buffer, so nothing has to be allocated for it
+    fn next_raw(&mut self) -> Option<(&str, u32, vfs::NodeKind)> {
+        let dir_size = self.folder.state.borrow().inode.low32_size as usize;
+        loop{
+            if self.offset_in_block + core::mem::size_of::<Ext2DirectoryEntry>() > self.block_len {
+                // Next block
+                if self.block_len != 0 { self.block_offset += self.block_buf.len(); }
+                if self.block_offset >= dir_size { return None; }
+                self.block_len = core::cmp::min(self.block_buf.len(), dir_size - self.block_offset);
+                self.offset_in_block = 0;
+                let fs = self.folder.fs.borrow();
+                let state = &mut *self.folder.state.borrow_mut();
+                state.inode.read_bytes_into(self.block_offset, &mut self.block_buf[..self.block_len], &*fs, &mut state.block_map)?;
+                continue;
+            }
+
+            let entry = unsafe{ ptr::read_unaligned(self.block_buf.as_ptr().add(self.offset_in_block) as *const Ext2DirectoryEntry) };
+            if entry.entry_size == 0 { return None; } // Corrupted, don't loop forever
+            let name_start = self.offset_in_block + core::mem::size_of::<Ext2DirectoryEntry>();
+            let name_end = name_start + entry.name_length_low8 as usize;
+            self.offset_in_block += entry.entry_size as usize;
+            // Unused entries have inode 0
+            if entry.inode_addr == 0 || name_end > self.block_len { continue; }
+
+            let kind = if !self.folder.fs.borrow().has_dir_entry_types() { vfs::NodeKind::Unknown } else {
+                match entry.entry_type { 1 => vfs::NodeKind::File, 2 => vfs::NodeKind::Folder, _ => vfs::NodeKind::Unknown }
+            };
+            // NOTE: Names are just bytes to ext2, the ones that aren't utf-8 can't be named by anything we have, so they're skipped
+            if from_utf8(&self.block_buf[name_start..name_end]).is_err() { continue; }
+            // NOTE: Checked just above, borrowing the name out of the if let would keep block_buf borrowed for the next block read
+            let name = unsafe{ core::str::from_utf8_unchecked(&self.block_buf[name_start..name_end]) };
+            return Some((name, entry.inode_addr, kind));
+        }
+    }
+}
+
+impl<'a> Iterator for Ext2DirIter<'a>{
+    type Item = Ext2DirEntry;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        self.next_raw().map(|(name, inode_addr, _)| Ext2DirEntry{name: name.to_owned(), inode_addr})
+    }
+}
+
+impl Ext2Folder {
+    /// Puts a new entry in the first gap big enough for it, or in a new block at the end of the folder
+    fn add_entry(&mut self, name: &str, inode_addr: u32, entry_type: u8, fs: &mut Ext2FS) -> Option<()>{
+        let block_size = fs.get_block_size() as usize;
+        // Entries are 4 byte aligned
+        let entry_len = |name_len: usize| (core::mem::size_of::<Ext2DirectoryEntry>() + name_len + 3) & !3;
+        let needed = entry_len(name.len());
+        let entry_type = if fs.has_dir_entry_types() { entry_type } else { 0 };
+        let state = &mut *self.state.borrow_mut();
+
+        let write_entry = |block: &mut [u8], at: usize, entry_size: usize| {
+            let entry = Ext2DirectoryEntry{inode_addr, entry_size: entry_size as u16, name_length_low8: name.len() as u8, entry_type};
+            unsafe{ ptr::write_unaligned(block.as_mut_ptr().add(at) as *mut Ext2DirectoryEntry, entry); }
+            let name_start = at + core::mem::size_of::<Ext2DirectoryEntry>();
+            block[name_start..name_start+name.len()].copy_from_slice(name.as_bytes());
+        };
+
+        let mut block = vec![0u8; block_size];
+        let dir_size = state.inode.low32_size as usize;
+        let mut block_offset = 0;
+        while block_offset < dir_size {
+            state.inode.read_bytes_into(block_offset, &mut block, fs, &mut state.block_map)?;
+            let mut cur = 0;
+            while cur + core::mem::size_of::<Ext2DirectoryEntry>() <= block_size {
+                let entry = unsafe{ ptr::read_unaligned(block.as_ptr().add(cur) as *const Ext2DirectoryEntry) };
+                let entry_size = entry.entry_size as usize;
+                if entry_size == 0 { break; }
+                // Unused entries can be taken whole, used ones only have their slack split off
+                let used = if entry.inode_addr == 0 { 0 } else { entry_len(entry.name_length_low8 as usize) };
+                if entry_size >= used + needed {
+                    if used == 0 {
+                        write_entry(&mut block, cur, entry_size);
+                    }else{
+                        let entry_data = unsafe{ &mut *(block.as_mut_ptr().add(cur) as *mut Ext2DirectoryEntry) };
+                        entry_data.entry_size = used as u16;
+                        write_entry(&mut block, cur+used, entry_size-used);
+                    }
+                    state.inode.write_bytes_from(block_offset, &block, fs, &mut state.block_map)?;
+                    return Some(());
+                }
+                cur += entry_size;
+            }
+            block_offset += block_size;
+        }
+
+        // No space anywhere, the folder grows by a block
+        for b in block.iter_mut() { *b = 0; }
+        write_entry(&mut block, 0, block_size);
+        state.inode.allocate_range(self.inode_addr, dir_size/block_size, dir_size/block_size+1, dir_size, dir_size+block_size, fs, &mut state.block_map).ok()?;
+        state.block_map = BlockMap::new();
+        state.inode.low32_size = (dir_size + block_size) as u32;
+        state.inode.write_bytes_from(dir_size, &block, fs, &mut state.block_map)?;
+        Some(())
+    }
+
+    /// Inode of the entry called name, without allocating anything for the entries that don't match
+    fn find_entry(&self, name: &str) -> Option<u32>{
+        let mut entries = self.read_dir();
+        while let Some((entry_name, inode_addr, _)) = entries.next_raw() {
+            if entry_name == name { return Some(inode_addr); }
+        }
+        None
+    }
+
+    pub fn read_dir(&self) -> Ext2DirIter<'_>{
+        Ext2DirIter{
+            folder: self,
+            block_buf: vec![0; self.fs.borrow().get_block_size() as usize],
+            block_offset: 0,
+            offset_in_block: 0,
+            block_len: 0
+        }
+    }
+}
+
 impl IFolder for Ext2Folder {
     fn get_children(&self) -> Vec<(alloc::string::String, vfs::Node)> {
-        let raw_data = self.inode.read_bytes(0, self.inode.low32_size as usize, &*self.fs.borrow());
-        let mut res = Vec::new();
-        if let Some(raw_data) = raw_data {
-            let mut cur_ind = 0;
-            while cur_ind < raw_data.len(){
-                let entry: &Ext2DirectoryEntry = unsafe{&*(raw_data.as_ptr().add(cur_ind) as *const Ext2DirectoryEntry)};
-                cur_ind += core::mem::size_of::<Ext2DirectoryEntry>();
-                let name: &str = from_utf8(&raw_data[cur_ind..cur_ind+entry.name_length_low8 as usize]).expect("Ext2 inode name in directory entry should be valid utf-8!");
-                cur_ind += entry.entry_size as usize-core::mem::size_of::<Ext2DirectoryEntry>();
-
-                let inode = self.fs.borrow().get_inode(entry.inode_addr).expect("Inode in directory entry should be valid!");
-                res.push((name.to_owned(), inode.as_vfs_node(self.fs.clone()).expect("Inodes should be parsable as vfs nodes!")))
+        // NOTE: Symlinks, devices and such have no vfs node, so they're left out
+        self.read_dir().filter_map(|e| {
+            let name = e.name.clone();
+            Some((name, e.into_node(self.fs.clone())?))
+        }).collect()
+    }
+
+    fn get_listing_in<'a>(&self, arena: &'a Arena) -> ArenaVec<'a, (ArenaString<'a>, vfs::NodeKind, Option<usize>)> {
+        let mut v = Vec::new_in(arena);
+        let mut entries = self.read_dir();
+        while let Some((name, inode_addr, kind)) = entries.next_raw() {
+            // NOTE: Folders don't need their inode, everything else does for the size ( and the kind, if the entry doesn't say )
+            if kind == vfs::NodeKind::Folder {
+                v.push((ArenaString::from_str_in(name, arena), kind, None));
+                continue;
             }
+            let inode = self.fs.borrow().get_inode(inode_addr);
+            let (kind, size) = match inode {
+                Some(inode) if inode.type_and_perm & 0xF000 == 0x4000 => (vfs::NodeKind::Folder, None),
+                Some(inode) if inode.type_and_perm & 0xF000 == 0x8000 => (vfs::NodeKind::File, Some(inode.low32_size as usize)),
+                _ => (kind, None)
+            };
+            v.push((ArenaString::from_str_in(name, arena), kind, size));
         }
-        res
+        v
+    }
+
+    fn lookup(&self, name: &str) -> Option<vfs::Node> {
+        // NOTE: Only the inode of the entry that matches gets read and wrapped
+        let inode_addr = self.find_entry(name)?;
+        let inode = self.fs.borrow().get_inode(inode_addr)?;
+        inode.as_vfs_node(inode_addr, self.fs.clone())
+    }
+
+    fn create_file(&mut self, name: &str) -> Option<vfs::Node> {
+        if name.len() == 0 || name.len() > 255 || name.contains('/') { return None; }
+        if self.find_entry(name).is_some() { return None; }
+        let fs_rc = self.fs.clone();
+        let mut fs = fs_rc.borrow_mut();
+        if !fs.is_writable() { return None; }
+
+        let group = ((self.inode_addr-1)/fs.sb.inodes_per_block_group) as usize;
+        let inode_addr = fs.alloc_inode(group, false)?;
+        let mut inode: Ext2RawInode = unsafe{ core::mem::zeroed() };
+        inode.type_and_perm = 0x8000 | 0o644;
+        inode.hard_links_to_inode = 1;
+        // NOTE: The on disk inode can be bigger than what we know about, the rest should be zeroes not whatever was there before
+        let inode_pos = fs.get_inode_position(inode_addr)?;
+        fs.write_into(inode_pos, &vec![0; fs.get_inode_size()])?;
+        fs.write_inode(inode_addr, &inode)?;
+
+        self.add_entry(name, inode_addr, 1, &mut fs)?;
+        // We don't keep the hashed index up to date
+        let mut state = self.state.borrow_mut();
+        state.inode.flags = state.inode.flags & !INODE_FLAG_INDEXED_DIR;
+        fs.write_inode(self.inode_addr, &state.inode)?;
+        drop(state);
+        fs.flush_metadata()?;
+        drop(fs);
+        dcache::invalidate();
+        inode.as_vfs_node(inode_addr, self.fs.clone())
     }
 }
 
@@ -222,73 +630,288 @@ pub struct Ext2FS{
     backing_device: Rc<RefCell<dyn IFile>>,
     pub sb: Ext2SuperBlock,
     pub extended_sb: Option<Ext2ExtendedSuperblock>,
+    // Read once on mount, the free counts in here are what the allocators look at to skip full groups
+    bgds: Vec<Ext2BlockGroupDescriptor>,
+    metadata_dirty: bool, // bgds or the free counts in sb changed and haven't been written back yet
+    // Every inode some node is open for, see open_inode
+    open_inodes: RefCell<Vec<(u32, Weak<RefCell<InodeState>>)>>
 }
 
+// Required features we know how to deal with, just the type byte in directory entries
+const SUPPORTED_REQUIRED_FEATURES: u32 = 0x2;
+// Features required for writing we know how to deal with, sparse superblocks and 64-bit file sizes (we never write them)
+const SUPPORTED_WRITE_FEATURES: u32 = 0x1 | 0x2;
+// Hashed directory index, we don't update the index so we have to clear this when adding entries
+const INODE_FLAG_INDEXED_DIR: u32 = 0x1000;
 
 // TODO: Proper deserialisation
-// TODO: Add support for writing
 
 impl Ext2FS{
     pub fn new(backing_dev: Rc<RefCell<dyn IFile>>) -> Option<Ext2FS>{
         // The Superblock is always located at byte 1024 from the beginning of the volume and is exactly 1024 bytes in length.
         // Source: https://wiki.osdev.org/Ext2#Locating_the_Superblock
 
-        let sb_data: Vec<u8> = backing_dev.borrow().read(1024, core::mem::size_of::<Ext2SuperBlock>())?;
-        let sb = unsafe{ &*(sb_data.as_ptr() as *const Ext2SuperBlock)}.clone();
+        let mut sb_data = [0u8; core::mem::size_of::<Ext2SuperBlock>()];
+        if backing_dev.borrow().read_into(1024, &mut sb_data).ok()? != sb_data.len() { return None; }
+        let sb = unsafe{ ptr::read_unaligned(sb_data.as_ptr() as *const Ext2SuperBlock) };
 
         let mut extended_sb = None;
         if sb.major_version >= 1{
-            let extended_sb_data: Vec<u8> = backing_dev.borrow().read(1024+core::mem::size_of::<Ext2SuperBlock>(), core::mem::size_of::<Ext2ExtendedSuperblock>())?;
-            let extended_sb_ptr = extended_sb_data.as_ptr() as *const Ext2ExtendedSuperblock;
-            extended_sb = Some(unsafe{&*extended_sb_ptr}.clone());
+            let mut extended_sb_data = [0u8; core::mem::size_of::<Ext2ExtendedSuperblock>()];
+            if backing_dev.borrow().read_into(1024+core::mem::size_of::<Ext2SuperBlock>(), &mut extended_sb_data).ok()? != extended_sb_data.len() { return None; }
+            extended_sb = Some(unsafe{ ptr::read_unaligned(extended_sb_data.as_ptr() as *const Ext2ExtendedSuperblock) });
         }
-        Some(Ext2FS{
+        if let Some(esb) = &extended_sb {
+            if esb.required_features & !SUPPORTED_REQUIRED_FEATURES != 0 { return None; }
+        }
+        if sb.blocks_per_block_group == 0 || sb.inodes_per_block_group == 0 { return None; }
+
+        let mut fs = Ext2FS{
             backing_device: backing_dev,
             sb: sb,
-            extended_sb: extended_sb
-        })
+            extended_sb: extended_sb,
+            bgds: Vec::new(),
+            metadata_dirty: false,
+            open_inodes: RefCell::new(Vec::new())
+        };
+
+        // The block group descriptor table is located in the block immediately following the Superblock.
+        // Source: https://wiki.osdev.org/Ext2#Block_Group_Descriptor_Table
+        let mut raw_table = vec![0u8; fs.get_block_group_count()*core::mem::size_of::<Ext2BlockGroupDescriptor>()];
+        fs.read_into(fs.get_block_group_table_addr(), &mut raw_table)?;
+        fs.bgds = raw_table.chunks_exact(core::mem::size_of::<Ext2BlockGroupDescriptor>()).map(|raw_descriptor| unsafe{ ptr::read_unaligned(raw_descriptor.as_ptr() as *const Ext2BlockGroupDescriptor) }).collect();
+        Some(fs)
     }
 
-    fn read(&self, addr: u32, size: usize) -> Option<Vec<u8>>{
-        (*self.backing_device).borrow().read(addr as usize, size)
+    pub fn get_block_group_count(&self) -> usize{
+        let blocks = (self.sb.no_of_blocks - self.sb.superblock_block_number) as usize;
+        let per_group = self.sb.blocks_per_block_group as usize;
+        (blocks + per_group - 1)/per_group
     }
 
-    pub fn read_block(&self, number: u32) -> Option<Vec<u8>>{
+    fn get_block_group_table_addr(&self) -> usize{
+        // NOTE: superblock_block_number is the block the superblock is in ( 1 for 1k blocks, 0 otherwise ), the table is in the one after it
+        (self.sb.superblock_block_number as usize + 1)*self.get_block_size() as usize
+    }
+
+    pub fn is_writable(&self) -> bool{
+        self.extended_sb.as_ref().map_or(true, |esb| esb.write_features & !SUPPORTED_WRITE_FEATURES == 0)
+    }
+
+    /// Writes all of data or fails
+    fn write_into(&self, addr: usize, data: &[u8]) -> Option<()>{
+        if (*self.backing_device).borrow_mut().write_from(addr, data).ok()? != data.len() { return None; }
+        Some(())
+    }
+
+    /// Writes the group descriptors and the free counts in the superblock back, if they changed
+    /// NOTE: This goes through the block cache like everything else, so calling it after every operation is cheap
+    pub fn flush_metadata(&mut self) -> Option<()>{
+        if !self.metadata_dirty { return Some(()); }
+        let mut raw_table = vec![0u8; self.bgds.len()*core::mem::size_of::<Ext2BlockGroupDescriptor>()];
+        for (i, descriptor) in self.bgds.iter().enumerate(){
+            unsafe{ ptr::write_unaligned(raw_table.as_mut_ptr().add(i*core::mem::size_of::<Ext2BlockGroupDescriptor>()) as *mut Ext2BlockGroupDescriptor, descriptor.clone()); }
+        }
+        self.write_into(self.get_block_group_table_addr(), &raw_table)?;
+        // unallocated_blocks and unallocated_inodes are at offset 12 and 16 in the superblock
+        self.write_into(1024+12, &self.sb.unallocated_blocks.to_le_bytes())?;
+        self.write_into(1024+16, &self.sb.unallocated_inodes.to_le_bytes())?;
+        self.metadata_dirty = false;
+        Some(())
+    }
+
+    /// Finds the first clear bit at or after start, wrapping around
+    fn find_clear_bit(bitmap: &[u8], start: usize, len: usize) -> Option<usize>{
+        (start..len).chain(0..start).find(|bit| bitmap[bit/8] & (1 << (bit%8)) == 0)
+    }
+
+    /// Allocates up to max contiguous blocks, as close after goal as possible, returns the first block and how many were allocated
+    pub fn alloc_blocks(&mut self, goal: u32, max: usize) -> Option<(u32, usize)>{
+        let first_data_block = self.sb.superblock_block_number;
+        let blocks_per_group = self.sb.blocks_per_block_group as usize;
+        let goal = if goal < first_data_block || goal >= self.sb.no_of_blocks { first_data_block } else { goal };
+        let goal_group = (goal - first_data_block) as usize/blocks_per_group;
+        let group_count = self.bgds.len();
+
+        for i in 0..group_count{
+            let group = (goal_group + i)%group_count;
+            if self.bgds[group].unallocated_blocks_in_group == 0 { continue; }
+            let blocks_in_group = core::cmp::min(blocks_per_group, (self.sb.no_of_blocks - first_data_block) as usize - group*blocks_per_group);
+            let start_bit = if i == 0 { (goal - first_data_block) as usize%blocks_per_group } else { 0 };
+
+            let bitmap_block = self.bgds[group].block_addr_for_block_usage_bitmap;
+            let mut bitmap = self.read_block(bitmap_block)?;
+            let first_bit = if let Some(bit) = Self::find_clear_bit(&bitmap, start_bit, blocks_in_group) { bit } else { continue; };
+            let mut len = 0;
+            while len < max && first_bit+len < blocks_in_group && bitmap[(first_bit+len)/8] & (1 << ((first_bit+len)%8)) == 0 {
+                bitmap[(first_bit+len)/8] |= 1 << ((first_bit+len)%8);
+                len += 1;
+            }
+            self.write_into(bitmap_block as usize*self.get_block_size() as usize, &bitmap)?;
+
+            self.bgds[group].unallocated_blocks_in_group -= len as u16;
+            self.sb.unallocated_blocks -= len as u32;
+            self.metadata_dirty = true;
+            return Some((first_data_block + (group*blocks_per_group + first_bit) as u32, len));
+        }
+        None
+    }
+
+    fn alloc_zeroed_block(&mut self, goal: u32) -> Option<u32>{
+        let (block, _) = self.alloc_blocks(goal, 1)?;
+        self.write_into(block as usize*self.get_block_size() as usize, &vec![0; self.get_block_size() as usize])?;
+        Some(block)
+    }
+
+    /// Allocates an inode, preferably in goal_group so it ends up close to it's parent folder
+    pub fn alloc_inode(&mut self, goal_group: usize, is_folder: bool) -> Option<u32>{
+        let inodes_per_group = self.sb.inodes_per_block_group as usize;
+        let first_usable_inode = self.extended_sb.as_ref().map_or(11, |esb| esb.first_non_reserved_inode_in_fs) as usize;
+        let group_count = self.bgds.len();
+
+        for i in 0..group_count{
+            let group = (goal_group + i)%group_count;
+            if self.bgds[group].unallocated_inodes_in_group == 0 { continue; }
+            let bitmap_block = self.bgds[group].block_addr_for_inode_usage_bitmap;
+            let mut bitmap = self.read_block(bitmap_block)?;
+            // Inode numbers start at 1
+            let start_bit = if group*inodes_per_group + 1 < first_usable_inode { first_usable_inode - 1 - group*inodes_per_group } else { 0 };
+            if start_bit >= inodes_per_group { continue; }
+            let bit = if let Some(bit) = (start_bit..inodes_per_group).find(|bit| bitmap[bit/8] & (1 << (bit%8)) == 0) { bit } else { continue; };
+            bitmap[bit/8] |= 1 << (bit%8);
+            self.write_into(bitmap_block as usize*self.get_block_size() as usize, &bitmap)?;
+
+            self.bgds[group].unallocated_inodes_in_group -= 1;
+            if is_folder { self.bgds[group].directories_in_group += 1; }
+            self.sb.unallocated_inodes -= 1;
+            self.metadata_dirty = true;
+            return Some((group*inodes_per_group + bit + 1) as u32);
+        }
+        None
+    }
+
+    /// Points the block_index'th block of the inode at physical, allocating indirect blocks on the way if needed
+    pub fn set_block_address(&mut self, inode: &mut Ext2RawInode, mut block_index: usize, physical: u32) -> Option<()>{
+        if block_index <= 11 {
+            let mut direct_block_pointers = inode.direct_block_pointers;
+            direct_block_pointers[block_index] = physical;
+            inode.direct_block_pointers = direct_block_pointers;
+            return Some(());
+        }
+
+        let block_size = self.get_block_size() as usize;
+        let pointers_per_block = block_size/core::mem::size_of::<u32>();
+        // Which level of indirection and which pointer to follow in every pointer block on the way
+        block_index -= 12;
+        let (levels, indices) = if block_index < pointers_per_block {
+            (1, [block_index, 0, 0])
+        }else if block_index - pointers_per_block < pointers_per_block*pointers_per_block {
+            block_index -= pointers_per_block;
+            (2, [block_index/pointers_per_block, block_index%pointers_per_block, 0])
+        }else{
+            block_index -= pointers_per_block + pointers_per_block*pointers_per_block;
+            if block_index >= pointers_per_block*pointers_per_block*pointers_per_block { return None; }
+            (3, [block_index/(pointers_per_block*pointers_per_block), (block_index%(pointers_per_block*pointers_per_block))/pointers_per_block, block_index%pointers_per_block])
+        };
+
+        let mut cur = match levels { 1 => inode.singly_indirect_block_pointer, 2 => inode.doubly_indirect_block_pointer, _ => inode.triply_indirect_block_pointer };
+        if cur == 0 {
+            cur = self.alloc_zeroed_block(physical)?;
+            inode.disk_sectors_used = inode.disk_sectors_used + (block_size/512) as u32;
+            match levels { 1 => inode.singly_indirect_block_pointer = cur, 2 => inode.doubly_indirect_block_pointer = cur, _ => inode.triply_indirect_block_pointer = cur };
+        }
+        for depth in 0..levels {
+            let pointer_addr = cur as usize*block_size + indices[depth]*core::mem::size_of::<u32>();
+            if depth == levels-1 {
+                self.write_into(pointer_addr, &physical.to_le_bytes())?;
+            }else{
+                let mut raw_pointer = [0u8; core::mem::size_of::<u32>()];
+                self.read_into(pointer_addr, &mut raw_pointer)?;
+                let mut next = u32::from_le_bytes(raw_pointer);
+                if next == 0 {
+                    next = self.alloc_zeroed_block(cur)?;
+                    inode.disk_sectors_used = inode.disk_sectors_used + (block_size/512) as u32;
+                    self.write_into(pointer_addr, &next.to_le_bytes())?;
+                }
+                cur = next;
+            }
+        }
+        Some(())
+    }
+
+    /// Fills all of buf or fails
+    fn read_into(&self, addr: usize, buf: &mut [u8]) -> Option<()>{
+        if (*self.backing_device).borrow().read_into(addr, buf).ok()? != buf.len() { return None; }
+        Some(())
+    }
+
+    pub fn prefetch(&self, addr: usize, len: usize){
+        (*self.backing_device).borrow().prefetch(addr, len)
+    }
+
+    pub fn read_block_into(&self, number: u32, buf: &mut [u8]) -> Option<()>{
         // NOTE: There should be no reason to read the first block, because it either unused ( 1024-bytes before the superblock ), or it just contains the superblock, but other than that it's unused
         // Also 0 is used in block pointers in inodes to denote invalid/unused pointers to blocks
         if number == 0 { return None; }
-        self.read(self.get_block_size()*number, self.get_block_size() as usize)  
+        let block_size = self.get_block_size() as usize;
+        trace_span!(Ext2ReadBlock, block_size);
+        self.read_into(number as usize*block_size, &mut buf[..block_size])
+    }
+
+    pub fn read_block(&self, number: u32) -> Option<Vec<u8>>{
+        let mut res = vec![0; self.get_block_size() as usize];
+        self.read_block_into(number, &mut res)?;
+        Some(res)
     }
     
 
-    pub fn get_inode(&self, inode_addr: u32) -> Option<Ext2RawInode> {
+    fn get_inode_position(&self, inode_addr: u32) -> Option<usize> {
+        if inode_addr == 0 { return None; }
         let block_group_descriptor_index = (inode_addr-1)/self.sb.inodes_per_block_group;
         let block_group_descriptor = self.get_block_group_descriptor(block_group_descriptor_index)?;
-        let starting_inode_table_addr = block_group_descriptor.starting_block_addr_for_inode_table*self.get_block_size();
-        let inode_index_in_table = (inode_addr-1)%self.sb.inodes_per_block_group;
-        // Inode size in list is self.get_inode_size() but only core::mem::size_of::<Ext2Inode>() bytes of the entire thing are useful for us
-        let raw_inode = self.read(starting_inode_table_addr+inode_index_in_table*self.get_inode_size() as u32, core::mem::size_of::<Ext2RawInode>())?;
-        Some(unsafe{&*(raw_inode.as_ptr() as *const Ext2RawInode)}.clone())
+        let starting_inode_table_addr = block_group_descriptor.starting_block_addr_for_inode_table as usize*self.get_block_size() as usize;
+        let inode_index_in_table = ((inode_addr-1)%self.sb.inodes_per_block_group) as usize;
+        Some(starting_inode_table_addr+inode_index_in_table*self.get_inode_size())
     }
 
-    pub fn get_block_group_descriptor(&self, block_group_index: u32) -> Option<Ext2BlockGroupDescriptor> {
-        let block_group_table_offset = block_group_index * core::mem::size_of::<Ext2BlockGroupDescriptor>() as u32;
+    pub fn get_inode(&self, inode_addr: u32) -> Option<Ext2RawInode> {
+        trace_span!(Ext2GetInode, core::mem::size_of::<Ext2RawInode>());
+        // Inode size in list is self.get_inode_size() but only core::mem::size_of::<Ext2Inode>() bytes of the entire thing are useful for us
+        let mut raw_inode = [0u8; core::mem::size_of::<Ext2RawInode>()];
+        self.read_into(self.get_inode_position(inode_addr)?, &mut raw_inode)?;
+        Some(unsafe{ ptr::read_unaligned(raw_inode.as_ptr() as *const Ext2RawInode) })
+    }
 
-        // The block group descriptor table is located in the block immediately following the Superblock.
-        // Source: https://wiki.osdev.org/Ext2#Block_Group_Descriptor_Table
+    /// The state shared by every node for inode_addr, inode ( fresh from get_inode ) is only used if no node for it is alive right now
+    /// NOTE: A live node's copy is never older than the disk, everything that changes it writes it back too
+    fn open_inode(&self, inode_addr: u32, inode: Ext2RawInode) -> Rc<RefCell<InodeState>> {
+        let mut open = self.open_inodes.borrow_mut();
+        open.retain(|(_, state)| state.strong_count() != 0);
+        if let Some(state) = open.iter().find(|(addr, _)| *addr == inode_addr).and_then(|(_, state)| state.upgrade()) { return state; }
+        let state = Rc::new(RefCell::new(InodeState{inode, block_map: BlockMap::new()}));
+        open.push((inode_addr, Rc::downgrade(&state)));
+        state
+    }
 
-        // The Superblock is always located at byte 1024 from the beginning of the volume and is exactly 1024 bytes in length.
-        // Source: https://wiki.osdev.org/Ext2#Locating_the_Superblock
+    pub fn write_inode(&self, inode_addr: u32, inode: &Ext2RawInode) -> Option<()> {
+        let mut raw_inode = [0u8; core::mem::size_of::<Ext2RawInode>()];
+        unsafe{ ptr::write_unaligned(raw_inode.as_mut_ptr() as *mut Ext2RawInode, inode.clone()); }
+        self.write_into(self.get_inode_position(inode_addr)?, &raw_inode)
+    }
 
-        let starting_block_group_table_addr = ((1024 + 1024)/self.get_block_size())*self.get_block_size();
-        let raw_descriptor: Vec<u8> = self.read(starting_block_group_table_addr+block_group_table_offset, core::mem::size_of::<Ext2BlockGroupDescriptor>())?;
-        Some(unsafe{ &*(raw_descriptor.as_ptr() as *const Ext2BlockGroupDescriptor)}.clone())
+    pub fn get_block_group_descriptor(&self, block_group_index: u32) -> Option<Ext2BlockGroupDescriptor> {
+        self.bgds.get(block_group_index as usize).cloned()
     }
 
     pub fn get_block_size(&self) -> u32{
         2u32.pow(self.sb.block_size_log2_minus_10+10)
     }
 
+    /// Whether directory entries store the type of the child, otherwise that byte is the high 8 bits of the name length
+    pub fn has_dir_entry_types(&self) -> bool{
+        self.sb.major_version >= 1 && self.extended_sb.as_ref().map_or(false, |esb| esb.required_features & 0x2 != 0)
+    }
+
     pub fn get_inode_size(&self) -> usize{
         // Inodes have a fixed size of either 128 for major version 0 Ext2 file systems, or as dictated by the field in the Superblock for major version 1 file systems
         // Source: https://wiki.osdev.org/Ext2#Inodes
@@ -0,0 +1,120 @@
+use crate::primitives::Mutex;
+
+pub const FRAME_SIZE: usize = 4096;
+// NOTE: Both paging setups only identity map the first 4 gb, so anything above that is useless to us for now
+pub const MAX_PHYS_ADDR: usize = 4*1024*1024*1024;
+const FRAME_COUNT: usize = MAX_PHYS_ADDR/FRAME_SIZE;
+
+pub static FRAME_ALLOCATOR: Mutex<FrameAllocator> = Mutex::from(FrameAllocator::new());
+
+/// Type of a memory map entry that is free to use
+// Source: https://www.gnu.org/software/grub/manual/multiboot2/multiboot.html#Memory-map
+pub const MULTIBOOT_MEMORY_AVAILABLE: u32 = 1;
+
+/// One bit per 4 kb frame of physical memory, 1 means free
+/// NOTE: This is 128 kb, but it's .bss ( which is why a 0 bit is used, so it can start out zeroed ) and it doesn't need the heap, which is kind of the point
+pub struct FrameAllocator{
+    bitmap: [u64; FRAME_COUNT/64],
+    free_frames: usize,
+    usable_frames: usize,
+    search_hint: usize // Index in bitmap to start looking from, everything before it is most likely used
+}
+
+impl core::fmt::Debug for FrameAllocator{
+    fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
+        f.debug_struct("FrameAllocator").field("free_frames", &self.free_frames).field("usable_frames", &self.usable_frames).finish()
+    }
+}
+
+impl FrameAllocator{
+    const fn new() -> Self{
+        // Everything is used until the memory map says otherwise
+        Self{ bitmap: [0; FRAME_COUNT/64], free_frames: 0, usable_frames: 0, search_hint: 0 }
+    }
+
+    fn is_used(&self, frame: usize) -> bool{
+        self.bitmap[frame/64] & (1 << (frame%64)) == 0
+    }
+
+    fn set_used(&mut self, frame: usize, used: bool){
+        if self.is_used(frame) == used { return; }
+        if used {
+            self.bitmap[frame/64] &= !(1 << (frame%64));
+            self.free_frames -= 1;
+        }else{
+            self.bitmap[frame/64] |= 1 << (frame%64);
+            self.free_frames += 1;
+        }
+    }
+
+    /// Marks [base, base+len) as usable memory, partial frames at the edges are ignored
+    pub fn add_free_region(&mut self, base: usize, len: usize){
+        let first = (base + FRAME_SIZE - 1)/FRAME_SIZE;
+        let end = core::cmp::min((base.saturating_add(len))/FRAME_SIZE, FRAME_COUNT);
+        for frame in first..end {
+            if self.is_used(frame) { self.usable_frames += 1; }
+            self.set_used(frame, false);
+        }
+        self.search_hint = 0;
+    }
+
+    /// Marks [base, base+len) as used, partial frames at the edges count as used too
+    pub fn reserve_region(&mut self, base: usize, len: usize){
+        let first = base/FRAME_SIZE;
+        let end = core::cmp::min((base.saturating_add(len) + FRAME_SIZE - 1)/FRAME_SIZE, FRAME_COUNT);
+        for frame in first..end {
+            if !self.is_used(frame) { self.usable_frames -= 1; }
+            self.set_used(frame, true);
+        }
+    }
+
+    /// Finds count physically contiguous free frames, returns the physical address of the first one
+    pub fn alloc_frames(&mut self, count: usize) -> Option<usize>{
+        if count == 0 || count > self.free_frames { return None; }
+        let mut run_start = 0;
+        let mut run_len = 0;
+        let mut frame = self.search_hint*64;
+        while frame < FRAME_COUNT {
+            // Skip whole words of used frames at once
+            if frame%64 == 0 && self.bitmap[frame/64] == 0 { run_len = 0; frame += 64; continue; }
+            if self.is_used(frame) {
+                run_len = 0;
+            }else{
+                if run_len == 0 { run_start = frame; }
+                run_len += 1;
+                if run_len == count {
+                    for f in run_start..run_start+count { self.set_used(f, true); }
+                    if count == 1 { self.search_hint = run_start/64; }
+                    return Some(run_start*FRAME_SIZE);
+                }
+            }
+            frame += 1;
+        }
+        // The hint might have skipped something that got freed
+        if self.search_hint != 0 { self.search_hint = 0; return self.alloc_frames(count); }
+        None
+    }
+
+    pub fn free_frames(&mut self, addr: usize, count: usize){
+        let first = addr/FRAME_SIZE;
+        for frame in first..core::cmp::min(first+count, FRAME_COUNT) { self.set_used(frame, false); }
+        self.search_hint = core::cmp::min(self.search_hint, first/64);
+    }
+
+    pub fn get_free_bytes(&self) -> usize { self.free_frames*FRAME_SIZE }
+    pub fn get_usable_bytes(&self) -> usize { self.usable_frames*FRAME_SIZE }
+}
+
+/// Feeds every available entry of a multiboot2 memory map tag ( type 6 ) to the allocator
+/// tag is the tag without it's type and size ( the first 2 u32's )
+pub fn add_multiboot_memory_map(alloc: &mut FrameAllocator, tag: &[u32]){
+    if tag.len() < 2 { return; }
+    let entry_size = tag[0] as usize/core::mem::size_of::<u32>();
+    if entry_size < 6 { return; }
+    // Entries: base_addr: u64, length: u64, type: u32, reserved: u32
+    for entry in tag[2..].chunks_exact(entry_size){
+        let base = entry[0] as usize | (entry[1] as usize) << 32;
+        let len = entry[2] as usize | (entry[3] as usize) << 32;
+        if entry[4] == MULTIBOOT_MEMORY_AVAILABLE { alloc.add_free_region(base, len); }
+    }
+}
@@ -1,6 +1,7 @@
 use core::{ptr, ffi, slice};
 use core::fmt::Debug;
-use crate::{efi::{EfiGopMode, self}, vga::{Vga, MixedRegisterState, Color256, self, VgaMode, Unblanked}};
+use alloc::vec::Vec;
+use crate::{efi::{EfiGopMode, self}, vga::{Vga, MixedRegisterState, Color256, self, VgaMode, Unblanked}, virtmem::{self, KERNEL_PAGE_TABLES, PageFlags, TlbFlush}};
 
 #[derive(Clone, Copy)]
 pub struct Pixel{
@@ -25,43 +26,281 @@ impl Debug for Pixel{
     }
 }
 
+/// NOTE: Drawing works on native pixels ( whatever to_native gives back ), so the format only gets looked at once and not for every pixel
+/// Rects are (x, y, w, h) and get clipped to the screen
 pub trait FrameBuffer {
     fn get_width(&self) -> usize;
     fn get_height(&self) -> usize;
-    fn set_pixel(&mut self, x: usize, y: usize, pixel: Pixel) -> Option<(i16, i16, i16)>;
-    fn fill(&mut self, x1: usize, y1: usize, x2: usize, y2: usize, pixel: Pixel){
-        for y in y1..y2{
-            for x in x1..x2{
-                self.set_pixel(x, y, pixel);
+    fn to_native(&self, pixel: Pixel) -> u32;
+    fn set_native_pixel(&mut self, x: usize, y: usize, native: u32);
+    fn get_native_pixel(&self, x: usize, y: usize) -> u32;
+
+    fn fill_rect(&mut self, x: usize, y: usize, w: usize, h: usize, pixel: Pixel){
+        let (w, h) = clip(x, y, w, h, self.get_width(), self.get_height());
+        let native = self.to_native(pixel);
+        for j in y..y+h{
+            for i in x..x+w{
+                self.set_native_pixel(i, j, native);
+            }
+        }
+    }
+
+    /// Copies a w*h block of native pixels to (x, y), stride is the length of one row of src
+    fn blit(&mut self, x: usize, y: usize, w: usize, h: usize, src: &[u32], stride: usize){
+        let (w, h) = clip(x, y, w, h, self.get_width(), self.get_height());
+        for j in 0..h{
+            for i in 0..w{
+                self.set_native_pixel(x+i, y+j, src[j*stride + i]);
             }
         }
     }
+
+    /// Moves a block of the screen somewhere else, the two can overlap ( that's what scrolling is )
+    fn copy_rect(&mut self, src_x: usize, src_y: usize, dst_x: usize, dst_y: usize, w: usize, h: usize){
+        let (w, h) = clip(core::cmp::max(src_x, dst_x), core::cmp::max(src_y, dst_y), w, h, self.get_width(), self.get_height());
+        // Go in the direction that doesn't overwrite pixels that still have to be copied
+        for j in 0..h{
+            let j = if dst_y > src_y { h-1-j } else { j };
+            for i in 0..w{
+                let i = if dst_x > src_x { w-1-i } else { i };
+                let native = self.get_native_pixel(src_x+i, src_y+j);
+                self.set_native_pixel(dst_x+i, dst_y+j, native);
+            }
+        }
+    }
+
+    fn fill(&mut self, x1: usize, y1: usize, x2: usize, y2: usize, pixel: Pixel){
+        if x2 <= x1 || y2 <= y1 { return; }
+        self.fill_rect(x1, y1, x2-x1, y2-y1, pixel);
+    }
+
+    /// Puts everything drawn so far on screen, only buffered framebuffers have anything to do here
+    fn present(&mut self){}
 }
 
-impl<'a> FrameBuffer for EfiGopMode<'a>{
+/// Returns how much of a w*h rect at (x, y) is actually on a screen_w*screen_h screen
+fn clip(x: usize, y: usize, w: usize, h: usize, screen_w: usize, screen_h: usize) -> (usize, usize){
+    if x >= screen_w || y >= screen_h { return (0, 0); }
+    (core::cmp::min(w, screen_w-x), core::cmp::min(h, screen_h-y))
+}
+
+/// Maps [base, base+len) write combining, so writes to video memory get merged into bursts instead of going out one by one uncached
+/// Video memory the boot identity map doesn't reach ( some gpus put it above 4 gb ) gets identity mapped here, with 2 mb pages where it's aligned enough
+/// NOTE: WC in the pat wins over whatever the mtrrs say for the range, so there's no need to touch those
+fn map_write_combining(base: usize, len: usize) -> bool{
+    if !KERNEL_PAGE_TABLES.lock().is_initialised() || !unsafe{ virtmem::init_pat() } { return false; }
+    let start = base & !(virtmem::PAGE_SIZE-1);
+    let len = (base + len - start + virtmem::PAGE_SIZE - 1) & !(virtmem::PAGE_SIZE-1);
+    let flags = PageFlags::PRESENT | PageFlags::WRITABLE | virtmem::WRITE_COMBINING;
+    let mut flush = TlbFlush::new();
+    let res = unsafe{
+        let mut pt = KERNEL_PAGE_TABLES.lock();
+        if pt.translate(start).is_some() { pt.protect_range(start, len, flags, &mut flush) } else { pt.map_range(start, start, len, flags, &mut flush) }
+    };
+    flush.flush();
+    res.is_some()
+}
+
+// Past this many damaged rects they all get merged into one big one
+const MAX_DAMAGE_RECTS: usize = 16;
+
+/// Back buffer in normal memory in front of another framebuffer, drawing only touches the back buffer and present() copies what changed
+/// Reading back for copy_rect then also comes from ram instead of video memory
+pub struct ShadowFrameBuffer<'a>{
+    front: &'a mut dyn FrameBuffer,
+    back: Vec<u32>, // Native pixels of front, width*height of them
+    width: usize,
+    height: usize,
+    damage: Vec<(usize, usize, usize, usize)>
+}
+
+impl<'a> ShadowFrameBuffer<'a>{
+    /// None if there isn't enough memory for the back buffer
+    pub fn new(front: &'a mut dyn FrameBuffer) -> Option<Self>{
+        let (width, height) = (front.get_width(), front.get_height());
+        let mut back = Vec::new();
+        back.try_reserve_exact(width*height).ok()?;
+        // NOTE: Starts out black instead of reading back what's on screen, video memory is slow to read
+        back.resize(width*height, front.to_native(Pixel{r: 0, g: 0, b: 0}));
+        let mut res = Self{ front, back, width, height, damage: Vec::new() };
+        res.add_damage(0, 0, width, height);
+        Some(res)
+    }
+
+    fn add_damage(&mut self, x: usize, y: usize, w: usize, h: usize){
+        if w == 0 || h == 0 { return; }
+        let union = |a: (usize, usize, usize, usize), b: (usize, usize, usize, usize)| {
+            let (x1, y1) = (core::cmp::min(a.0, b.0), core::cmp::min(a.1, b.1));
+            let (x2, y2) = (core::cmp::max(a.0+a.2, b.0+b.2), core::cmp::max(a.1+a.3, b.1+b.3));
+            (x1, y1, x2-x1, y2-y1)
+        };
+        let new = (x, y, w, h);
+        // Merge with a rect when that doesn't add anything that wasn't damaged anyway, say the next glyph on the same line
+        for d in self.damage.iter_mut(){
+            let u = union(*d, new);
+            if u.2*u.3 <= d.2*d.3 + w*h { *d = u; return; }
+        }
+        if self.damage.len() >= MAX_DAMAGE_RECTS {
+            let all = self.damage.drain(..).fold(new, union);
+            self.damage.push(all);
+            return;
+        }
+        self.damage.push(new);
+    }
+
+    #[inline(always)]
+    fn row(&mut self, x: usize, y: usize, w: usize) -> &mut [u32]{
+        let start = y*self.width + x;
+        &mut self.back[start..start+w]
+    }
+}
+
+impl<'a> FrameBuffer for ShadowFrameBuffer<'a>{
+    fn get_width(&self) -> usize { self.width }
+    fn get_height(&self) -> usize { self.height }
+
+    #[inline(always)]
+    fn to_native(&self, pixel: Pixel) -> u32 { self.front.to_native(pixel) }
+
+    fn set_native_pixel(&mut self, x: usize, y: usize, native: u32) {
+        if x >= self.width || y >= self.height { return; }
+        self.back[y*self.width + x] = native;
+        self.add_damage(x, y, 1, 1);
+    }
+
+    fn get_native_pixel(&self, x: usize, y: usize) -> u32 {
+        if x >= self.width || y >= self.height { return 0; }
+        self.back[y*self.width + x]
+    }
+
+    fn fill_rect(&mut self, x: usize, y: usize, w: usize, h: usize, pixel: Pixel){
+        let (w, h) = clip(x, y, w, h, self.width, self.height);
+        let native = self.to_native(pixel);
+        for j in y..y+h{
+            self.row(x, j, w).fill(native);
+        }
+        self.add_damage(x, y, w, h);
+    }
+
+    fn blit(&mut self, x: usize, y: usize, w: usize, h: usize, src: &[u32], stride: usize){
+        let (w, h) = clip(x, y, w, h, self.width, self.height);
+        for j in 0..h{
+            self.row(x, y+j, w).copy_from_slice(&src[j*stride..j*stride + w]);
+        }
+        self.add_damage(x, y, w, h);
+    }
+
+    fn copy_rect(&mut self, src_x: usize, src_y: usize, dst_x: usize, dst_y: usize, w: usize, h: usize){
+        let (w, h) = clip(core::cmp::max(src_x, dst_x), core::cmp::max(src_y, dst_y), w, h, self.width, self.height);
+        for j in 0..h{
+            let j = if dst_y > src_y { h-1-j } else { j };
+            let (src, dst) = ((src_y+j)*self.width + src_x, (dst_y+j)*self.width + dst_x);
+            self.back.copy_within(src..src+w, dst);
+        }
+        self.add_damage(dst_x, dst_y, w, h);
+    }
+
+    fn present(&mut self){
+        for (x, y, w, h) in self.damage.drain(..){
+            self.front.blit(x, y, w, h, &self.back[y*self.width + x..], self.width);
+        }
+        self.front.present();
+    }
+}
+
+#[derive(Clone, Copy, Debug)]
+enum EfiPixelOrder{
+    Rgb,
+    Bgr
+}
+
+/// The gop framebuffer, with everything that's needed per pixel worked out once at setup
+/// NOTE: Rows are pix_per_scan_line apart, which can be more than the width
+pub struct EfiFrameBuffer{
+    base: *mut u32,
+    width: usize,
+    height: usize,
+    stride: usize,
+    order: EfiPixelOrder
+}
+
+impl EfiFrameBuffer{
+    fn from_gop_mode(mode: &EfiGopMode) -> Option<Self>{
+        let order = match mode.info.pix_format{
+            efi::EfiGraphicsPixelFormat::RgbR8bit => EfiPixelOrder::Rgb,
+            efi::EfiGraphicsPixelFormat::BgrR8bit => EfiPixelOrder::Bgr,
+            _ => return None
+        };
+        Some(Self{
+            base: mode.framebuffer_base as *mut u32,
+            width: mode.info.horz_res as usize,
+            height: mode.info.vert_res as usize,
+            stride: mode.info.pix_per_scan_line as usize,
+            order
+        })
+    }
+
+    #[inline(always)]
+    fn row(&mut self, x: usize, y: usize, w: usize) -> &mut [u32]{
+        unsafe{ slice::from_raw_parts_mut(self.base.add(y*self.stride + x), w) }
+    }
+}
+
+impl FrameBuffer for EfiFrameBuffer{
     fn get_width(&self) -> usize {
-        self.info.horz_res as usize
+        self.width
     }
 
     fn get_height(&self) -> usize {
-        self.info.vert_res as usize
+        self.height
+    }
+
+    // Byte order in memory is r, g, b, reserved for rgb and b, g, r, reserved for bgr
+    #[inline(always)]
+    fn to_native(&self, pixel: Pixel) -> u32 {
+        match self.order{
+            EfiPixelOrder::Rgb => pixel.r as u32 | (pixel.g as u32) << 8 | (pixel.b as u32) << 16,
+            EfiPixelOrder::Bgr => pixel.b as u32 | (pixel.g as u32) << 8 | (pixel.r as u32) << 16
+        }
+    }
+
+    #[inline(always)]
+    fn set_native_pixel(&mut self, x: usize, y: usize, native: u32) {
+        if x >= self.width || y >= self.height { return; }
+        unsafe{ self.base.add(y*self.stride + x).write_volatile(native); }
     }
 
     #[inline(always)]
-    fn set_pixel(&mut self, x: usize, y: usize, pixel: Pixel) -> Option<(i16, i16, i16)> {
-       let fb_ptr = unsafe{slice::from_raw_parts_mut(self.framebuffer_base as *mut u32, self.get_width()*self.get_height())};
-       if x > self.get_width() { return None }
-       if y > self.get_height() { return None }
-       match self.info.pix_format{
-        efi::EfiGraphicsPixelFormat::RgbR8bit => { fb_ptr[y*self.get_width() + x] = ((pixel.r as u32) << 24 | (pixel.g as u32) << 16 | (pixel.b as u32) << 8).to_be(); return Some((0, 0, 0))},
-        efi::EfiGraphicsPixelFormat::BgrR8bit => { fb_ptr[y*self.get_width() + x] = ((pixel.b as u32) << 24 | (pixel.g as u32) << 16 | (pixel.r as u32) << 8).to_be(); return Some((0, 0, 0))},
-        efi::EfiGraphicsPixelFormat::BitMask => return None,
-        efi::EfiGraphicsPixelFormat::BltOnly => return None,
-        efi::EfiGraphicsPixelFormat::FormatMax => return None
-      };
+    fn get_native_pixel(&self, x: usize, y: usize) -> u32 {
+        if x >= self.width || y >= self.height { return 0; }
+        unsafe{ self.base.add(y*self.stride + x).read_volatile() }
     }
 
+    fn fill_rect(&mut self, x: usize, y: usize, w: usize, h: usize, pixel: Pixel){
+        let (w, h) = clip(x, y, w, h, self.width, self.height);
+        let native = self.to_native(pixel);
+        for j in y..y+h{
+            self.row(x, j, w).fill(native);
+        }
+    }
+
+    fn blit(&mut self, x: usize, y: usize, w: usize, h: usize, src: &[u32], stride: usize){
+        let (w, h) = clip(x, y, w, h, self.width, self.height);
+        for j in 0..h{
+            self.row(x, y+j, w).copy_from_slice(&src[j*stride..j*stride + w]);
+        }
+    }
+
+    fn copy_rect(&mut self, src_x: usize, src_y: usize, dst_x: usize, dst_y: usize, w: usize, h: usize){
+        let (w, h) = clip(core::cmp::max(src_x, dst_x), core::cmp::max(src_y, dst_y), w, h, self.width, self.height);
+        for j in 0..h{
+            let j = if dst_y > src_y { h-1-j } else { j };
+            // NOTE: ptr::copy is a memmove, so rows that overlap sideways are fine too
+            unsafe{ ptr::copy(self.base.add((src_y+j)*self.stride + src_x), self.base.add((dst_y+j)*self.stride + dst_x), w); }
+        }
+    }
 }
+
 impl<STATE: MixedRegisterState> FrameBuffer for Vga<Color256, STATE>{
     fn get_width(&self) -> usize {
         320
@@ -71,27 +310,27 @@ impl<STATE: MixedRegisterState> FrameBuffer for Vga<Color256, STATE>{
         200
     }
 
+    /// Index of the closest palette color
     #[inline(always)]
-    fn set_pixel(&mut self, x: usize, y: usize, pixel: Pixel) -> Option<(i16, i16, i16)> {
-        let mut best_ind = 0;
-        let mut best_err = i32::MAX;
-        let mut best_color = Pixel{r: 0, g: 0, b: 0};
-
-        for (i, c)  in vga::FANCY_PALETTE.iter().enumerate(){
-            let err = (c.0 as i32*4 - pixel.r as i32).abs().pow(2) + (c.1 as i32*4 - pixel.g as i32).abs().pow(2) + (c.2 as i32*4 - pixel.b as i32).abs().pow(2);
-            if err < best_err{
-                best_ind = i;
-                best_err = err;
-                best_color = Pixel{r: c.0, g: c.1, b: c.2};
-            }
-        }
-        unsafe{ self.write(x, y, best_ind as u8); }
-        Some((best_color.r as i16 - pixel.r as i16, best_color.g as i16 - pixel.r as i16, best_color.b as i16 - pixel.b as i16))
+    fn to_native(&self, pixel: Pixel) -> u32 {
+        vga::PALETTE_LUT.lookup(pixel.r, pixel.g, pixel.b) as u32
+    }
+
+    #[inline(always)]
+    fn set_native_pixel(&mut self, x: usize, y: usize, native: u32) {
+        if x >= 320 || y >= 200 { return; }
+        unsafe{ self.write(x, y, native as u8); }
+    }
+
+    #[inline(always)]
+    fn get_native_pixel(&self, x: usize, y: usize) -> u32 {
+        if x >= 320 || y >= 200 { return 0; }
+        unsafe{ self.read(x, y) as u32 }
     }
 }
 
 
-pub fn try_setup_efi_framebuffer(efi_table: *mut efi::EfiSystemTable, _desired_res_w: u32, _desired_res_h: u32) -> Option<&'static mut impl FrameBuffer>{
+pub fn try_setup_efi_framebuffer(efi_table: *mut efi::EfiSystemTable, _desired_res_w: u32, _desired_res_h: u32) -> Option<EfiFrameBuffer>{
     if efi_table == ptr::null_mut(){ return None }
     let efi_table = unsafe{&mut *efi_table};
     if unsafe{core::mem::transmute::<_, *const ffi::c_void>(&*efi_table.boot_services)} == ptr::null() { return None }
@@ -129,11 +368,14 @@ pub fn try_setup_efi_framebuffer(efi_table: *mut efi::EfiSystemTable, _desired_r
            }
        }
     (gop.set_mode)(&mut gop, best_mode_ind);*/
-    Some(gop.mode)
+    let fb = EfiFrameBuffer::from_gop_mode(gop.mode)?;
+    map_write_combining(fb.base as usize, fb.stride*fb.height*core::mem::size_of::<u32>());
+    Some(fb)
 }
 
 
 pub fn try_setup_vga_framebuffer<MODE: VgaMode + 'static>(vga: Vga<MODE, Unblanked>, _desired_res_w: u32, _desired_res_h: u32) -> Option<Vga<Color256, Unblanked>>{
+    map_write_combining(0xa0000, 320*200);
     let vga = unsafe{vga.blank_screen()};
     Some(unsafe{vga.set_mode::<Color256>().unblank_screen()})
 }
@@ -0,0 +1,256 @@
+use core::{arch::asm, mem::size_of};
+
+use crate::{primitives::{Mutex, disable_interrupts}, virtmem::KernPointer, smp::MAX_CPUS};
+
+// Source: AMD64 programmer's manual vol. 2, chapter 4 ( segmentation ) and chapter 8 ( exceptions and interrupts )
+pub const KERNEL_CODE_SELECTOR: u16 = 0x08;
+pub const KERNEL_DATA_SELECTOR: u16 = 0x10;
+// Every cpu has it's own tss, as loading one marks it busy
+const fn tss_selector(cpu: usize) -> u16 { 0x18 + (cpu*16) as u16 }
+const GDT_ENTRIES: usize = 3 + 2*MAX_CPUS;
+
+pub const PAGE_FAULT_VECTOR: u8 = 14;
+pub const DOUBLE_FAULT_VECTOR: u8 = 8;
+
+// The 8259 pics, remapped so irqs don't land on top of the cpu exceptions
+// Source: https://wiki.osdev.org/8259_PIC
+// FIXME: Use the apic instead once there's more than one core
+const PIC1_COMMAND_PORT: u16 = 0x20;
+const PIC1_DATA_PORT: u16 = 0x21;
+const PIC2_COMMAND_PORT: u16 = 0xA0;
+const PIC2_DATA_PORT: u16 = 0xA1;
+const PIC_EOI: u8 = 0x20;
+pub const PIC1_OFFSET: u8 = 0x20;
+pub const PIC2_OFFSET: u8 = 0x28;
+pub const KEYBOARD_IRQ: u8 = 1;
+pub const COM1_IRQ: u8 = 4;
+pub const PRIMARY_ATA_IRQ: u8 = 14;
+pub const SECONDARY_ATA_IRQ: u8 = 15;
+const CASCADE_IRQ: u8 = 2;
+
+// NOTE: Interrupts run on their own stacks ( through the tss's interrupt stack table ) because we are built for a target with a red zone,
+// and the cpu pushing the interrupt frame right below rsp would trample whatever the interrupted function had there
+pub const IST_STACK_SIZE: usize = 16*1024;
+const IST_STACK_COUNT: usize = 2;
+pub const INTERRUPT_IST: u8 = 1;
+pub const DOUBLE_FAULT_IST: u8 = 2;
+
+#[derive(Clone, Copy)]
+#[repr(C, align(16))]
+struct IstStack([u8; IST_STACK_SIZE]);
+const EMPTY_IST_STACK: IstStack = IstStack([0; IST_STACK_SIZE]);
+static mut IST_STACKS: [[IstStack; IST_STACK_COUNT]; MAX_CPUS] = [[EMPTY_IST_STACK; IST_STACK_COUNT]; MAX_CPUS];
+
+#[repr(C, packed)]
+struct TaskStateSegment {
+    _reserved0: u32,
+    rsp: [u64; 3],
+    _reserved1: u64,
+    ist: [u64; 7],
+    _reserved2: u64,
+    _reserved3: u16,
+    iomap_base: u16
+}
+
+const EMPTY_TSS: TaskStateSegment = TaskStateSegment { _reserved0: 0, rsp: [0; 3], _reserved1: 0, ist: [0; 7], _reserved2: 0, _reserved3: 0, iomap_base: size_of::<TaskStateSegment>() as u16 };
+static mut TSS: [TaskStateSegment; MAX_CPUS] = [EMPTY_TSS; MAX_CPUS];
+
+// null, kernel code, kernel data, then a tss per cpu ( which takes 2 entries in long mode )
+static mut GDT: [u64; GDT_ENTRIES] = {
+    let mut gdt = [0; GDT_ENTRIES];
+    gdt[1] = (1 << 43) | (1 << 44) | (1 << 47) | (1 << 53); // executable, code/data, present, long mode
+    gdt[2] = (1 << 41) | (1 << 44) | (1 << 47); // writable, code/data, present
+    gdt
+};
+
+#[repr(C, packed)]
+struct DescriptorTablePointer {
+    limit: u16,
+    base: u64
+}
+
+#[derive(Clone, Copy)]
+#[repr(C)]
+struct IdtEntry {
+    offset_low: u16,
+    selector: u16,
+    ist: u8,
+    type_attributes: u8,
+    offset_mid: u16,
+    offset_high: u32,
+    _reserved: u32
+}
+
+impl IdtEntry {
+    const fn missing() -> Self {
+        Self { offset_low: 0, selector: 0, ist: 0, type_attributes: 0, offset_mid: 0, offset_high: 0, _reserved: 0 }
+    }
+}
+
+static mut IDT: [IdtEntry; 256] = [IdtEntry::missing(); 256];
+
+/// What the cpu pushes before calling a handler
+#[derive(Debug)]
+#[repr(C)]
+pub struct InterruptStackFrame {
+    pub rip: u64,
+    pub cs: u64,
+    pub rflags: u64,
+    pub rsp: u64,
+    pub ss: u64
+}
+
+/// Called on page faults with the faulting address and the error code, returns true if the fault was handled and the instruction can be retried
+pub type PageFaultHook = fn(usize, u64) -> bool;
+static PAGE_FAULT_HOOK: Mutex<Option<PageFaultHook>> = Mutex::from(None);
+
+pub fn set_page_fault_hook(hook: PageFaultHook) {
+    *PAGE_FAULT_HOOK.lock() = Some(hook);
+}
+
+/// Points an idt entry at a handler, as an interrupt gate ( so interrupts stay disabled while it runs )
+pub unsafe fn set_handler(vector: u8, handler: usize, ist: u8) {
+    IDT[vector as usize] = IdtEntry {
+        offset_low: handler as u16,
+        selector: KERNEL_CODE_SELECTOR,
+        ist,
+        type_attributes: 0x8E, // present, ring 0, 64-bit interrupt gate
+        offset_mid: (handler >> 16) as u16,
+        offset_high: (handler >> 32) as u32,
+        _reserved: 0
+    };
+}
+
+extern "x86-interrupt" fn page_fault_handler(frame: InterruptStackFrame, error_code: u64) {
+    let addr: usize;
+    unsafe { asm!("mov {}, cr2", out(reg) addr, options(nomem, nostack)); }
+    // NOTE: Copy the hook out, so the lock isn't held while it runs
+    let hook = *PAGE_FAULT_HOOK.lock();
+    if let Some(hook) = hook {
+        if hook(addr, error_code) { return; }
+    }
+    panic!("Page fault at address {:#x}, error code: {:#b}, {:#x?}", addr, error_code, frame);
+}
+
+extern "x86-interrupt" fn double_fault_handler(frame: InterruptStackFrame, _error_code: u64) -> ! {
+    panic!("Double fault, {:#x?}", frame);
+}
+
+/// Replaces the firmware's gdt with ours ( which has a tss per cpu ) and loads an idt with the exception handlers
+/// NOTE: This has to happen after we are done with uefi boot services, they expect their own tables
+pub unsafe fn init() {
+    for cpu in 0..MAX_CPUS {
+        for i in 0..IST_STACK_COUNT {
+            TSS[cpu].ist[i] = core::ptr::addr_of!(IST_STACKS[cpu][i]) as u64 + IST_STACK_SIZE as u64;
+        }
+        let tss_addr = core::ptr::addr_of!(TSS[cpu]) as u64;
+        let tss_limit = (size_of::<TaskStateSegment>() - 1) as u64;
+        let entry = tss_selector(cpu) as usize/8;
+        GDT[entry] = (tss_limit & 0xFFFF) | ((tss_addr & 0xFF_FFFF) << 16) | (0x89 << 40) | (((tss_addr >> 24) & 0xFF) << 56); // present, available 64-bit tss
+        GDT[entry+1] = tss_addr >> 32;
+    }
+    set_handler(PAGE_FAULT_VECTOR, page_fault_handler as usize, INTERRUPT_IST);
+    set_handler(DOUBLE_FAULT_VECTOR, double_fault_handler as usize, DOUBLE_FAULT_IST);
+    load_tables(0);
+}
+
+/// Loads the gdt, this cpu's tss and the idt, init() has to have run on the bsp first
+pub unsafe fn load_tables(cpu: usize) {
+    let gdt_ptr = DescriptorTablePointer { limit: (size_of::<[u64; GDT_ENTRIES]>() - 1) as u16, base: core::ptr::addr_of!(GDT) as u64 };
+    asm!("lgdt [{}]", in(reg) &gdt_ptr, options(readonly, nostack));
+    // Reload cs with a far return, then the data segments
+    asm!(
+        "push {sel}",
+        "lea {tmp}, [rip + 2f]",
+        "push {tmp}",
+        "retfq",
+        "2:",
+        sel = in(reg) KERNEL_CODE_SELECTOR as u64,
+        tmp = lateout(reg) _,
+    );
+    asm!(
+        "mov ds, {0:x}",
+        "mov es, {0:x}",
+        "mov ss, {0:x}",
+        in(reg) KERNEL_DATA_SELECTOR,
+        options(nostack)
+    );
+    asm!("ltr {0:x}", in(reg) tss_selector(cpu), options(nostack));
+
+    let idt_ptr = DescriptorTablePointer { limit: (size_of::<[IdtEntry; 256]>() - 1) as u16, base: core::ptr::addr_of!(IDT) as u64 };
+    asm!("lidt [{}]", in(reg) &idt_ptr, options(readonly, nostack));
+}
+
+unsafe fn pic_write(port: u16, val: u8) {
+    KernPointer::<u8>::from_port(port).write(val);
+    // Give the old pics some time, a write to an unused port takes long enough
+    KernPointer::<u8>::from_port(0x80).write(0);
+}
+
+/// Reads the pic's in service register, to tell real irqs from spurious ones
+unsafe fn pic_in_service(command_port: u16) -> u8 {
+    let mut port = KernPointer::<u8>::from_port(command_port);
+    port.write(0x0B);
+    port.read()
+}
+
+pub fn end_of_interrupt(irq: u8) {
+    unsafe {
+        if irq >= 8 { KernPointer::<u8>::from_port(PIC2_COMMAND_PORT).write(PIC_EOI); }
+        KernPointer::<u8>::from_port(PIC1_COMMAND_PORT).write(PIC_EOI);
+    }
+}
+
+/// Lets an irq through the pic, the handler has to be set first
+pub fn unmask_irq(irq: u8) {
+    unsafe {
+        let (port, bit) = if irq < 8 { (PIC1_DATA_PORT, irq) } else { (PIC2_DATA_PORT, irq-8) };
+        let mut data = KernPointer::<u8>::from_port(port);
+        let mask = data.read() & !(1 << bit);
+        data.write(mask);
+    }
+}
+
+extern "x86-interrupt" fn spurious_irq7_handler(_frame: InterruptStackFrame) {
+    // NOTE: A spurious irq doesn't get an eoi, but a real irq 7 does
+    if unsafe { pic_in_service(PIC1_COMMAND_PORT) } & (1 << 7) != 0 { end_of_interrupt(7); }
+}
+
+extern "x86-interrupt" fn spurious_irq15_handler(_frame: InterruptStackFrame) {
+    // NOTE: Spurious on the slave still means the master saw a real irq 2, so it gets an eoi
+    if unsafe { pic_in_service(PIC2_COMMAND_PORT) } & (1 << 7) != 0 { end_of_interrupt(15); } else { end_of_interrupt(CASCADE_IRQ); }
+}
+
+/// Remaps the pics and masks every irq, use unmask_irq to let them through
+pub unsafe fn init_pic() {
+    pic_write(PIC1_COMMAND_PORT, 0x11); // Initialise, expect icw4
+    pic_write(PIC2_COMMAND_PORT, 0x11);
+    pic_write(PIC1_DATA_PORT, PIC1_OFFSET);
+    pic_write(PIC2_DATA_PORT, PIC2_OFFSET);
+    pic_write(PIC1_DATA_PORT, 1 << CASCADE_IRQ); // Slave is on irq 2
+    pic_write(PIC2_DATA_PORT, CASCADE_IRQ); // Slave's cascade identity
+    pic_write(PIC1_DATA_PORT, 0x01); // 8086 mode
+    pic_write(PIC2_DATA_PORT, 0x01);
+    pic_write(PIC1_DATA_PORT, !(1 << CASCADE_IRQ));
+    pic_write(PIC2_DATA_PORT, 0xFF);
+    set_handler(PIC1_OFFSET+7, spurious_irq7_handler as usize, INTERRUPT_IST);
+    set_handler(PIC2_OFFSET+7, spurious_irq15_handler as usize, INTERRUPT_IST);
+}
+
+/// Sleeps until something is available, cond is checked with interrupts disabled so a wakeup can't slip in between checking and halting
+/// If interrupts were disabled to begin with ( like while booting ) this just polls cond
+pub fn wait_until<T>(mut cond: impl FnMut() -> Option<T>) -> T {
+    loop {
+        let were_enabled = disable_interrupts();
+        if let Some(val) = cond() {
+            if were_enabled { unsafe { asm!("sti", options(nomem, nostack)); } }
+            return val;
+        }
+        if were_enabled {
+            // NOTE: sti only takes effect after the next instruction, so nothing can come in before the hlt
+            unsafe { asm!("sti", "hlt", options(nomem, nostack)); }
+        } else {
+            core::hint::spin_loop();
+        }
+    }
+}
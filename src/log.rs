@@ -0,0 +1,180 @@
+use core::{cell::UnsafeCell, fmt::Write, sync::atomic::{AtomicBool, AtomicU8, AtomicUsize, Ordering}};
+
+/// Appends a line to the log ring, never blocks and never takes a lock, so it's fine from irq handlers and the allocator
+/// klog!(Info, "{} mb free", free)
+macro_rules! klog {
+    ($level:ident, $($arg:tt)*) => {
+        $crate::log::log($crate::log::LogLevel::$level, format_args!($($arg)*))
+    };
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, PartialOrd)]
+#[repr(u8)]
+pub enum LogLevel {
+    Error,
+    Warn,
+    Info,
+    Debug
+}
+
+impl LogLevel {
+    fn prefix(self) -> &'static str {
+        match self {
+            LogLevel::Error => "error: ",
+            LogLevel::Warn => "warning: ",
+            LogLevel::Info => "",
+            LogLevel::Debug => "debug: "
+        }
+    }
+}
+
+// A record per slot, so producers only have to agree on which slot is theirs and not on byte offsets
+// NOTE: Lines longer than a slot get cut off
+const SLOT_DATA: usize = 120;
+const SLOT_COUNT: usize = 256; // Power of two
+
+struct Slot {
+    seq: AtomicUsize, // == position when free for the producer at that position, position+1 once it's filled in
+    len: UnsafeCell<usize>,
+    data: UnsafeCell<[u8; SLOT_DATA]>
+}
+
+/// Bounded multi producer, single consumer queue of log lines ( Vyukov's, minus the multiple consumers )
+/// NOTE: The consumer is whoever holds `draining`, which is either the uart irq or someone flushing by hand
+struct LogRing {
+    slots: [Slot; SLOT_COUNT],
+    enqueue_pos: AtomicUsize,
+    dequeue_pos: UnsafeCell<usize>, // Only the consumer touches these
+    sent_of_current: UnsafeCell<usize>, // Bytes of the slot at dequeue_pos already sent
+    cr_sent: UnsafeCell<bool>, // '\n' goes out as "\r\n", this is set once the '\r' is out
+    draining: AtomicBool
+}
+
+unsafe impl Sync for LogRing {}
+
+const EMPTY_SLOT: Slot = Slot { seq: AtomicUsize::new(0), len: UnsafeCell::new(0), data: UnsafeCell::new([0; SLOT_DATA]) };
+
+static LOG_RING: LogRing = LogRing::new();
+static MIN_LEVEL: AtomicU8 = AtomicU8::new(LogLevel::Info as u8);
+static LOGGED: AtomicUsize = AtomicUsize::new(0);
+static DROPPED: AtomicUsize = AtomicUsize::new(0);
+
+/// Formats into a slot, cutting off whatever doesn't fit
+struct SlotWriter<'a> {
+    buf: &'a mut [u8; SLOT_DATA],
+    len: usize
+}
+
+impl<'a> Write for SlotWriter<'a> {
+    fn write_str(&mut self, s: &str) -> core::fmt::Result {
+        let n = core::cmp::min(s.len(), SLOT_DATA - self.len);
+        self.buf[self.len..self.len+n].copy_from_slice(&s.as_bytes()[..n]);
+        self.len += n;
+        Ok(())
+    }
+}
+
+impl LogRing {
+    const fn new() -> Self {
+        let mut slots = [EMPTY_SLOT; SLOT_COUNT];
+        let mut i = 0;
+        while i < SLOT_COUNT {
+            slots[i].seq = AtomicUsize::new(i);
+            i += 1;
+        }
+        Self { slots, enqueue_pos: AtomicUsize::new(0), dequeue_pos: UnsafeCell::new(0), sent_of_current: UnsafeCell::new(0), cr_sent: UnsafeCell::new(false), draining: AtomicBool::new(false) }
+    }
+
+    /// Returns false if every slot is taken
+    fn push(&self, level: LogLevel, args: core::fmt::Arguments) -> bool {
+        let mut pos = self.enqueue_pos.load(Ordering::Relaxed);
+        let slot = loop {
+            let slot = &self.slots[pos % SLOT_COUNT];
+            let seq = slot.seq.load(Ordering::Acquire);
+            if seq == pos {
+                match self.enqueue_pos.compare_exchange_weak(pos, pos+1, Ordering::Relaxed, Ordering::Relaxed) {
+                    Ok(_) => break slot,
+                    Err(actual) => pos = actual
+                }
+            } else if seq < pos {
+                return false; // Still holds a line from the last time around that hasn't been sent
+            } else {
+                pos = self.enqueue_pos.load(Ordering::Relaxed);
+            }
+        };
+        // NOTE: The slot is ours until seq is bumped, nobody else reads or writes it
+        let mut writer = SlotWriter { buf: unsafe { &mut *slot.data.get() }, len: 0 };
+        let _ = writer.write_str(level.prefix());
+        let _ = writer.write_fmt(args);
+        unsafe { *slot.len.get() = writer.len; }
+        slot.seq.store(pos+1, Ordering::Release);
+        true
+    }
+
+    /// Hands up to max bytes of finished lines to put, returns whether there's more left after that
+    /// A line that's still being written stops the draining, lines go out in the order slots were taken
+    fn drain(&self, max: usize, mut put: impl FnMut(u8)) -> bool {
+        if self.draining.swap(true, Ordering::Acquire) { return true; } // Someone else is on it
+        let mut sent = 0;
+        let more = unsafe {
+            let pos = &mut *self.dequeue_pos.get();
+            let offset = &mut *self.sent_of_current.get();
+            let cr_sent = &mut *self.cr_sent.get();
+            loop {
+                let slot = &self.slots[*pos % SLOT_COUNT];
+                if slot.seq.load(Ordering::Acquire) != *pos + 1 { break false; }
+                let (data, len) = (&*slot.data.get(), *slot.len.get());
+                // The line followed by it's "\r\n"
+                while sent < max && *offset <= len {
+                    let b = if *offset == len { b'\n' } else { data[*offset] };
+                    if b == b'\n' && !*cr_sent { put(b'\r'); *cr_sent = true; sent += 1; continue; }
+                    put(b);
+                    *cr_sent = false;
+                    *offset += 1;
+                    sent += 1;
+                }
+                if *offset <= len { break true; } // Ran out of room mid line
+                *offset = 0;
+                slot.seq.store(*pos + SLOT_COUNT, Ordering::Release);
+                *pos += 1;
+            }
+        };
+        self.draining.store(false, Ordering::Release);
+        more
+    }
+
+    fn has_pending(&self) -> bool {
+        // NOTE: Racy read of dequeue_pos if someone else is draining, but then they'll take care of it anyway
+        let pos = unsafe { *self.dequeue_pos.get() };
+        self.slots[pos % SLOT_COUNT].seq.load(Ordering::Acquire) == pos + 1
+    }
+}
+
+pub fn log(level: LogLevel, args: core::fmt::Arguments) {
+    if level as u8 > MIN_LEVEL.load(Ordering::Relaxed) { return; }
+    if !LOG_RING.push(level, args) {
+        DROPPED.fetch_add(1, Ordering::Relaxed);
+        return;
+    }
+    LOGGED.fetch_add(1, Ordering::Relaxed);
+    crate::uart_16550::kick_log_drain();
+}
+
+pub fn set_min_level(level: LogLevel) {
+    MIN_LEVEL.store(level as u8, Ordering::Relaxed);
+}
+
+/// (lines logged, lines dropped because the ring was full)
+pub fn get_stats() -> (usize, usize) {
+    (LOGGED.load(Ordering::Relaxed), DROPPED.load(Ordering::Relaxed))
+}
+
+/// Used by the uart's irq handler, and to send things by hand before that is running
+pub fn drain(max: usize, put: impl FnMut(u8)) -> bool {
+    LOG_RING.drain(max, put)
+}
+
+/// Whether there's a finished line waiting to be sent
+pub fn has_pending() -> bool {
+    LOG_RING.has_pending()
+}
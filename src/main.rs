@@ -4,6 +4,8 @@
 #![feature(abi_efiapi)]
 #![feature(default_alloc_error_handler)]
 #![feature(lang_items)]
+#![feature(abi_x86_interrupt)]
+#![feature(allocator_api)]
 
 extern crate alloc;
 
@@ -28,6 +30,7 @@ use crate::hio::KeyboardPacketType;
 use crate::ps2_8042::SpecialKeys;
 use crate::uart_16550::UARTDevice;
 use crate::vga::Vga;
+use crate::text_grid::TextGrid;
 
 macro_rules! wait_for {
   ($cond:expr) => {
@@ -43,6 +46,8 @@ trait X86Default { unsafe fn x86_default() -> Self; }
 fn panic(p: &::core::panic::PanicInfo) -> ! { 
     let mut s = String::new();
     let written = write!(s, "Ron {}", p).is_ok(); // FIXME: Crashes on virtualbox and real hardware but not on qemu?
+    // Get what was logged before the panic out first, so things are in order
+    uart_16550::flush_log_blocking();
     if !UART.is_locked(){
         writeln!(UART.lock()).unwrap();
         if !written{
@@ -60,11 +65,16 @@ fn panic(p: &::core::panic::PanicInfo) -> ! {
             s.chars().for_each(|c|lock.write_char(c));
            lock.write_char('\n');
      }
+        lock.repaint();
     }    
     loop{}
 }
 
 
+#[macro_use]
+mod log;
+#[macro_use]
+mod trace;
 mod multiboot;
 mod ps2_8042;
 mod uart_16550;
@@ -78,85 +88,23 @@ mod vfs;
 mod devfs;
 mod ext2;
 mod partitions;
+mod pci;
+mod block_cache;
+mod dcache;
+mod frame_alloc;
+mod interrupts;
+mod mmap;
+mod elf;
+mod bench;
+mod ring_buffer;
+mod executor;
+mod smp;
 mod char_device;
 mod allocator;
+mod text_grid;
+mod arena;
 mod primitives;
-
-#[no_mangle]
-pub unsafe extern "C" fn memcpy(dest: *mut u8, src: *const u8, n: usize) -> *mut u8 {
-    if n < core::mem::size_of::<usize>(){
-        for i in 0..n {*dest.offset(i as isize) = *src.offset(i as isize); }
-        return dest;
-    }
-    let dest_size = dest as *mut usize;
-    let src_size = src as *mut usize;
-    let n_size = n/core::mem::size_of::<usize>();
-
-    for i in 0..n_size { *dest_size.offset(i as isize) = *src_size.offset(i as isize); }
-    for i in n_size*core::mem::size_of::<usize>() .. n { *dest.offset(i as isize) = *src.offset(i as isize); }
-    return dest;
-}
-
-
-#[no_mangle]
-pub unsafe extern "C" fn memcmp(ptr1: *const u8, ptr2: *const u8, n: usize) -> i32 {
-    let ptr1_size = ptr1 as *mut usize;
-    let ptr2_size = ptr2 as *mut usize;
-    let n_size = n/core::mem::size_of::<usize>();
-    let mut ineq_i = 0;
-    let mut eq: bool = true;
-    for i in 0..n_size {
-        if *ptr1_size.add(i) != *ptr2_size.add(i) { 
-            eq = false; 
-            for subi in i*core::mem::size_of::<usize>()..(i+1)*core::mem::size_of::<usize>(){
-                if *ptr1.add(i) != *ptr2.add(i){ineq_i = subi; break; }
-            } 
-            break; 
-        } 
-    }
-    for i in n_size*core::mem::size_of::<usize>() .. n {if *ptr1.offset(i as isize) != *ptr2.offset(i as isize){ eq = false; ineq_i = i; break; } }
-    if eq { return 0; }else { return *ptr1.add(ineq_i) as i32 - *ptr2.add(ineq_i) as i32; }
-}
-
-#[no_mangle]
-pub unsafe extern "C" fn memset(dest: *mut u8, c: isize, n: usize) -> *mut u8 {
-    let c = c as u8;
-    if n < core::mem::size_of::<usize>(){
-        for i in 0..n {*dest.offset(i as isize) = c; }
-        return dest;
-    }
-    let dest_size = dest as *mut usize;
-    let n_size = n/core::mem::size_of::<usize>();
-    let mut c_size = 0usize;
-    // Endianness dosen't matter
-    for i in 0..core::mem::size_of::<usize>()/core::mem::size_of::<u8>(){
-        c_size |= (c as usize) << (i*core::mem::size_of::<u8>());
-    }
-    for i in 0..n_size {*(dest_size.offset(i as isize)) = c_size; }
-    for i in n_size*core::mem::size_of::<usize>()..n { *(dest.offset(i as isize)) = c; }
-    return dest;
-}
-
-#[no_mangle]
-pub unsafe extern "C" fn bcmp(ptr1: *const u8, ptr2: *const u8, n: usize) -> i32 {
-    if n == 0 { return 0; }
-    memcmp(ptr1, ptr2, n)
-}
-
-#[no_mangle]
-pub unsafe extern "C" fn memmove(dest: *mut u8, src: *const u8, n: usize) -> *mut u8{
-    if (dest as *const u8) == src { return dest; }
-    let src_range = src..src.add(n);
-    let has_overlap =  src_range.contains(&(dest as *const u8)) || src_range.contains(&(dest.add(n) as *const u8));
-    if !has_overlap{
-        memcpy(dest, src, n);
-    } else if (dest as *const u8) < src{
-        for i in 0..n{*dest.add(i) = *src.add(i); }
-    } else if (dest as *const u8) > src{
-        for i in (0..n).rev(){*dest.add(i) = *src.add(i); }
-    }
-    dest
-}
+mod mem;
 
 pub static UART: Mutex<LazyInitialised<UARTDevice>> = Mutex::from(LazyInitialised::uninit());
 
@@ -173,40 +121,43 @@ pub const unsafe fn from_utf8_unchecked(v: &[u8]) -> &str {
 }
 
 static TERMINAL: Mutex<LazyInitialised<Terminal<'static>>> = Mutex::from(LazyInitialised::uninit());
+const CMD_ARENA_SIZE: usize = 64*1024;
+const MAX_HEXDUMP_LEN: usize = 4096;
+const SCROLLBACK_LINES: usize = 500;
 struct Terminal<'a>{
     fb: &'a mut dyn FrameBuffer,
+    grid: TextGrid,
     cursor_pos: (usize, usize),
-    cursor_char: char,
+    drawn_cursor: Option<(usize, usize)>, // Where the visual cursor is on screen right now
     color: Pixel
 }
 impl Debug for Terminal<'_>{
     fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
-        f.debug_struct("Terminal").field("cursor_pos", &self.cursor_pos).field("cursor_char", &self.cursor_char).field("color", &self.color).finish()
+        f.debug_struct("Terminal").field("cursor_pos", &self.cursor_pos).field("color", &self.color).finish()
     }
 }
 
 impl<'a> Write for Terminal<'a>{
     fn write_str(&mut self, s: &str) -> core::fmt::Result {
-        s.chars().for_each(|c|self.write_char(c));
+        s.chars().for_each(|c|self.put_char(c));
         Ok(())
     }
 }
 
+// NOTE: Writing only changes the grid, nothing shows up on screen until repaint()
 impl<'a> Terminal<'a>{
     fn new(fb: &'a mut dyn FrameBuffer, color: Pixel) -> Self {
+        let grid = TextGrid::new(fb.get_cols(), fb.get_rows(), SCROLLBACK_LINES);
         Terminal{
             fb,
+            grid,
             cursor_pos: (0, 0),
-            cursor_char: ' ',
+            drawn_cursor: None,
             color
         }
     }
     fn clear(&mut self){
-        for i in 0..self.fb.get_height(){
-            for j in 0..self.fb.get_width(){
-                self.fb.set_pixel(j, i,Pixel{r: 0, g: 0, b: 0});
-            }
-        }
+        self.grid.clear();
         self.cursor_pos = (0, 0);
     }
     fn cursor_up(&mut self){
@@ -214,14 +165,14 @@ impl<'a> Terminal<'a>{
         self.cursor_pos.1 -= 1;
     }
     fn cursor_down(&mut self){
-        if self.cursor_pos.1 >= self.fb.get_rows()-1 { self.cursor_pos.1 = 0; }
+        if self.cursor_pos.1 >= self.grid.get_rows()-1 { self.grid.scroll_up(); }
         else {  self.cursor_pos.1 += 1; }
     }
     fn cursor_right(&mut self){
-        if self.cursor_pos.0 >= self.fb.get_cols()-1 {
+        if self.cursor_pos.0 >= self.grid.get_cols()-1 {
             self.cursor_pos.0 = 0; 
             self.cursor_down(); 
-            for x in 0..self.fb.get_cols(){self.fb.write_char(x, self.cursor_pos.1, ' ', self.color);}
+            self.grid.clear_row(self.cursor_pos.1);
             return;
         }
         self.cursor_pos.0 += 1;
@@ -231,67 +182,96 @@ impl<'a> Terminal<'a>{
         self.cursor_pos.0 -= 1;
     }
 
-    pub fn visual_cursor_up(&mut self){
-        self.erase_visual_cursor();
-        self.cursor_up();
-        self.update_visual_cursor();
-    }
-    pub fn visual_cursor_left(&mut self){
-        self.erase_visual_cursor();
-        self.cursor_left();
-        self.update_visual_cursor();
-    }
-    pub fn visual_cursor_right(&mut self){
-        self.erase_visual_cursor();
-        self.cursor_right();
-        self.update_visual_cursor();
-    }
+    pub fn visual_cursor_up(&mut self){ self.cursor_up(); }
+    pub fn visual_cursor_left(&mut self){ self.cursor_left(); }
+    pub fn visual_cursor_right(&mut self){ self.cursor_right(); }
+    pub fn visual_cursor_down(&mut self){ self.cursor_down(); }
 
-    pub fn visual_cursor_down(&mut self){
-        self.erase_visual_cursor();
-        self.cursor_down();
-        self.update_visual_cursor();
-    }
+    /// Moves the view into the scrollback, lines > 0 goes back
+    pub fn scroll_view(&mut self, lines: isize){ self.grid.scroll_view(lines); }
 
-    fn update_visual_cursor(&mut self){
-        self.fb.write_char(self.cursor_pos.0, self.cursor_pos.1, '_', self.color);
-    }
-    
-    fn erase_visual_cursor(&mut self){
-        self.fb.write_char(self.cursor_pos.0, self.cursor_pos.1, self.cursor_char, self.color);
+    fn write_char(&mut self, c: char){
+        self.put_char(c);
     }
 
-    fn write_char(&mut self, c: char){
-        self.erase_visual_cursor(); // erase current cursor
+    fn put_char(&mut self, c: char){
         match c{
             '\n' => {
                 self.cursor_down();
-                for x in 0..self.fb.get_cols(){self.fb.write_char(x, self.cursor_pos.1, ' ', self.color);}
+                self.grid.clear_row(self.cursor_pos.1);
                 self.cursor_pos.0 = 0;
             },
             '\r' => {
                self.cursor_left(); // Go to char
-               self.erase_visual_cursor();
+               self.grid.set(self.cursor_pos.0, self.cursor_pos.1, text_grid::BLANK_CELL);
             },
             c => {
-                self.fb.write_char(self.cursor_pos.0, self.cursor_pos.1, c, self.color);
+                self.grid.set(self.cursor_pos.0, self.cursor_pos.1, text_grid::Cell{c, color: self.color});
                 self.cursor_right();
             }
         }
-        self.update_visual_cursor();
+    }
+
+    /// Puts whatever changed since last time on screen, scrolling is one copy_rect and only dirty rows get drawn
+    fn repaint(&mut self){
+        let rows = self.grid.get_rows();
+        let scrolled = self.grid.take_pending_scroll();
+        if scrolled >= rows {
+            self.grid.mark_all_dirty();
+        } else if scrolled > 0 {
+            let width = self.fb.get_width();
+            self.fb.copy_rect(0, scrolled*16, 0, 0, width, (rows-scrolled)*16);
+        }
+        // The old cursor moved up with everything else, it's row has to be drawn again to get rid of it
+        if let Some((_, y)) = self.drawn_cursor.take() {
+            if y >= scrolled { self.grid.mark_dirty(y - scrolled); }
+        }
+
+        for row in 0..rows {
+            if !self.grid.take_dirty(row) { continue; }
+            // Runs of the same color go out in one write_str
+            let cells = self.grid.get_row(row);
+            let mut run = [0u8; 128];
+            let (mut run_start, mut run_len) = (0, 0);
+            for (col, cell) in cells.iter().enumerate() {
+                let same_color = run_len == 0 || (cells[run_start].color.r, cells[run_start].color.g, cells[run_start].color.b) == (cell.color.r, cell.color.g, cell.color.b);
+                if !same_color || run_len == run.len() {
+                    self.fb.write_str(run_start, row, unsafe{ from_utf8_unchecked(&run[..run_len]) }, cells[run_start].color);
+                    run_start = col;
+                    run_len = 0;
+                }
+                // NOTE: The font only has ascii
+                run[run_len] = if cell.c.is_ascii() { cell.c as u8 } else { b'?' };
+                run_len += 1;
+            }
+            if run_len != 0 { self.fb.write_str(run_start, row, unsafe{ from_utf8_unchecked(&run[..run_len]) }, cells[run_start].color); }
+        }
+
+        if self.grid.is_following_output() {
+            self.fb.write_char(self.cursor_pos.0, self.cursor_pos.1, '_', self.color);
+            self.drawn_cursor = Some(self.cursor_pos);
+        }
+        self.fb.present();
     }
 }
 
 // reg1 and reg2 are used for multiboot
 #[no_mangle]
 pub extern "C" fn main(r1: u32, r2: u32) -> ! {
+    let main_entry_tsc = primitives::read_tsc();
     let multiboot_data= multiboot::init(r1 as usize, r2 as usize);
+    // NOTE: Before anything else, the allocator needs to know which cpu it's on
+    unsafe{ smp::init_bsp(); }
+    mem::init();
     unsafe{ UART.lock().set(UARTDevice::x86_default()); }
     UART.lock().init();
-    writeln!(UART.lock(), "Hello, world!").unwrap();
+    klog!(Info, "Hello, world!");
+    let tsc_hz = trace::calibrate_tsc();
+    klog!(Info, "tsc runs at {} mhz", tsc_hz/1_000_000);
 
     
     let mut efi_system_table_ptr = 0usize;
+    let mut cmdline = "";
     let mut i = 0;
     loop{
         let id = multiboot_data[i];
@@ -300,6 +280,20 @@ pub extern "C" fn main(r1: u32, r2: u32) -> ! {
         len /= core::mem::size_of::<u32>() as u32;
         if id == 0 && len == 2 { break; }
 
+        if id == 1 {
+            // Boot command line, null terminated
+            // NOTE: The multiboot info is reserved below, so this stays valid
+            let bytes = unsafe{ core::slice::from_raw_parts(multiboot_data[i+2..].as_ptr() as *const u8, (multiboot_data[i+1] as usize).saturating_sub(2*core::mem::size_of::<u32>())) };
+            let bytes = bytes.split(|b| *b == 0).next().unwrap_or(&[]);
+            cmdline = core::str::from_utf8(bytes).unwrap_or("");
+        }
+
+        if id == 6 {
+            // Memory map, the size without padding is what says how many entries there are
+            let unpadded_len = multiboot_data[i+1] as usize/core::mem::size_of::<u32>();
+            frame_alloc::add_multiboot_memory_map(&mut frame_alloc::FRAME_ALLOCATOR.lock(), &multiboot_data[i+2..i+unpadded_len]);
+        }
+
         if id == 0xB || id == 0xC {
             for j in i+2..i+2+(core::mem::size_of::<usize>()/core::mem::size_of::<u32>()){
                 efi_system_table_ptr |= (multiboot_data[j] as usize) << ((j-i-2)*32); // assumes little endian
@@ -309,18 +303,33 @@ pub extern "C" fn main(r1: u32, r2: u32) -> ! {
     }
     // FIXME: Don't hardcore the starting location of the heap
     // Stack size: 1mb, executable size (as of 22 may 2022): ~4mb, so starting the heap at 8mb should be a safe bet.
+    // NOTE: The first mb is bios/real mode stuff, then the kernel, then the initial heap, none of that can be handed out as frames
+    // and neither can the multiboot info itself, as we are still using it
+    frame_alloc::FRAME_ALLOCATOR.lock().reserve_region(0, 9*1024*1024);
+    frame_alloc::FRAME_ALLOCATOR.lock().reserve_region(r2 as usize, unsafe{ *(r2 as usize as *const u32) } as usize);
     allocator::ALLOCATOR.lock().init((8*1024*1024) as *mut u8, 1*1024*1024);
+    unsafe{ virtmem::KERNEL_PAGE_TABLES.lock().set(virtmem::PageMapper::from_cr3()); }
+    klog!(Info, "{} mb of usable physical memory :)", frame_alloc::FRAME_ALLOCATOR.lock().get_usable_bytes()/1024/1024);
     vfs::VFS_ROOT.lock().set(Rc::new(RefCell::new(VFSNode::new_root())));
+    // Spend about 1/256th of ram on the block cache
+    let cache_blocks = frame_alloc::FRAME_ALLOCATOR.lock().get_usable_bytes()/256/block_cache::CACHE_BLOCK_SIZE;
+    block_cache::BLOCK_CACHE.lock().set(block_cache::BlockCache::new(cache_blocks));
+    dcache::DENTRY_CACHE.lock().set(dcache::DentryCache::new());
 
     let dev_folder = vfs::VFSNode::new_folder(vfs::VFS_ROOT.lock().clone(), "dev");
     let dfs = Rc::new(RefCell::new(devfs::DevFS::new()));
-    (*dev_folder).borrow_mut().mountpoint = Some(dfs.clone() as Rc<RefCell<dyn IFolder>>);
+    (*dev_folder).borrow_mut().set_mountpoint(Some(dfs.clone() as Rc<RefCell<dyn IFolder>>));
 
     let vga;
-    let mut fb: Option<&mut dyn framebuffer::FrameBuffer>;
+    let mut fb: Option<&mut dyn framebuffer::FrameBuffer> = None;
     let o;
     let mut uo;
-    fb = framebuffer::try_setup_efi_framebuffer(efi_system_table_ptr as *mut efi::EfiSystemTable, 800, 600).map(|x|x as &mut dyn framebuffer::FrameBuffer);
+    let mut efi_fb;
+    if let Some(val) = framebuffer::try_setup_efi_framebuffer(efi_system_table_ptr as *mut efi::EfiSystemTable, 800, 600){
+        efi_fb = val;
+        // NOTE: main never returns so this lives long enough
+        fb = Some(unsafe{ &mut *((&mut efi_fb) as *mut framebuffer::EfiFrameBuffer) as &mut dyn FrameBuffer});
+    }
     if fb.is_none(){
         vga = unsafe { Vga::x86_default() };
         o = framebuffer::try_setup_vga_framebuffer(vga, 800, 600);
@@ -330,20 +339,36 @@ pub extern "C" fn main(r1: u32, r2: u32) -> ! {
         }
     }
     let fb = fb.unwrap();
+    // Everything gets drawn in ram and only what changed is copied over on present(), if there's memory for it
+    let mut shadow_fb;
+    let fb = if let Some(val) = framebuffer::ShadowFrameBuffer::new(unsafe{ &mut *(fb as *mut dyn FrameBuffer) }){
+        shadow_fb = val;
+        // NOTE: main never returns so this lives long enough
+        unsafe{ &mut *((&mut shadow_fb) as *mut framebuffer::ShadowFrameBuffer) as &mut dyn FrameBuffer }
+    }else{ fb };
 
     fb.fill(0, 0, fb.get_width(), fb.get_height(), Pixel{r: 0, g: 0, b: 0});    
     TERMINAL.lock().set(Terminal::new(fb, Pixel{r: 0x0, g: 0xa8, b: 0x54 }));
     
-    writeln!(UART.lock(), "If you see this then that means the framebuffer subsystem didn't instantly crash the kernel :)").unwrap();
+    klog!(Info, "If you see this then that means the framebuffer subsystem didn't instantly crash the kernel :)");
+    // NOTE: Done with boot services now, so we can take over the gdt and idt
+    unsafe{ interrupts::init(); }
+    mmap::MAPPINGS.lock().set(mmap::MappingTable::new());
+    interrupts::set_page_fault_hook(mmap::page_fault_hook);
     writeln!(TERMINAL.lock(), "Hello, world!").unwrap();
+    let cpus = unsafe{ smp::start_aps() };
+    writeln!(TERMINAL.lock(), "{} cpu(s) online", cpus).unwrap();
+    TERMINAL.lock().repaint(); // So there's something on screen if probing the disks hangs
 
        
     if let Some(primary_ata_bus) = unsafe{ ATABus::primary_x86() }{
         let ata_ref = Rc::new(RefCell::new(primary_ata_bus));
+        let (has_dma, name) = { let bus = (*ata_ref).borrow(); (bus.has_dma(), bus.name()) };
+        if has_dma { klog!(Info, "{} ata bus has a bus master controller, using dma :)", name); } else { klog!(Warn, "{} ata bus has no bus master controller, falling back to pio", name); }
         // NOTE: master device is not necessarilly the device from which the os was booted
     
         if unsafe{(*ata_ref).borrow_mut().identify(ATADevice::MASTER).is_some()}{
-            let master_dev = Rc::new(RefCell::new(ATADeviceFile{bus: ata_ref.clone(), bus_device: ATADevice::MASTER}));
+            let master_dev = Rc::new(RefCell::new(block_cache::CachedDevice::new(Rc::new(RefCell::new(ATADeviceFile{bus: ata_ref.clone(), bus_device: ATADevice::MASTER})))));
             (*dfs).borrow_mut().add_device_file(master_dev.clone() as Rc<RefCell<dyn IFile>>, "hda".to_owned());
             for part_number in 0..4{
                 if let Some(part_dev) = partitions::MBRPartitionFile::from(master_dev.clone() as Rc<RefCell<dyn IFile>>, part_number.try_into().unwrap()){
@@ -356,7 +381,7 @@ pub extern "C" fn main(r1: u32, r2: u32) -> ! {
         }
 
         if unsafe{(*ata_ref).borrow_mut().identify(ATADevice::SLAVE).is_some()}{
-            let slave_dev = Rc::new(RefCell::new(ATADeviceFile{bus: ata_ref.clone(), bus_device: ATADevice::SLAVE}));
+            let slave_dev = Rc::new(RefCell::new(block_cache::CachedDevice::new(Rc::new(RefCell::new(ATADeviceFile{bus: ata_ref.clone(), bus_device: ATADevice::SLAVE})))));
             (*dfs).borrow_mut().add_device_file(slave_dev.clone() as Rc<RefCell<dyn IFile>>, "hdb".to_owned());
             for part_number in 0..4{
                 if let Some(part_dev) = partitions::MBRPartitionFile::from(slave_dev.clone() as Rc<RefCell<dyn IFile>>, part_number.try_into().unwrap()){
@@ -371,10 +396,12 @@ pub extern "C" fn main(r1: u32, r2: u32) -> ! {
 
     if let Some(secondary_ata_bus) = unsafe{ ATABus::secondary_x86() }{
         let ata_ref = Rc::new(RefCell::new(secondary_ata_bus));
+        let (has_dma, name) = { let bus = (*ata_ref).borrow(); (bus.has_dma(), bus.name()) };
+        if has_dma { klog!(Info, "{} ata bus has a bus master controller, using dma :)", name); } else { klog!(Warn, "{} ata bus has no bus master controller, falling back to pio", name); }
         // NOTE: master device is not necessarilly the device from which the os was booted
     
         if unsafe{(*ata_ref).borrow_mut().identify(ATADevice::MASTER).is_some()}{
-            let master_dev = Rc::new(RefCell::new(ATADeviceFile{bus: ata_ref.clone(), bus_device: ATADevice::MASTER}));
+            let master_dev = Rc::new(RefCell::new(block_cache::CachedDevice::new(Rc::new(RefCell::new(ATADeviceFile{bus: ata_ref.clone(), bus_device: ATADevice::MASTER})))));
             (*dfs).borrow_mut().add_device_file(master_dev.clone() as Rc<RefCell<dyn IFile>>, "hdc".to_owned());
             for part_number in 0..4{
                 if let Some(part_dev) = partitions::MBRPartitionFile::from(master_dev.clone() as Rc<RefCell<dyn IFile>>, part_number.try_into().unwrap()){
@@ -387,7 +414,7 @@ pub extern "C" fn main(r1: u32, r2: u32) -> ! {
         }
 
         if unsafe{(*ata_ref).borrow_mut().identify(ATADevice::SLAVE).is_some()}{
-            let slave_dev = Rc::new(RefCell::new(ATADeviceFile{bus: ata_ref.clone(), bus_device: ATADevice::SLAVE}));
+            let slave_dev = Rc::new(RefCell::new(block_cache::CachedDevice::new(Rc::new(RefCell::new(ATADeviceFile{bus: ata_ref.clone(), bus_device: ATADevice::SLAVE})))));
             (*dfs).borrow_mut().add_device_file(slave_dev.clone() as Rc<RefCell<dyn IFile>>, "hdd".to_owned());
             for part_number in 0..4{
                 if let Some(part_dev) = partitions::MBRPartitionFile::from(slave_dev.clone() as Rc<RefCell<dyn IFile>>, part_number.try_into().unwrap()){
@@ -401,202 +428,391 @@ pub extern "C" fn main(r1: u32, r2: u32) -> ! {
     }
 
     let mut ps2 = unsafe { ps2_8042::PS2Device::x86_default() };
+    unsafe{
+        ps2.enable_irq();
+        interrupts::init_pic();
+        interrupts::set_handler(interrupts::PIC1_OFFSET+interrupts::KEYBOARD_IRQ, ps2_8042::keyboard_irq_handler as usize, interrupts::INTERRUPT_IST);
+        interrupts::set_handler(interrupts::PIC1_OFFSET+interrupts::COM1_IRQ, uart_16550::com1_irq_handler as usize, interrupts::INTERRUPT_IST);
+        interrupts::set_handler(interrupts::PIC2_OFFSET+interrupts::PRIMARY_ATA_IRQ-8, ata::primary_irq_handler as usize, interrupts::INTERRUPT_IST);
+    }
+    interrupts::unmask_irq(interrupts::KEYBOARD_IRQ);
+    interrupts::unmask_irq(interrupts::COM1_IRQ);
+    interrupts::unmask_irq(interrupts::PRIMARY_ATA_IRQ);
+    interrupts::unmask_irq(interrupts::SECONDARY_ATA_IRQ);
+    primitives::enable_interrupts();
+    // From here on logging doesn't wait for the uart
+    uart_16550::enable_log_irq_drain();
+
+    let boot_cycles = primitives::read_tsc() - main_entry_tsc;
+    klog!(Info, "Took {} ms to get to the shell", trace::cycles_to_ns(boot_cycles)/1_000_000);
+    if bench::is_bench_mode(cmdline) { bench::run_suite(boot_cycles); }
+
+    // The shell is just a task, so anything else that's spawned runs while it waits for keys
+    let mut executor = executor::Executor::new();
+    executor.spawn(async move {
+        let mut cur_dir = vfs::Path::try_from("/").unwrap();
+        write!(TERMINAL.lock(), "{} # ", cur_dir).unwrap();
+
+        let mut ignore_inc_x: bool; 
+        // Basically an ad-hoc ArrayString (arrayvec crate)
+        let mut cmd_buf: [u8; 80] = [b' '; 80]; 
+        let mut buf_ind = 0; // Also length of buf, a.k.a portion of buf used
+        // Everything a command allocates just for itself goes here, it's all thrown away when the next command starts
+        let mut cmd_arena = arena::Arena::new(CMD_ARENA_SIZE);
+        'big_loop: loop {
+            ignore_inc_x = false;
+            // Whatever the last command or key printed goes on screen in one go, before waiting for the next key
+            TERMINAL.lock().repaint();
+            let b = ps2.next_packet().await;
+
+            if b.typ == KeyboardPacketType::KEY_RELEASED && b.special_keys.ESC { break; }
+            if b.typ == KeyboardPacketType::KEY_RELEASED { continue; }
+
+            if b.special_keys.any_shift() && b.special_keys.UP_ARROW {
+                TERMINAL.lock().scroll_view(1);
+            } else if b.special_keys.any_shift() && b.special_keys.DOWN_ARROW {
+                TERMINAL.lock().scroll_view(-1);
+            } else if b.special_keys.UP_ARROW {
+                TERMINAL.lock().visual_cursor_up();
+            } else if b.special_keys.DOWN_ARROW{
+                TERMINAL.lock().visual_cursor_down();
+            } else if b.special_keys.RIGHT_ARROW {
+                TERMINAL.lock().visual_cursor_right();
+            }else if b.special_keys.LEFT_ARROW {
+                TERMINAL.lock().visual_cursor_left();
+            }
 
-    let mut cur_dir = vfs::Path::try_from("/").unwrap();
-    write!(TERMINAL.lock(), "{} # ", cur_dir).unwrap();
-
-    let mut ignore_inc_x: bool; 
-    // Basically an ad-hoc ArrayString (arrayvec crate)
-    let mut cmd_buf: [u8; 80] = [b' '; 80]; 
-    let mut buf_ind = 0; // Also length of buf, a.k.a portion of buf used
-    'big_loop: loop {
-        ignore_inc_x = false;
-        let b = unsafe { ps2.read_packet() };
-
-        if b.typ == KeyboardPacketType::KEY_RELEASED && b.special_keys.ESC { break; }
-        if b.typ == KeyboardPacketType::KEY_RELEASED { continue; }
-
-        if b.special_keys.UP_ARROW {
-            TERMINAL.lock().visual_cursor_up();
-        } else if b.special_keys.DOWN_ARROW{
-            TERMINAL.lock().visual_cursor_down();
-        } else if b.special_keys.RIGHT_ARROW {
-            TERMINAL.lock().visual_cursor_right();
-        }else if b.special_keys.LEFT_ARROW {
-            TERMINAL.lock().visual_cursor_left();
-        }
-
-        let mut c = match b.char_codepoint {
-            Some(v) => v,
-            None => continue
-        };
-
-        if b.special_keys.any_shift() { c = b.shift_codepoint().unwrap(); }
-
-        TERMINAL.lock().write_char(c);
-        if c == '\r' { ignore_inc_x = true; if buf_ind > 0 { buf_ind -= 1; } }
-        if c == '\n' {
-            let bufs = unsafe{from_utf8_unchecked(&cmd_buf[..buf_ind])}.trim();
-            buf_ind = 0; // Flush buffer
-            let mut splat = bufs.split_inclusive(' ');
-            if let Some(cmnd) = splat.next(){
-                // Handle shell built ins
-                if cmnd.contains("puts"){
-                    while let Some(arg) = splat.next(){
-                        write!(TERMINAL.lock(), "{}", arg).unwrap();
-                    }
-                    TERMINAL.lock().write_char('\n');
-                }else if cmnd.contains("whoareyou"){
-                    writeln!(TERMINAL.lock(), "Ron").unwrap();
-                }else if cmnd.contains("help"){
-                    writeln!(TERMINAL.lock(), "puts whoareyou rmvfsdir mkvfsdir mount.ext2 umount free hexdump ls cd clear exit help").unwrap();
-                }else if cmnd.contains("clear"){
-                    TERMINAL.lock().clear();
-                }else if cmnd.contains("free"){
-                    let heap_used = ALLOCATOR.lock().get_heap_used();
-                    let heap_max = ALLOCATOR.lock().get_heap_max();
-                    writeln!(TERMINAL.lock(), "{} bytes of {} bytes used on heap, that's {}% !", heap_used, heap_max, heap_used as f32/heap_max as f32 * 100.0).unwrap();
-                }else if cmnd.contains("mount.ext2"){
-                    if let (Some(file), Some(mntpoint)) = (splat.next(), splat.next()){
-                        let mut file_node = vfs::Path::try_from(file.trim());
-                        if !file.starts_with("/"){
-                            let mut actual_node = cur_dir.clone();
-                            actual_node.append(file);
-                            file_node = Ok(actual_node);
+            let mut c = match b.char_codepoint {
+                Some(v) => v,
+                None => continue
+            };
+
+            if b.special_keys.any_shift() { c = b.shift_codepoint().unwrap(); }
+
+            TERMINAL.lock().write_char(c);
+            if c == '\r' { ignore_inc_x = true; if buf_ind > 0 { buf_ind -= 1; } }
+            if c == '\n' {
+                cmd_arena.reset();
+                let bufs = unsafe{from_utf8_unchecked(&cmd_buf[..buf_ind])}.trim();
+                buf_ind = 0; // Flush buffer
+                let mut splat = bufs.split_inclusive(' ');
+                if let Some(cmnd) = splat.next(){
+                    // Handle shell built ins
+                    if cmnd.contains("puts"){
+                        while let Some(arg) = splat.next(){
+                            write!(TERMINAL.lock(), "{}", arg).unwrap();
                         }
-                        let file_node = if let Ok(val) = file_node { val } else { writeln!(TERMINAL.lock(), "Malformed source path: \"{}\"!", file).unwrap(); continue; };
-                        let file_node = if let Some(val) = file_node.get_node() { val } else { writeln!(TERMINAL.lock(), "Source path: \"{}\" does not exist!", file).unwrap(); continue; };
-                        let file_node = if let vfs::Node::File(val) = file_node { val } else { writeln!(TERMINAL.lock(), "Source path: \"{}\" is not a file!", file).unwrap(); continue;};
-                        let e2fs = ext2::Ext2FS::new(file_node);
-                        let e2fs = if let Some(val) = e2fs { val } else { writeln!(TERMINAL.lock(), "Source file does not contain a valid ext2 fs!").unwrap(); continue; };
-                        let e2fs = Rc::new(RefCell::new(e2fs));
-                        let root_inode = (*e2fs).borrow_mut().get_inode(2).expect("Root inode should exist!").as_vfs_node(e2fs.clone()).expect("Root inode should be parsable in vfs!").expect_folder();
-                        let mut mntpoint_node = vfs::Path::try_from(mntpoint.trim());
-                        if !mntpoint.starts_with("/"){
-                            let mut actual_node = cur_dir.clone();
-                            actual_node.append(mntpoint);
-                            mntpoint_node = Ok(actual_node);
+                        TERMINAL.lock().write_char('\n');
+                    }else if cmnd.contains("whoareyou"){
+                        writeln!(TERMINAL.lock(), "Ron").unwrap();
+                    }else if cmnd.contains("help"){
+                        writeln!(TERMINAL.lock(), "puts whoareyou rmvfsdir mkvfsdir mount.ext2 umount free cachestat membench logstat loglevel perf sync touch write sum hexdump elfload ls cd clear exit help").unwrap();
+                    }else if cmnd.contains("clear"){
+                        TERMINAL.lock().clear();
+                    }else if cmnd.contains("membench"){
+                        // Cycles per call of the mem* functions from 1 byte to 1 mb, each size gets about 16 mb of work
+                        const MAX_SIZE: usize = 1024*1024;
+                        let (erms, fsrm) = mem::get_features();
+                        writeln!(TERMINAL.lock(), "erms: {}, fsrm: {}", erms, fsrm).unwrap();
+                        writeln!(TERMINAL.lock(), "size: memcpy memmove memset memcmp ( cycles per call )").unwrap();
+                        let mut src = alloc::vec::Vec::new();
+                        src.resize(MAX_SIZE + 64, 0x5Au8);
+                        let mut dest = src.clone();
+                        let mut size = 1;
+                        while size <= MAX_SIZE {
+                            let iters = core::cmp::max(1, core::cmp::min(100_000, 16*MAX_SIZE/size));
+                            let time = |f: &mut dyn FnMut()| {
+                                let start = primitives::read_tsc();
+                                for _ in 0..iters { f(); }
+                                (primitives::read_tsc() - start) / iters as u64
+                            };
+                            let (s, d) = (src.as_ptr(), dest.as_mut_ptr());
+                            let copy = time(&mut || unsafe{ mem::memcpy(core::hint::black_box(d), s, size); });
+                            let moved = time(&mut || unsafe{ mem::memmove(core::hint::black_box(d).add(1), d, size); }); // Overlapping
+                            let set = time(&mut || unsafe{ mem::memset(core::hint::black_box(d), 0x5A, size); });
+                            let cmp = time(&mut || unsafe{ core::hint::black_box(mem::memcmp(core::hint::black_box(s), d, size)); });
+                            writeln!(TERMINAL.lock(), "{}: {} {} {} {}", size, copy, moved, set, cmp).unwrap();
+                            size *= 4;
                         }
-                        let mntpoint_node = if let Ok(val) = mntpoint_node { val } else { writeln!(TERMINAL.lock(), "Malformed mountpoint path!").unwrap(); continue;};
-                        let mntpoint_node = if let Some(val) = mntpoint_node.get_vfs_node() { val } else { writeln!(TERMINAL.lock(), "Mountpoint should exist in vfs!").unwrap(); continue; };
-                        (*mntpoint_node).borrow_mut().mountpoint = Some(root_inode);
-                    }else{
-                        writeln!(TERMINAL.lock(), "Not enough arguments!").unwrap();                
-                    }
-                }else if cmnd.contains("umount"){
-                    if let Some(mntpoint) = splat.next(){
-                        let mut mntpoint_node = vfs::Path::try_from(mntpoint.trim());
-                        if !mntpoint.starts_with("/"){
-                            let mut actual_node = cur_dir.clone();
-                            actual_node.append(mntpoint);
-                            mntpoint_node = Ok(actual_node);
+                    }else if cmnd.contains("free"){
+                        // NOTE: Take each lock once and copy everything out, writing to the terminal might allocate
+                        let (heap_used, heap_max, (heap_free, largest_free), fragmentation, slab_bytes) = {
+                            let heap = ALLOCATOR.lock();
+                            (heap.get_heap_used(), heap.get_heap_max(), heap.get_free_stats(), heap.get_fragmentation_percent(), heap.get_slab_bytes())
+                        };
+                        let (phys_free, phys_usable) = {
+                            let frames = frame_alloc::FRAME_ALLOCATOR.lock();
+                            (frames.get_free_bytes(), frames.get_usable_bytes())
+                        };
+                        let mags = allocator::get_magazine_stats();
+                        // Blocks sitting in the magazines look allocated to the heap, but nothing is using them
+                        let heap_used = heap_used.saturating_sub(mags.cached_bytes);
+                        writeln!(TERMINAL.lock(), "{} bytes of {} bytes used on heap, that's {}% !", heap_used, heap_max, heap_used as f32/heap_max as f32 * 100.0).unwrap();
+                        writeln!(TERMINAL.lock(), "{} bytes free outside of slabs, biggest free block is {} bytes, that's {}% fragmentation ({} bytes in slabs) !", heap_free, largest_free, fragmentation, slab_bytes).unwrap();
+                        writeln!(TERMINAL.lock(), "{} kb of {} kb of physical memory free !", phys_free/1024, phys_usable/1024).unwrap();
+                        let mag_hit_rate = if mags.hits+mags.misses != 0 { mags.hits as f32/(mags.hits+mags.misses) as f32 * 100.0 } else { 0.0 };
+                        writeln!(TERMINAL.lock(), "Command arena: {} of {} bytes used, {} allocations didn't fit and went to the heap", cmd_arena.get_used(), cmd_arena.get_capacity(), cmd_arena.get_overflows()).unwrap();
+                        writeln!(TERMINAL.lock(), "Magazines: {}% hit rate, {} allocator lock acquisitions, {} bytes cached ( not counted as used above )", mag_hit_rate, mags.lock_acquisitions, mags.cached_bytes).unwrap();
+                    }else if cfg!(feature = "lock_stats") && cmnd.contains("lockstat"){
+                        #[cfg(feature = "lock_stats")]
+                        {
+                            let stats = [("ALLOCATOR", ALLOCATOR.get_stats()), ("FRAME_ALLOCATOR", frame_alloc::FRAME_ALLOCATOR.get_stats()), ("UART", UART.get_stats()), ("TERMINAL", TERMINAL.get_stats()), ("BLOCK_CACHE", block_cache::BLOCK_CACHE.get_stats()), ("DENTRY_CACHE", dcache::DENTRY_CACHE.get_stats())];
+                            for (name, (acquisitions, contended, spin_cycles)) in stats.iter() {
+                                writeln!(TERMINAL.lock(), "{}: locked {} times, {} had to wait, {} cycles spent spinning", name, acquisitions, contended, spin_cycles).unwrap();
+                            }
                         }
-                        let mntpoint_node = if let Ok(val) = mntpoint_node { val } else { writeln!(TERMINAL.lock(), "Malformed mountpoint path!").unwrap(); continue;};
-                        let mntpoint_node = if let Some(val) = mntpoint_node.get_vfs_node() { val } else { writeln!(TERMINAL.lock(), "Mountpoint should exist in vfs!").unwrap(); continue; };
-                        (*mntpoint_node).borrow_mut().mountpoint = None;
-                    }else{
-                        writeln!(TERMINAL.lock(), "Not enough arguments!").unwrap();                
-                    }
-                }else if cmnd.contains("ls"){
-                    for subnode in (*cur_dir.get_node().expect("Shell path should be valid at all times!").expect_folder()).borrow().get_children(){
-                        write!(TERMINAL.lock(), "{} ", subnode.0).unwrap();
-                        if let Node::File(f) = subnode.1{
-                            write!(TERMINAL.lock(), "(size: {} kb) ", (*f).borrow().get_size() as f32 / 1024.0).unwrap();
+                    }else if cmnd.contains("perf"){
+                        // perf [serial|trace|reset|on|off], serial and trace go out the serial port as csv for scripts to pick up
+                        match splat.next().map(|arg| arg.trim()) {
+                            Some("reset") => trace::reset(),
+                            Some("on") => trace::set_enabled(true),
+                            Some("off") => trace::set_enabled(false),
+                            // NOTE: Flushed after every line, a dump is bigger than the log ring and lines that don't fit get dropped
+                            Some("serial") => {
+                                klog!(Info, "perf,name,calls,bytes,cycles,p50_cycles,p99_cycles,tsc_hz");
+                                uart_16550::flush_log_blocking();
+                                for (point, stats) in trace::get_all_point_stats().iter() {
+                                    klog!(Info, "perf,{},{},{},{},{},{},{}", point.name(), stats.calls, stats.bytes, stats.cycles, stats.p50_cycles, stats.p99_cycles, trace::get_tsc_hz());
+                                    uart_16550::flush_log_blocking();
+                                }
+                            },
+                            Some("trace") => {
+                                klog!(Info, "trace,cpu,name,start_ns,cycles,bytes");
+                                uart_16550::flush_log_blocking();
+                                for cpu in 0..smp::cpus_online() {
+                                    trace::for_each_event(cpu, |e| {
+                                        klog!(Info, "trace,{},{},{},{},{}", cpu, e.point.name(), trace::cycles_to_ns(e.start), e.cycles, e.bytes);
+                                        uart_16550::flush_log_blocking();
+                                    });
+                                }
+                            },
+                            _ => {
+                                writeln!(TERMINAL.lock(), "tracing is {}, tsc at {} mhz", if trace::is_enabled() { "on" } else { "off" }, trace::get_tsc_hz()/1_000_000).unwrap();
+                                for (point, stats) in trace::get_all_point_stats().iter() {
+                                    if stats.calls == 0 { continue; }
+                                    writeln!(TERMINAL.lock(), "{}: {} calls, {} bytes, {} us total, p50 < {} cycles, p99 < {} cycles", point.name(), stats.calls, stats.bytes, trace::cycles_to_ns(stats.cycles)/1000, stats.p50_cycles, stats.p99_cycles).unwrap();
+                                }
+                            }
                         }
-                    }
-                    writeln!(TERMINAL.lock()).unwrap();                
-                }else if cmnd.contains("hexdump"){
-                    if let (Some(offset_str), Some(arg)) = (splat.next(), splat.next()){
-                        if let Ok(offset) = offset_str.trim().parse::<usize>(){
-                            let mut found = None;
-                            for subnode in (*cur_dir.get_node().expect("Shell path should be valid at all times!").expect_folder()).borrow().get_children(){
-                               if subnode.0 == arg {
-                                   found = Some(subnode.1);
-                                   break;
-                               }
-                            }   
-                        
+                    }else if cmnd.contains("loglevel"){
+                        let level = match splat.next().map(|arg| arg.trim()) {
+                            Some("error") => log::LogLevel::Error,
+                            Some("warn") => log::LogLevel::Warn,
+                            Some("info") => log::LogLevel::Info,
+                            Some("debug") => log::LogLevel::Debug,
+                            _ => { writeln!(TERMINAL.lock(), "Expected one of: error warn info debug").unwrap(); continue; }
+                        };
+                        log::set_min_level(level);
+                    }else if cmnd.contains("logstat"){
+                        let (logged, dropped) = log::get_stats();
+                        writeln!(TERMINAL.lock(), "{} lines logged, {} dropped because the log ring was full", logged, dropped).unwrap();
+                    }else if cmnd.contains("cachestat"){
+                        let stats = block_cache::BLOCK_CACHE.lock().stats();
+                        let hit_rate = if stats.hits+stats.misses != 0 { stats.hits as f32/(stats.hits+stats.misses) as f32 * 100.0 } else { 0.0 };
+                        writeln!(TERMINAL.lock(), "{} hits, {} misses, that's a {}% hit rate !", stats.hits, stats.misses, hit_rate).unwrap();
+                        writeln!(TERMINAL.lock(), "{} of {} blocks used, {} dirty, {} written back ( {} failed ), {} prefetched", stats.used_blocks, stats.total_blocks, stats.dirty_blocks, stats.writebacks, stats.failed_writebacks, stats.prefetched).unwrap();
+                        let (dentry_hits, dentry_misses, dentries) = dcache::DENTRY_CACHE.lock().get_stats();
+                        writeln!(TERMINAL.lock(), "Dentry cache: {} hits, {} misses, {} names cached", dentry_hits, dentry_misses, dentries).unwrap();
+                        let (mappings, mapped_pages, idle_pages) = mmap::MAPPINGS.lock().get_stats();
+                        writeln!(TERMINAL.lock(), "{} file mappings, {} pages in memory ( {} of them idle )", mappings, mapped_pages, idle_pages).unwrap();
+                    }else if cmnd.contains("sync"){
+                        if block_cache::BLOCK_CACHE.lock().sync().is_err() { writeln!(TERMINAL.lock(), "Couldn't write back some blocks!").unwrap(); }
+                    }else if cmnd.contains("mount.ext2"){
+                        if let (Some(file), Some(mntpoint)) = (splat.next(), splat.next()){
+                            let file_node = if let Some(val) = vfs::lookup_path(&cur_dir.join_in(file.trim(), &cmd_arena)) { val } else { writeln!(TERMINAL.lock(), "Source path: \"{}\" does not exist!", file).unwrap(); continue; };
+                            let file_node = if let vfs::Node::File(val) = file_node { val } else { writeln!(TERMINAL.lock(), "Source path: \"{}\" is not a file!", file).unwrap(); continue;};
+                            let e2fs = ext2::Ext2FS::new(file_node);
+                            let e2fs = if let Some(val) = e2fs { val } else { writeln!(TERMINAL.lock(), "Source file does not contain a valid ext2 fs!").unwrap(); continue; };
+                            let e2fs = Rc::new(RefCell::new(e2fs));
+                            let root_inode = (*e2fs).borrow().get_inode(2).expect("Root inode should exist!");
+                            let root_inode = root_inode.as_vfs_node(2, e2fs.clone()).expect("Root inode should be parsable in vfs!").expect_folder();
+                            let mntpoint_node = if let Some(val) = vfs::lookup_vfs_path(&cur_dir.join_in(mntpoint.trim(), &cmd_arena)) { val } else { writeln!(TERMINAL.lock(), "Mountpoint should exist in vfs!").unwrap(); continue; };
+                            (*mntpoint_node).borrow_mut().set_mountpoint(Some(root_inode));
+                        }else{
+                            writeln!(TERMINAL.lock(), "Not enough arguments!").unwrap();                
+                        }
+                    }else if cmnd.contains("umount"){
+                        if let Some(mntpoint) = splat.next(){
+                            let mntpoint_node = if let Some(val) = vfs::lookup_vfs_path(&cur_dir.join_in(mntpoint.trim(), &cmd_arena)) { val } else { writeln!(TERMINAL.lock(), "Mountpoint should exist in vfs!").unwrap(); continue; };
+                            (*mntpoint_node).borrow_mut().set_mountpoint(None);
+                        }else{
+                            writeln!(TERMINAL.lock(), "Not enough arguments!").unwrap();                
+                        }
+                    }else if cmnd.contains("touch"){
+                        while let Some(name) = splat.next(){
+                            let folder = cur_dir.get_node().expect("Shell path should be valid at all times!").expect_folder();
+                            let created = (*folder).borrow_mut().create_file(name.trim());
+                            if created.is_none() { writeln!(TERMINAL.lock(), "Couldn't create file: \"{}\"!", name.trim()).unwrap(); }
+                        }
+                    }else if cmnd.contains("write"){
+                        if let Some(name) = splat.next(){
+                            let folder = cur_dir.get_node().expect("Shell path should be valid at all times!").expect_folder();
+                            if let Some(Node::File(file)) = dcache::lookup(&folder, name.trim()){
+                                // Appends the rest of the line
+                                let mut text = arena::ArenaString::new_in(&cmd_arena);
+                                while let Some(arg) = splat.next(){ text.push_str(arg); }
+                                text.push('\n');
+                                let size = (*file).borrow().get_size();
+                                if let Err(e) = (*file).borrow_mut().write_from(size, text.as_bytes()){
+                                    writeln!(TERMINAL.lock(), "Couldn't write to file: {:?}!", e).unwrap();
+                                }
+                            }else{
+                                writeln!(TERMINAL.lock(), "File not found!").unwrap();
+                            }
+                        }else{
+                            writeln!(TERMINAL.lock(), "Not enough arguments!").unwrap();
+                        }
+                    }else if cmnd.contains("ls"){
+                        let folder = cur_dir.get_node().expect("Shell path should be valid at all times!").expect_folder();
+                        // NOTE: Sizes come with the listing, looking every file up again would read the folder again for each of them
+                        let listing = (*folder).borrow().get_listing_in(&cmd_arena);
+                        for (name, _, size) in listing.iter(){
+                            write!(TERMINAL.lock(), "{} ", name).unwrap();
+                            if let Some(size) = size {
+                                write!(TERMINAL.lock(), "(size: {} kb) ", *size as f32 / 1024.0).unwrap();
+                            }
+                        }
+                        writeln!(TERMINAL.lock()).unwrap();                
+                    }else if cmnd.contains("sum"){
+                        // Adds up every byte of a file, split up into jobs that run on every cpu
+                        if let Some(arg) = splat.next(){
+                            let found = dcache::lookup(&cur_dir.get_node().expect("Shell path should be valid at all times!").expect_folder(), arg.trim());
                             if let Some(Node::File(file)) = found {
-                                if let Some(data) = (*file).borrow().read(offset, 16){
-                                    for e in data{
-                                        write!(TERMINAL.lock(), "0x{:02X} ", e).unwrap();
+                                let size = (*file).borrow().get_size();
+                                if let Some(data) = (*file).borrow().read(0, size){
+                                    const CHUNK_SIZE: usize = 64*1024;
+                                    let data = alloc::sync::Arc::new(data);
+                                    let total = alloc::sync::Arc::new(core::sync::atomic::AtomicU32::new(0));
+                                    let mut jobs: alloc::vec::Vec<smp::Job> = alloc::vec::Vec::new();
+                                    for chunk_start in (0..size).step_by(CHUNK_SIZE){
+                                        let (data, total) = (data.clone(), total.clone());
+                                        jobs.push(alloc::boxed::Box::new(move ||{
+                                            let chunk = &data[chunk_start..core::cmp::min(chunk_start+CHUNK_SIZE, data.len())];
+                                            let sum = chunk.iter().fold(0u32, |acc, b| acc.wrapping_add(*b as u32));
+                                            total.fetch_add(sum, core::sync::atomic::Ordering::Relaxed);
+                                        }));
+                                    }
+                                    smp::run_all(jobs);
+                                    writeln!(TERMINAL.lock(), "{:#010x} ( {} bytes )", total.load(core::sync::atomic::Ordering::Relaxed), size).unwrap();
+                                    for (cpu, (run, stolen)) in smp::get_stats().iter().enumerate(){
+                                        writeln!(TERMINAL.lock(), "cpu {}: {} jobs run, {} stolen", cpu, run, stolen).unwrap();
                                     }
                                 }else{
-                                    write!(TERMINAL.lock(), "Couldn't read file!").unwrap();
+                                    writeln!(TERMINAL.lock(), "Couldn't read file!").unwrap();
                                 }
                             }else{
-                                write!(TERMINAL.lock(), "File not found!").unwrap();
+                                writeln!(TERMINAL.lock(), "File not found!").unwrap();
                             }
-                        }else{
-                            write!(TERMINAL.lock(), "Bad offset!").unwrap();
                         }
-                    }else{
-                        write!(TERMINAL.lock(), "Not enough arguments!").unwrap();
-                    }
-                    writeln!(TERMINAL.lock()).unwrap();
-                }else if cmnd.contains("cd"){
-                    if let Some(name) = splat.next(){
-                        let name = name.trim();
-                        let old_dir = cur_dir.clone();
-                        if name == ".."{
-                            cur_dir.del_last();
-                        }else if name.starts_with("/"){
-                            if let Ok(new_dir) = name.try_into(){
-                                cur_dir = new_dir;
+                    }else if cmnd.contains("elfload"){
+                        // Maps an executable and faults in it's entry point, then throws it away again, there's nothing to run it in yet
+                        if let Some(arg) = splat.next(){
+                            let found = dcache::lookup(&cur_dir.get_node().expect("Shell path should be valid at all times!").expect_folder(), arg.trim());
+                            if let Some(Node::File(file)) = found {
+                                if let Some(image) = elf::load(file){
+                                    writeln!(TERMINAL.lock(), "Entry at {:#x} ( base {:#x} ), {} segments", image.entry, image.base, image.get_segment_count()).unwrap();
+                                    writeln!(TERMINAL.lock(), "{} cycles to entry, {} pages faulted", image.cycles_to_entry, image.pages_faulted).unwrap();
+                                    image.unload();
+                                }else{
+                                    writeln!(TERMINAL.lock(), "Not a position independent x86_64 elf executable!").unwrap();
+                                }
                             }else{
-                                writeln!(TERMINAL.lock(), "Invalid cd path!").unwrap();
+                                writeln!(TERMINAL.lock(), "File not found!").unwrap();
                             }
-                        }else{
-                            cur_dir.append(name);
                         }
-                        if cur_dir.get_node().is_none(){
-                            writeln!(TERMINAL.lock(), "Invalid cd path: {}!", cur_dir).unwrap();
-                            cur_dir = old_dir;
-                        }
-                    }
-                }else if cmnd.contains("mkvfsdir"){
-                    while let Some(name) = splat.next(){
-                       VFSNode::new_folder(cur_dir.get_vfs_node().expect("Shell path should be valid at all times!"), name);
-                    }
-                }else if cmnd.contains("rmvfsdir"){
-                    while let Some(name) = splat.next(){
-                        let cur_node = cur_dir.get_vfs_node().expect("Shell path should be valid at all times!");
-                        // Empty folder check
-                        if let Some(child_to_sacrifice) = VFSNode::find_folder(cur_node.clone(), name){
-                            if (*child_to_sacrifice).borrow().get_children().len() != 0 {
-                                writeln!(TERMINAL.lock(), "Folder: \"{}\", is non-empty!", name).unwrap();
-                                break;
+                    }else if cmnd.contains("hexdump"){
+                        if let (Some(offset_str), Some(arg)) = (splat.next(), splat.next()){
+                            // Optional length, 16 bytes by default, the buffer comes from the command arena so it can't be much bigger than that
+                            let len = core::cmp::min(splat.next().and_then(|len| len.trim().parse::<usize>().ok()).unwrap_or(16), MAX_HEXDUMP_LEN);
+                            if let Ok(offset) = offset_str.trim().parse::<usize>(){
+                                let found = dcache::lookup(&cur_dir.get_node().expect("Shell path should be valid at all times!").expect_folder(), arg.trim());
+                                if let Some(Node::File(file)) = found {
+                                    let mut data = alloc::vec::Vec::with_capacity_in(len, &cmd_arena);
+                                    data.resize(len, 0u8);
+                                    if let Ok(read) = (*file).borrow().read_into(offset, &mut data){
+                                        for e in &data[..read]{
+                                            write!(TERMINAL.lock(), "0x{:02X} ", e).unwrap();
+                                        }
+                                    }else{
+                                        write!(TERMINAL.lock(), "Couldn't read file!").unwrap();
+                                    }
+                                }else{
+                                    write!(TERMINAL.lock(), "File not found!").unwrap();
+                                }
+                            }else{
+                                write!(TERMINAL.lock(), "Bad offset!").unwrap();
                             }
                         }else{
-                            writeln!(TERMINAL.lock(), "Folder: \"{}\", does not exist!", name).unwrap();
-                            continue;
+                            write!(TERMINAL.lock(), "Not enough arguments!").unwrap();
                         }
-                        ////
+                        writeln!(TERMINAL.lock()).unwrap();
+                    }else if cmnd.contains("cd"){
+                        if let Some(name) = splat.next(){
+                            let name = name.trim();
+                            let old_dir = cur_dir.clone();
+                            if name == ".."{
+                                cur_dir.del_last();
+                            }else if name.starts_with("/"){
+                                if let Ok(new_dir) = name.try_into(){
+                                    cur_dir = new_dir;
+                                }else{
+                                    writeln!(TERMINAL.lock(), "Invalid cd path!").unwrap();
+                                }
+                            }else{
+                                cur_dir.append(name);
+                            }
+                            if cur_dir.get_node().is_none(){
+                                writeln!(TERMINAL.lock(), "Invalid cd path: {}!", cur_dir).unwrap();
+                                cur_dir = old_dir;
+                            }
+                        }
+                    }else if cmnd.contains("mkvfsdir"){
+                        while let Some(name) = splat.next(){
+                           VFSNode::new_folder(cur_dir.get_vfs_node().expect("Shell path should be valid at all times!"), name);
+                        }
+                    }else if cmnd.contains("rmvfsdir"){
+                        while let Some(name) = splat.next(){
+                            let cur_node = cur_dir.get_vfs_node().expect("Shell path should be valid at all times!");
+                            // Empty folder check
+                            if let Some(child_to_sacrifice) = VFSNode::find_folder(cur_node.clone(), name){
+                                if (*child_to_sacrifice).borrow().get_children().len() != 0 {
+                                    writeln!(TERMINAL.lock(), "Folder: \"{}\", is non-empty!", name).unwrap();
+                                    break;
+                                }
+                            }else{
+                                writeln!(TERMINAL.lock(), "Folder: \"{}\", does not exist!", name).unwrap();
+                                continue;
+                            }
+                            ////
           
-                        if !VFSNode::del_folder(cur_node, name){ writeln!(TERMINAL.lock(), "Couldn't delete folder: \"{}\"!", name).unwrap(); }
+                            if !VFSNode::del_folder(cur_node, name){ writeln!(TERMINAL.lock(), "Couldn't delete folder: \"{}\"!", name).unwrap(); }
+                        }
+                    }else if cmnd.contains("elp"){
+                        writeln!(TERMINAL.lock(), "NOPERS, no elp!").unwrap();
+                    }else if cmnd.contains("exit"){
+                        break 'big_loop;
                     }
-                }else if cmnd.contains("elp"){
-                    writeln!(TERMINAL.lock(), "NOPERS, no elp!").unwrap();
-                }else if cmnd.contains("exit"){
-                    break 'big_loop;
+
                 }
 
+                write!(TERMINAL.lock(), "{} # ", cur_dir).unwrap();
+                continue;
             }
 
-            write!(TERMINAL.lock(), "{} # ", cur_dir).unwrap();
-            continue;
-        }
+            if buf_ind < cmd_buf.len() { 
+                cmd_buf[buf_ind] = c as u8; 
+                if !ignore_inc_x { buf_ind += 1; }
+            }
 
-        if buf_ind < cmd_buf.len() { 
-            cmd_buf[buf_ind] = c as u8; 
-            if !ignore_inc_x { buf_ind += 1; }
         }
+    });
+    executor.run();
 
-    }
-
-    writeln!(UART.lock(), "Heap usage: {} bytes", allocator::ALLOCATOR.lock().get_heap_used()).unwrap();
+    if block_cache::BLOCK_CACHE.lock().sync().is_err() { klog!(Error, "Couldn't write back some cached blocks before shutdown!"); }
+    klog!(Info, "Heap usage: {} bytes", allocator::ALLOCATOR.lock().get_heap_used());
     // Shutdown
-    writeln!(UART.lock(), "\nIt's now safe to turn off your computer!").unwrap();
+    klog!(Info, "\nIt's now safe to turn off your computer!");
+    uart_16550::flush_log_blocking();
 
     let width = TERMINAL.lock().fb.get_width();
     let height = TERMINAL.lock().fb.get_height();
@@ -605,6 +821,7 @@ pub extern "C" fn main(r1: u32, r2: u32) -> ! {
     TERMINAL.lock().fb.fill(0, 0, width, height, Pixel{r: 0, g: 0, b: 0});
     let s = "It's now safe to turn off your computer!";
     s.chars().enumerate().for_each(|(ind, c)|{TERMINAL.lock().fb.write_char(ind+cols/2-s.len()/2, (rows-1)/2, c, Pixel{r: 0xff ,g: 0xff, b: 0x55});});
+    TERMINAL.lock().fb.present();
     
     loop{}
 }
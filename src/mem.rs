@@ -0,0 +1,244 @@
+use core::{arch::{asm, x86_64::{__cpuid_count, _mm_loadu_si128, _mm_cmpeq_epi8, _mm_movemask_epi8, __m128i}}, sync::atomic::{AtomicBool, AtomicUsize, Ordering}};
+
+use crate::primitives::{disable_interrupts, enable_interrupts};
+
+// The libc functions the compiler emits calls to
+// NOTE: The loops are asm on purpose, llvm happily turns a copy loop written in rust back into a call to memcpy, which is this
+
+// From this size on rep movsb/stosb beats the sse loops, if the cpu has fast strings ( erms )
+static REP_THRESHOLD: AtomicUsize = AtomicUsize::new(usize::MAX);
+static HAS_ERMS: AtomicBool = AtomicBool::new(false);
+static HAS_FSRM: AtomicBool = AtomicBool::new(false);
+const ERMS_THRESHOLD: usize = 2048;
+const FSRM_THRESHOLD: usize = 256; // Fast short rep mov makes rep movsb good a lot earlier
+
+/// Picks the implementations for this cpu, until then everything uses the sse2 loops
+/// NOTE: No avx, nothing turns on the avx state in xcr0 and the irq handlers don't save it
+pub fn init() {
+    let leaf7 = unsafe { __cpuid_count(7, 0) };
+    let erms = leaf7.ebx & (1 << 9) != 0;
+    let fsrm = leaf7.edx & (1 << 4) != 0;
+    HAS_ERMS.store(erms, Ordering::Relaxed);
+    HAS_FSRM.store(fsrm, Ordering::Relaxed);
+    let threshold = if fsrm { FSRM_THRESHOLD } else if erms { ERMS_THRESHOLD } else { usize::MAX };
+    REP_THRESHOLD.store(threshold, Ordering::Relaxed);
+}
+
+/// (erms, fsrm)
+pub fn get_features() -> (bool, bool) {
+    (HAS_ERMS.load(Ordering::Relaxed), HAS_FSRM.load(Ordering::Relaxed))
+}
+
+/// Copies n < 16 bytes, every load happens before any store so it's fine for overlapping buffers too
+#[inline(always)]
+unsafe fn copy_small(dest: *mut u8, src: *const u8, n: usize) {
+    if n >= 8 {
+        asm!("mov {a}, [{s}]", "mov {b}, [{s} + {n} - 8]", "mov [{d}], {a}", "mov [{d} + {n} - 8], {b}",
+            s = in(reg) src, d = in(reg) dest, n = in(reg) n, a = out(reg) _, b = out(reg) _, options(nostack, preserves_flags));
+    } else if n >= 4 {
+        asm!("mov {a:e}, [{s}]", "mov {b:e}, [{s} + {n} - 4]", "mov [{d}], {a:e}", "mov [{d} + {n} - 4], {b:e}",
+            s = in(reg) src, d = in(reg) dest, n = in(reg) n, a = out(reg) _, b = out(reg) _, options(nostack, preserves_flags));
+    } else if n > 0 {
+        // First, middle and last byte covers 1, 2 and 3
+        asm!("movzx {a:e}, byte ptr [{s}]", "movzx {b:e}, byte ptr [{s} + {h}]", "movzx {c:e}, byte ptr [{s} + {n} - 1]",
+            "mov [{d}], {a:l}", "mov [{d} + {h}], {b:l}", "mov [{d} + {n} - 1], {c:l}",
+            s = in(reg) src, d = in(reg) dest, n = in(reg) n, h = in(reg) n/2, a = out(reg) _, b = out(reg) _, c = out(reg) _, options(nostack, preserves_flags));
+    }
+}
+
+/// n >= 16 and the buffers don't overlap
+/// The first and last 16 bytes are done unaligned, everything in between with aligned stores, 64 bytes at a time
+#[inline(always)]
+unsafe fn copy_sse(dest: *mut u8, src: *const u8, n: usize) {
+    asm!(
+        "movdqu {x0}, [{s}]",
+        "movdqu {tail}, [{s} + {n} - 16]",
+        "lea {end}, [{d} + {n} - 16]",
+        "movdqu [{d}], {x0}",
+        // Skip to the first 16 byte aligned dest, the head store already covered the bytes before it
+        "mov {t}, {d}",
+        "neg {t}",
+        "and {t}, 15",
+        "add {s}, {t}",
+        "add {d}, {t}",
+        "sub {n}, {t}",
+        "cmp {n}, 64",
+        "jb 3f",
+        "2:",
+        "movdqu {x0}, [{s}]",
+        "movdqu {x1}, [{s} + 16]",
+        "movdqu {x2}, [{s} + 32]",
+        "movdqu {x3}, [{s} + 48]",
+        "movdqa [{d}], {x0}",
+        "movdqa [{d} + 16], {x1}",
+        "movdqa [{d} + 32], {x2}",
+        "movdqa [{d} + 48], {x3}",
+        "add {s}, 64",
+        "add {d}, 64",
+        "sub {n}, 64",
+        "cmp {n}, 64",
+        "jae 2b",
+        "3:",
+        "cmp {n}, 16",
+        "jb 5f",
+        "4:",
+        "movdqu {x0}, [{s}]",
+        "movdqa [{d}], {x0}",
+        "add {s}, 16",
+        "add {d}, 16",
+        "sub {n}, 16",
+        "cmp {n}, 16",
+        "jae 4b",
+        "5:",
+        "movdqu [{end}], {tail}",
+        s = inout(reg) src => _, d = inout(reg) dest => _, n = inout(reg) n => _, t = out(reg) _, end = out(reg) _,
+        x0 = out(xmm_reg) _, x1 = out(xmm_reg) _, x2 = out(xmm_reg) _, x3 = out(xmm_reg) _, tail = out(xmm_reg) _,
+        options(nostack)
+    );
+}
+
+/// Forwards, so also fine for overlapping buffers as long as dest < src
+#[inline(always)]
+unsafe fn copy_rep_movsb(dest: *mut u8, src: *const u8, n: usize) {
+    asm!("rep movsb", inout("rcx") n => _, inout("rdi") dest => _, inout("rsi") src => _, options(nostack, preserves_flags));
+}
+
+/// Backwards, for overlapping buffers with dest > src, the odd bytes at the end first then 8 bytes at a time
+unsafe fn copy_backward(dest: *mut u8, src: *const u8, n: usize) {
+    // NOTE: Everything else expects the direction flag to be clear, so no interrupts while it's set
+    let were_enabled = disable_interrupts();
+    asm!(
+        "std",
+        "rep movsb",
+        "sub rsi, 7",
+        "sub rdi, 7",
+        "mov rcx, {words}",
+        "rep movsq",
+        "cld",
+        words = in(reg) n/8,
+        inout("rcx") n%8 => _, inout("rdi") dest.add(n-1) => _, inout("rsi") src.add(n-1) => _,
+        options(nostack)
+    );
+    if were_enabled { enable_interrupts(); }
+}
+
+/// n >= 16, same idea as copy_sse
+#[inline(always)]
+unsafe fn set_sse(dest: *mut u8, c: u8, n: usize) {
+    let pattern = c as u64 * 0x0101_0101_0101_0101;
+    asm!(
+        "movq {x}, {p}",
+        "punpcklqdq {x}, {x}",
+        "movdqu [{d}], {x}",
+        "movdqu [{d} + {n} - 16], {x}",
+        "mov {t}, {d}",
+        "neg {t}",
+        "and {t}, 15",
+        "add {d}, {t}",
+        "sub {n}, {t}",
+        "cmp {n}, 64",
+        "jb 3f",
+        "2:",
+        "movdqa [{d}], {x}",
+        "movdqa [{d} + 16], {x}",
+        "movdqa [{d} + 32], {x}",
+        "movdqa [{d} + 48], {x}",
+        "add {d}, 64",
+        "sub {n}, 64",
+        "cmp {n}, 64",
+        "jae 2b",
+        "3:",
+        "cmp {n}, 16",
+        "jb 5f",
+        "4:",
+        "movdqa [{d}], {x}",
+        "add {d}, 16",
+        "sub {n}, 16",
+        "cmp {n}, 16",
+        "jae 4b",
+        "5:",
+        p = in(reg) pattern, d = inout(reg) dest => _, n = inout(reg) n => _, t = out(reg) _, x = out(xmm_reg) _,
+        options(nostack)
+    );
+}
+
+#[inline(always)]
+unsafe fn set_small(dest: *mut u8, c: u8, n: usize) {
+    let pattern = c as u64 * 0x0101_0101_0101_0101;
+    if n >= 8 {
+        asm!("mov [{d}], {p}", "mov [{d} + {n} - 8], {p}", d = in(reg) dest, n = in(reg) n, p = in(reg) pattern, options(nostack, preserves_flags));
+    } else if n >= 4 {
+        asm!("mov [{d}], {p:e}", "mov [{d} + {n} - 4], {p:e}", d = in(reg) dest, n = in(reg) n, p = in(reg) pattern, options(nostack, preserves_flags));
+    } else if n > 0 {
+        asm!("mov [{d}], {p:l}", "mov [{d} + {h}], {p:l}", "mov [{d} + {n} - 1], {p:l}", d = in(reg) dest, n = in(reg) n, h = in(reg) n/2, p = in(reg) pattern, options(nostack, preserves_flags));
+    }
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn memcpy(dest: *mut u8, src: *const u8, n: usize) -> *mut u8 {
+    if n < 16 {
+        copy_small(dest, src, n);
+    } else if n >= REP_THRESHOLD.load(Ordering::Relaxed) {
+        copy_rep_movsb(dest, src, n);
+    } else {
+        copy_sse(dest, src, n);
+    }
+    dest
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn memmove(dest: *mut u8, src: *const u8, n: usize) -> *mut u8 {
+    let (d, s) = (dest as usize, src as usize);
+    if d == s { return dest; }
+    if n < 16 {
+        copy_small(dest, src, n);
+    } else if d + n <= s || s + n <= d {
+        memcpy(dest, src, n);
+    } else if d < s {
+        copy_rep_movsb(dest, src, n);
+    } else {
+        copy_backward(dest, src, n);
+    }
+    dest
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn memset(dest: *mut u8, c: isize, n: usize) -> *mut u8 {
+    let c = c as u8;
+    if n < 16 {
+        set_small(dest, c, n);
+    } else if n >= REP_THRESHOLD.load(Ordering::Relaxed) {
+        asm!("rep stosb", inout("rcx") n => _, inout("rdi") dest => _, in("al") c, options(nostack, preserves_flags));
+    } else {
+        set_sse(dest, c, n);
+    }
+    dest
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn memcmp(ptr1: *const u8, ptr2: *const u8, n: usize) -> i32 {
+    let mut i = 0;
+    // 16 bytes at a time, the movemask has a 0 bit for every byte that differs
+    while i + 16 <= n {
+        let a = _mm_loadu_si128(ptr1.add(i) as *const __m128i);
+        let b = _mm_loadu_si128(ptr2.add(i) as *const __m128i);
+        let eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) as u32;
+        if eq != 0xFFFF {
+            let j = i + (!eq).trailing_zeros() as usize;
+            return *ptr1.add(j) as i32 - *ptr2.add(j) as i32;
+        }
+        i += 16;
+    }
+    while i < n {
+        let (a, b) = (*ptr1.add(i), *ptr2.add(i));
+        if a != b { return a as i32 - b as i32; }
+        i += 1;
+    }
+    0
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn bcmp(ptr1: *const u8, ptr2: *const u8, n: usize) -> i32 {
+    if n == 0 { return 0; }
+    memcmp(ptr1, ptr2, n)
+}
@@ -0,0 +1,248 @@
+use core::{cell::RefCell, sync::atomic::{AtomicUsize, Ordering}};
+
+use alloc::{rc::Rc, vec::Vec};
+
+use crate::{primitives::{Mutex, LazyInitialised}, vfs::IFile, frame_alloc::{FRAME_ALLOCATOR, FRAME_SIZE}, virtmem::{KERNEL_PAGE_TABLES, PageFlags, PageSize, TlbFlush, PAGE_SIZE, HUGE_PAGE_SIZE}};
+
+// NOTE: 1 tb, way past the identity map, so mappings can't collide with physical memory
+const MMAP_BASE: usize = 0x100_0000_0000;
+// Page fault error code bits
+const PF_PRESENT: u64 = 1 << 0;
+const PF_WRITE: u64 = 1 << 1;
+// File pages nothing maps anymore are kept around up to this many, so mapping the same file again ( running the same program twice, say ) doesn't read it again
+const MAX_IDLE_PAGES: usize = 512;
+
+// Bumped by note_file_write
+static FILE_WRITES: AtomicUsize = AtomicUsize::new(0);
+
+pub static MAPPINGS: Mutex<LazyInitialised<MappingTable>> = Mutex::from(LazyInitialised::uninit());
+
+/// A file page that is in memory, shared by every mapping of that part of the file
+#[derive(Debug)]
+struct CachedPage {
+    file: (usize, usize),
+    page: usize, // Index of the page in the file
+    frame: usize,
+    users: usize, // How many mappings have it mapped, idle pages have 0
+    last_used: usize // When it went idle, the oldest ones get evicted first
+}
+
+struct Mapping {
+    start: usize,
+    len: usize,
+    file: Rc<RefCell<dyn IFile>>,
+    file_id: (usize, usize),
+    offset: usize, // Page aligned offset into the file
+    file_len: usize, // Bytes of the file past offset that show up in the mapping, the rest reads as zeroes ( like an elf segment's bss )
+    writable: bool,
+    private: bool // Pages are a copy of the file that's never written back or shared, instead of the file's cached pages
+}
+
+/// Keeps track of every file mapping and the pages backing them
+/// Pages are read in on the first fault, through the file's read_into ( so from the block cache for block devices and ext2 ), and stay cached a while after nothing maps them
+/// NOTE: Don't touch mapped memory while holding MAPPINGS, the block cache or a borrow of the mapped file, the fault handler needs all of those
+pub struct MappingTable {
+    mappings: Vec<Mapping>,
+    pages: Vec<CachedPage>,
+    next_virt: usize,
+    clock: usize, // Counts unmapped pages, for last_used
+    writes_seen: usize, // FILE_WRITES when the idle pages were last known to match their files
+    faults: usize,
+    shared_faults: usize // Faults where the page was already in memory
+}
+
+impl core::fmt::Debug for MappingTable {
+    fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
+        f.debug_struct("MappingTable").field("mappings", &self.mappings.len()).field("pages", &self.pages).field("next_virt", &self.next_virt).field("faults", &self.faults).finish()
+    }
+}
+
+fn file_id(file: &Rc<RefCell<dyn IFile>>) -> (usize, usize) {
+    (**file).borrow().get_id().unwrap_or((Rc::as_ptr(file) as *const () as usize, 0))
+}
+
+impl MappingTable {
+    pub fn new() -> Self {
+        Self { mappings: Vec::new(), pages: Vec::new(), next_virt: MMAP_BASE, clock: 0, writes_seen: 0, faults: 0, shared_faults: 0 }
+    }
+
+    /// Hands out len bytes of address space, for putting several mappings next to each other with map_at
+    /// NOTE: Address space is plentiful, so it's never reused, and every reservation starts in a fresh 2 mb chunk so unmapping can drop whole tables
+    pub fn reserve(&mut self, len: usize) -> usize {
+        let start = self.next_virt;
+        self.next_virt += (len + HUGE_PAGE_SIZE - 1)/HUGE_PAGE_SIZE*HUGE_PAGE_SIZE;
+        start
+    }
+
+    /// Maps [offset, offset+file_len) of file at virt, which has to be in space from reserve, and zeroes after that up to len
+    /// Nothing is read until it's touched, virt and offset have to be page aligned
+    pub fn map_at(&mut self, virt: usize, file: Rc<RefCell<dyn IFile>>, offset: usize, file_len: usize, len: usize, writable: bool, private: bool) -> Option<()> {
+        if virt % PAGE_SIZE != 0 || offset % PAGE_SIZE != 0 || len == 0 { return None; }
+        let len = (len + PAGE_SIZE - 1)/PAGE_SIZE*PAGE_SIZE;
+        if virt < MMAP_BASE || virt.checked_add(len)? > self.next_virt { return None; }
+        if self.mappings.iter().any(|m| virt < m.start+m.len && m.start < virt+len) { return None; }
+        let file_id = file_id(&file);
+        self.mappings.push(Mapping { start: virt, len, file, file_id, offset, file_len, writable, private });
+        Some(())
+    }
+
+    /// Removes the mapping starting at addr, writing back it's pages if it was writable
+    pub fn unmap(&mut self, addr: *mut u8) -> Option<()> {
+        let index = self.mappings.iter().position(|m| m.start == addr as usize)?;
+        self.forget_stale_pages();
+        let mapping = self.mappings.swap_remove(index);
+        let mut pt = KERNEL_PAGE_TABLES.lock();
+        let mut flush = TlbFlush::new();
+        for virt in (mapping.start..mapping.start+mapping.len).step_by(PAGE_SIZE) {
+            // Only pages that were faulted in are mapped
+            let phys = if let Some(phys) = pt.translate(virt) { phys } else { continue; };
+            if mapping.private {
+                FRAME_ALLOCATOR.lock().free_frames(phys, 1);
+                continue;
+            }
+            let page = (mapping.offset + virt - mapping.start)/PAGE_SIZE;
+            // FIXME: Writes back every page of a writable mapping, we could check the dirty bit instead
+            if mapping.writable {
+                let mut file = (*mapping.file).borrow_mut();
+                let file_offset = page*PAGE_SIZE;
+                let end = core::cmp::min(file.get_size(), mapping.offset.saturating_add(mapping.file_len));
+                if file_offset < end {
+                    let data = unsafe { core::slice::from_raw_parts(phys as *const u8, core::cmp::min(PAGE_SIZE, end - file_offset)) };
+                    let _ = file.write_from(file_offset, data);
+                }
+            }
+            if !is_shared(&mapping, page) {
+                FRAME_ALLOCATOR.lock().free_frames(phys, 1);
+                continue;
+            }
+            if let Some(cached) = self.pages.iter_mut().find(|p| p.file == mapping.file_id && p.page == page) {
+                cached.users -= 1;
+                if cached.users == 0 {
+                    cached.last_used = self.clock;
+                    self.clock += 1;
+                }
+            }
+        }
+        unsafe { pt.unmap_range(mapping.start, mapping.len, &mut flush); }
+        flush.flush();
+        // NOTE: The only writes since forget_stale_pages were ours, and those came from the cached pages themselves
+        self.writes_seen = FILE_WRITES.load(Ordering::Acquire);
+        self.evict_idle(MAX_IDLE_PAGES);
+        Some(())
+    }
+
+    /// Frees the longest idle pages until at most max_idle are left
+    fn evict_idle(&mut self, max_idle: usize) {
+        let mut idle = self.pages.iter().filter(|p| p.users == 0).count();
+        while idle > max_idle {
+            let oldest = self.pages.iter().enumerate().filter(|(_, p)| p.users == 0).min_by_key(|(_, p)| p.last_used).map(|(i, _)| i).expect("Should have an idle page!");
+            FRAME_ALLOCATOR.lock().free_frames(self.pages[oldest].frame, 1);
+            self.pages.swap_remove(oldest);
+            idle -= 1;
+        }
+    }
+
+    /// Drops every idle page if any file was written since they were read, they might not match anymore
+    /// NOTE: Pages that are still mapped are kept, writing to a file that is mapped was never going to be coherent
+    fn forget_stale_pages(&mut self) {
+        let writes = FILE_WRITES.load(Ordering::Acquire);
+        if writes == self.writes_seen { return; }
+        self.evict_idle(0);
+        self.writes_seen = writes;
+    }
+
+    /// Maps in the page containing addr if it belongs to a mapping, reading it from the file if it isn't in memory already
+    fn handle_fault(&mut self, addr: usize, error_code: u64) -> bool {
+        self.forget_stale_pages();
+        let mapping = if let Some(m) = self.mappings.iter().find(|m| addr >= m.start && addr < m.start+m.len) { m } else { return false; };
+        if error_code & PF_PRESENT != 0 { return false; } // Protection violation, like writing to a read only mapping
+        if error_code & PF_WRITE != 0 && !mapping.writable { return false; }
+
+        let virt = addr/PAGE_SIZE*PAGE_SIZE;
+        let page = (mapping.offset + virt - mapping.start)/PAGE_SIZE;
+        let flags = if mapping.writable { PageFlags::PRESENT | PageFlags::WRITABLE } else { PageFlags::PRESENT };
+        self.faults += 1;
+
+        if !is_shared(mapping, page) {
+            let frame = if let Some(frame) = read_page(mapping, page) { frame } else { return false; };
+            let mut flush = TlbFlush::new();
+            let mapped = unsafe { KERNEL_PAGE_TABLES.lock().map_page(virt, frame, PageSize::Small, flags, &mut flush) };
+            flush.flush();
+            if mapped.is_none() { FRAME_ALLOCATOR.lock().free_frames(frame, 1); }
+            return mapped.is_some();
+        }
+
+        let cached = match self.pages.iter().position(|p| p.file == mapping.file_id && p.page == page) {
+            Some(cached) => { self.shared_faults += 1; cached },
+            None => {
+                let frame = if let Some(frame) = read_page(mapping, page) { frame } else { return false; };
+                self.pages.push(CachedPage { file: mapping.file_id, page, frame, users: 0, last_used: self.clock });
+                self.pages.len()-1
+            }
+        };
+
+        let mut flush = TlbFlush::new();
+        let mapped = unsafe { KERNEL_PAGE_TABLES.lock().map_page(virt, self.pages[cached].frame, PageSize::Small, flags, &mut flush) };
+        flush.flush();
+        // NOTE: If that failed a freshly read page just stays idle, it's still good for the next fault
+        if mapped.is_none() { return false; }
+        self.pages[cached].users += 1;
+        true
+    }
+
+    /// Returns (mappings, pages in memory, how many of those nothing maps right now)
+    pub fn get_stats(&self) -> (usize, usize, usize) { (self.mappings.len(), self.pages.len(), self.pages.iter().filter(|p| p.users == 0).count()) }
+    /// Returns (page faults handled, how many of them found the page already in memory)
+    pub fn get_fault_stats(&self) -> (usize, usize) { (self.faults, self.shared_faults) }
+}
+
+/// Whether page of the file can be one of the file's cached pages, private mappings never share
+/// NOTE: A cached page's contents can't depend on the mapping, so one that goes past the mapping's file_len gets a private copy with the zeroes in it
+fn is_shared(mapping: &Mapping, page: usize) -> bool {
+    !mapping.private && (page+1)*PAGE_SIZE <= mapping.offset.saturating_add(mapping.file_len)
+}
+
+/// Reads page of mapping's file into a fresh frame, zeroing whatever is past the end of the file or the mapping's file_len
+fn read_page(mapping: &Mapping, page: usize) -> Option<usize> {
+    let frame = FRAME_ALLOCATOR.lock().alloc_frames(1)?;
+    // NOTE: Frames are identity mapped, so the page can be filled in place
+    let buf = unsafe { core::slice::from_raw_parts_mut(frame as *mut u8, FRAME_SIZE) };
+    let file = (*mapping.file).borrow();
+    let file_offset = page*PAGE_SIZE;
+    let end = core::cmp::min(file.get_size(), mapping.offset.saturating_add(mapping.file_len));
+    let n = if file_offset < end { core::cmp::min(PAGE_SIZE, end - file_offset) } else { 0 };
+    buf[n..].fill(0);
+    if n != 0 && file.read_into(file_offset, &mut buf[..n]) != Ok(n) {
+        FRAME_ALLOCATOR.lock().free_frames(frame, 1);
+        return None;
+    }
+    Some(frame)
+}
+
+/// Has to be called by anything that changes a file's contents, so idle pages that were read before that aren't handed out again
+/// NOTE: Lock free, so it's fine to call while MAPPINGS is held ( unmap writing pages back does that )
+pub fn note_file_write() {
+    FILE_WRITES.fetch_add(1, Ordering::Release);
+}
+
+/// Page fault hook for interrupts
+pub fn page_fault_hook(addr: usize, error_code: u64) -> bool {
+    // NOTE: If whatever faulted was holding the lock there is nothing we can do, it's a bug anyways
+    if MAPPINGS.is_locked() { return false; }
+    MAPPINGS.lock().handle_fault(addr, error_code)
+}
+
+/// See MappingTable::reserve
+pub fn reserve(len: usize) -> usize {
+    MAPPINGS.lock().reserve(len)
+}
+
+/// Maps part of file at virt, see MappingTable::map_at
+pub fn mmap_at(virt: usize, file: Rc<RefCell<dyn IFile>>, offset: usize, file_len: usize, len: usize, writable: bool, private: bool) -> Option<*mut u8> {
+    MAPPINGS.lock().map_at(virt, file, offset, file_len, len, writable, private)?;
+    Some(virt as *mut u8)
+}
+
+pub fn munmap(addr: *mut u8) -> Option<()> {
+    MAPPINGS.lock().unmap(addr)
+}
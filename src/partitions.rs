@@ -1,8 +1,8 @@
 use core::{convert::TryFrom, cell::RefCell};
 
-use alloc::{rc::Rc, vec::Vec};
+use alloc::rc::Rc;
 
-use crate::{vfs::IFile, ata};
+use crate::{vfs::{IFile, IOError}, ata};
 
 #[repr(u8)]
 #[derive(Clone, Copy)]
@@ -33,7 +33,8 @@ pub struct MBRPartitionFile{
 impl MBRPartitionFile{
   pub fn from(device_file: Rc<RefCell<dyn IFile>>, partition_number: MBRPartitionNumber) -> Option<Self>{
     let part_data_offset = (partition_number as usize)*16 + (0x1fe-16*4);
-    if let Some(part_data) = device_file.borrow().read(part_data_offset, 16){
+    let mut part_data = [0u8; 16];
+    if device_file.borrow().read_into(part_data_offset, &mut part_data) == Ok(part_data.len()){
       // If SYSTEM_ID/partition type is 0 then the partition is unused
       if part_data[4] == 0x0 { return None; } 
       Some(Self{
@@ -51,17 +52,25 @@ impl MBRPartitionFile{
 }
 
 impl IFile for MBRPartitionFile{
-    fn read(&self, offset: usize, len: usize) -> Option<Vec<u8>> {
-      if offset+len >= self.partition_size{ return None; }
-      (*self.device).borrow().read(offset+self.partition_offset, len)
+    fn read_into(&self, offset: usize, buf: &mut [u8]) -> Result<usize, IOError> {
+      if offset > self.partition_size{ return Err(IOError::OutOfBounds); }
+      let len = core::cmp::min(buf.len(), self.partition_size - offset);
+      (*self.device).borrow().read_into(offset+self.partition_offset, &mut buf[..len])
     }
 
-    fn write(&mut self, offset: usize, data: &[u8]) {
-      if offset+data.len() >= self.partition_size{ return; }
-      (*self.device).borrow_mut().write(offset+self.partition_offset, data);
+    fn write_from(&mut self, offset: usize, data: &[u8]) -> Result<usize, IOError> {
+      if offset > self.partition_size{ return Err(IOError::OutOfBounds); }
+      let len = core::cmp::min(data.len(), self.partition_size - offset);
+      (*self.device).borrow_mut().write_from(offset+self.partition_offset, &data[..len])
     }
 
     fn get_size(&self) -> usize {
         self.partition_size
     }
+
+    fn prefetch(&self, offset: usize, len: usize) {
+      if offset >= self.partition_size { return; }
+      let len = core::cmp::min(len, self.partition_size - offset);
+      (*self.device).borrow().prefetch(offset+self.partition_offset, len)
+    }
 }
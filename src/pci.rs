@@ -0,0 +1,69 @@
+use crate::virtmem::KernPointer;
+
+// Configuration space access mechanism #1
+// Source: https://wiki.osdev.org/PCI#Configuration_Space_Access_Mechanism_.231
+const CONFIG_ADDRESS_PORT: u16 = 0xCF8;
+const CONFIG_DATA_PORT: u16 = 0xCFC;
+
+pub const CLASS_MASS_STORAGE: u8 = 0x01;
+pub const SUBCLASS_IDE: u8 = 0x01;
+
+#[derive(Clone, Copy, Debug)]
+pub struct PciDevice{
+    pub bus: u8,
+    pub device: u8,
+    pub function: u8
+}
+
+impl PciDevice{
+    fn config_address(&self, offset: u8) -> u32 {
+        (1 << 31) | ((self.bus as u32) << 16) | ((self.device as u32) << 11) | ((self.function as u32) << 8) | ((offset as u32) & 0xFC)
+    }
+
+    pub unsafe fn read_config(&self, offset: u8) -> u32 {
+        KernPointer::<u32>::from_port(CONFIG_ADDRESS_PORT).write(self.config_address(offset));
+        KernPointer::<u32>::from_port(CONFIG_DATA_PORT).read()
+    }
+
+    pub unsafe fn write_config(&self, offset: u8, val: u32) {
+        KernPointer::<u32>::from_port(CONFIG_ADDRESS_PORT).write(self.config_address(offset));
+        KernPointer::<u32>::from_port(CONFIG_DATA_PORT).write(val);
+    }
+
+    pub unsafe fn vendor_id(&self) -> u16 {
+        (self.read_config(0x00) & 0xFFFF) as u16
+    }
+
+    /// Returns (class, subclass, programming interface)
+    pub unsafe fn class(&self) -> (u8, u8, u8) {
+        let v = self.read_config(0x08);
+        (((v >> 24) & 0xFF) as u8, ((v >> 16) & 0xFF) as u8, ((v >> 8) & 0xFF) as u8)
+    }
+
+    pub unsafe fn bar(&self, n: u8) -> u32 {
+        assert!(n < 6, "Type 0 pci headers only have 6 bars!");
+        self.read_config(0x10 + n*4)
+    }
+
+    /// Allows the device to initiate DMA transfers on it's own
+    pub unsafe fn enable_bus_mastering(&self) {
+        let command_and_status = self.read_config(0x04);
+        // NOTE: Writing back the status half as 0 is fine, as it's bits are cleared by writing 1's
+        self.write_config(0x04, (command_and_status & 0xFFFF) | (1 << 2));
+    }
+}
+
+/// Brute force scan of every bus/device/function for the first device with a matching class
+pub unsafe fn find_by_class(class: u8, subclass: u8) -> Option<PciDevice> {
+    for bus in 0..=255u8 {
+        for device in 0..32u8 {
+            for function in 0..8u8 {
+                let dev = PciDevice{bus, device, function};
+                if dev.vendor_id() == 0xFFFF { if function == 0 { break; } else { continue; } } // Nothing here
+                let (c, sc, _) = dev.class();
+                if c == class && sc == subclass { return Some(dev); }
+            }
+        }
+    }
+    None
+}
@@ -1,4 +1,6 @@
-use core::{sync::atomic::AtomicBool, cell::UnsafeCell};
+use core::{sync::atomic::{AtomicUsize, Ordering}, cell::UnsafeCell, arch::asm};
+#[cfg(feature = "lock_stats")]
+use core::sync::atomic::AtomicU64;
 use core::ops::{Deref, DerefMut};
 use core::fmt::{Debug, Formatter, Error};
 
@@ -44,15 +46,35 @@ impl<T> DerefMut for LazyInitialised<T>{
 }
 
 pub struct MutexGuard<'lock_lifetime, T>{
-    lock_ref: &'lock_lifetime AtomicBool,
+    lock_ref: &'lock_lifetime Mutex<T>,
     inner_ref: &'lock_lifetime mut T
 }
 
+// FIXME: Arbitrary number, it's cycles now so it at least doesn't depend on how fast the spin loop is ( ~5 seconds at 3 ghz )
+const DEADLOCK_WARNING_CYCLES: u64 = 1 << 34;
+
+pub fn read_tsc() -> u64 {
+    unsafe{ core::arch::x86_64::_rdtsc() }
+}
+
+/// Ticket lock, every locker takes a ticket and waits for it to be served, so the lock is handed out in the order it was asked for
+/// NOTE: Only the owner ever writes now_serving, so unlocking is a plain store
 pub struct Mutex<T> {
-    lock: AtomicBool,
+    next_ticket: AtomicUsize,
+    now_serving: AtomicUsize,
+    #[cfg(feature = "lock_stats")]
+    stats: LockStats,
     inner: UnsafeCell<T>,
 }
 
+/// How hot a lock is, only there with the lock_stats feature
+#[cfg(feature = "lock_stats")]
+pub struct LockStats{
+    acquisitions: AtomicU64,
+    contended: AtomicU64, // Acquisitions that had to wait
+    spin_cycles: AtomicU64
+}
+
 unsafe impl<T> Sync for Mutex<T>{ }
 unsafe impl<T> Send for Mutex<T>{ }
 
@@ -61,20 +83,23 @@ impl<T> Debug for Mutex<T>
 where T: Debug{
 
 fn fmt(&self, f: &mut Formatter<'_>) -> Result<(), Error> { 
-   f.debug_struct("Mutex").field("lock", &self.lock).field("inner", unsafe{&*self.inner.get()}).finish()
+   f.debug_struct("Mutex").field("next_ticket", &self.next_ticket).field("now_serving", &self.now_serving).field("inner", unsafe{&*self.inner.get()}).finish()
 }
 
 }
 impl<T> Mutex<T> 
 where T: Debug{
     pub fn is_locked(&self) -> bool{
-        self.lock.load(core::sync::atomic::Ordering::Relaxed)
+        self.now_serving.load(Ordering::Relaxed) != self.next_ticket.load(Ordering::Relaxed)
     }
 
     pub const fn from(val: T) -> Self{
         Self{
             inner: UnsafeCell::new(val),
-            lock: AtomicBool::new(false)
+            next_ticket: AtomicUsize::new(0),
+            now_serving: AtomicUsize::new(0),
+            #[cfg(feature = "lock_stats")]
+            stats: LockStats{ acquisitions: AtomicU64::new(0), contended: AtomicU64::new(0), spin_cycles: AtomicU64::new(0) }
         }
     }
 
@@ -83,21 +108,35 @@ where T: Debug{
     }
 
     pub fn lock(&self) -> MutexGuard<T>{
-        let mut deadlock_warning_iter_count = 1_000_000; // FIXME: Arbitrary number
-        while self.lock.compare_exchange_weak(false, true, core::sync::atomic::Ordering::Acquire, core::sync::atomic::Ordering::Relaxed).is_err() {
-            while self.is_locked(){ 
-                core::hint::spin_loop(); 
-                deadlock_warning_iter_count -= 1; 
-                if deadlock_warning_iter_count == 0{ panic!("Tried one million (1,000,000) times but couldn't lock mutex: {:?} :(, is your system too fast, or too slow?!", self); }
+        let ticket = self.next_ticket.fetch_add(1, Ordering::Relaxed);
+        if self.now_serving.load(Ordering::Acquire) != ticket {
+            let start = read_tsc();
+            while self.now_serving.load(Ordering::Acquire) != ticket {
+                core::hint::spin_loop();
+                // NOTE: Printing self would need the lock, so just say where it is
+                if read_tsc() - start > DEADLOCK_WARNING_CYCLES { panic!("Waited {} cycles but couldn't lock mutex at {:p} :(, is someone holding it forever?!", DEADLOCK_WARNING_CYCLES, self); }
+            }
+            #[cfg(feature = "lock_stats")]
+            {
+                self.stats.contended.fetch_add(1, Ordering::Relaxed);
+                self.stats.spin_cycles.fetch_add(read_tsc() - start, Ordering::Relaxed);
             }
         }
+        #[cfg(feature = "lock_stats")]
+        self.stats.acquisitions.fetch_add(1, Ordering::Relaxed);
 
        MutexGuard{
-        lock_ref: &self.lock,
+        lock_ref: self,
         inner_ref: unsafe{&mut *self.inner.get()},
       }
     }
 
+    /// Returns (acquisitions, acquisitions that had to wait, cycles spent waiting)
+    #[cfg(feature = "lock_stats")]
+    pub fn get_stats(&self) -> (u64, u64, u64){
+        (self.stats.acquisitions.load(Ordering::Relaxed), self.stats.contended.load(Ordering::Relaxed), self.stats.spin_cycles.load(Ordering::Relaxed))
+    }
+
 }
 
 impl<'lock_lifetime, T> Deref for MutexGuard<'lock_lifetime, T>{
@@ -116,8 +155,18 @@ impl<'lock_lifetime, T> DerefMut for MutexGuard<'lock_lifetime, T>{
 
 impl<'lock_lifetime, T> Drop for MutexGuard<'lock_lifetime, T>{
     fn drop(&mut self){
-        while self.lock_ref.compare_exchange_weak(true, false, core::sync::atomic::Ordering::Release, core::sync::atomic::Ordering::Relaxed).is_err(){
-            core::hint::spin_loop();
-        }
+        let served = self.lock_ref.now_serving.load(Ordering::Relaxed);
+        self.lock_ref.now_serving.store(served.wrapping_add(1), Ordering::Release);
     }
-}
\ No newline at end of file
+}
+
+/// Disables interrupts, returns whether they were enabled before
+pub fn disable_interrupts() -> bool {
+    let rflags: u64;
+    unsafe{ asm!("pushfq", "pop {}", "cli", out(reg) rflags); }
+    rflags & (1 << 9) != 0
+}
+
+pub fn enable_interrupts() {
+    unsafe{ asm!("sti", options(nomem, nostack)); }
+}
@@ -1,4 +1,4 @@
-use crate::{X86Default, hio::{KeyboardPacket, KeyboardPacketType}, virtmem::KernPointer};
+use crate::{X86Default, hio::{KeyboardPacket, KeyboardPacketType}, virtmem::KernPointer, ring_buffer::SpscRing, interrupts::{self, InterruptStackFrame}, executor::{IrqWaker, RingFuture}};
 use packed_struct::prelude::*;
 
 
@@ -78,6 +78,19 @@ impl X86Default for PS2Device {
     }
 }
 
+// Filled by the irq handler, emptied by next_packet
+static SCANCODES: SpscRing<u8, 256> = SpscRing::new(0);
+static SCANCODE_WAKER: IrqWaker = IrqWaker::new();
+
+pub extern "x86-interrupt" fn keyboard_irq_handler(_frame: InterruptStackFrame) {
+    // NOTE: Can't lock anything here, the code we interrupted might be holding it, so the ports are used directly
+    let b = unsafe { KernPointer::<u8>::from_port(0x60).read() };
+    // FIXME: Keys pressed when the buffer is full are just lost
+    SCANCODES.push(b);
+    SCANCODE_WAKER.wake();
+    interrupts::end_of_interrupt(interrupts::KEYBOARD_IRQ);
+}
+
 pub const scan_code_set_1: [char; 128] = [
     ' ', ' ', '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\r', '\t', 'q', 'w',
     'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n', ' ', 'a', 's', 'd', 'f', 'g', 'h', 'j',
@@ -89,20 +102,40 @@ pub const scan_code_set_1: [char; 128] = [
 ];
 
 impl PS2Device {
-    pub unsafe fn read_byte(&mut self) -> u8 {
+    // NOTE: These two only run while the controller is set up, before the irq is on, so polling is all there is
+    unsafe fn poll_byte(&mut self) -> u8 {
         wait_for!(StatusRegister::unpack_from_slice(&[self.status_and_command.read()]).unwrap().is_output_buf_full);
         self.data.read()
     }
 
+    unsafe fn write_command(&mut self, cmd: u8) {
+        wait_for!(!StatusRegister::unpack_from_slice(&[self.status_and_command.read()]).unwrap().is_input_buf_full);
+        self.status_and_command.write(cmd);
+    }
+
+    /// Makes the controller raise irq 1 for the first port, from then on bytes come through keyboard_irq_handler
+    /// NOTE: Has to be called before the irq is unmasked, otherwise the handler would eat the config byte
+    pub unsafe fn enable_irq(&mut self) {
+        self.write_command(0x20); // Read config byte
+        let config = self.poll_byte();
+        self.write_command(0x60); // Write config byte
+        wait_for!(!StatusRegister::unpack_from_slice(&[self.status_and_command.read()]).unwrap().is_input_buf_full);
+        self.data.write((config | 0b1) & !0b10); // First port irq on, second port irq off
+    }
+
+    /// Waits for the next key, letting other tasks run in the meantime
     /// NOTE: Assumes scan code set 1
-    pub unsafe fn read_packet(&mut self) -> KeyboardPacket {
-        let mut b = self.read_byte();
+    pub async fn next_packet(&mut self) -> KeyboardPacket {
+        let mut b = RingFuture::new(&SCANCODES, &SCANCODE_WAKER).await;
         let mut multibyte = false;
-        // Multibyte
         if b == 0xE0 {
-            b = self.read_byte();
+            b = RingFuture::new(&SCANCODES, &SCANCODE_WAKER).await;
             multibyte = true;
         }
+        self.decode(b, multibyte)
+    }
+
+    fn decode(&mut self, b: u8, multibyte: bool) -> KeyboardPacket {
         let old_special = self.special_keys;
         
         match b {
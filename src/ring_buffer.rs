@@ -0,0 +1,39 @@
+use core::{cell::UnsafeCell, sync::atomic::{AtomicUsize, Ordering}};
+
+/// Lock free ring buffer for exactly one producer ( say an interrupt handler ) and one consumer
+/// NOTE: N has to be a power of two, head and tail just keep counting up and get masked when used
+pub struct SpscRing<T: Copy, const N: usize> {
+    buf: UnsafeCell<[T; N]>,
+    head: AtomicUsize, // Next slot to read, only the consumer writes it
+    tail: AtomicUsize  // Next slot to write, only the producer writes it
+}
+
+unsafe impl<T: Copy, const N: usize> Sync for SpscRing<T, N> {}
+
+impl<T: Copy, const N: usize> SpscRing<T, N> {
+    pub const fn new(fill: T) -> Self {
+        assert!(N.is_power_of_two(), "Ring buffer size has to be a power of two!");
+        Self { buf: UnsafeCell::new([fill; N]), head: AtomicUsize::new(0), tail: AtomicUsize::new(0) }
+    }
+
+    /// Returns false if the buffer is full, the value is dropped in that case
+    pub fn push(&self, val: T) -> bool {
+        let tail = self.tail.load(Ordering::Relaxed);
+        if tail.wrapping_sub(self.head.load(Ordering::Acquire)) == N { return false; }
+        unsafe { (*self.buf.get())[tail % N] = val; }
+        self.tail.store(tail.wrapping_add(1), Ordering::Release);
+        true
+    }
+
+    pub fn pop(&self) -> Option<T> {
+        let head = self.head.load(Ordering::Relaxed);
+        if head == self.tail.load(Ordering::Acquire) { return None; }
+        let val = unsafe { (*self.buf.get())[head % N] };
+        self.head.store(head.wrapping_add(1), Ordering::Release);
+        Some(val)
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.head.load(Ordering::Acquire) == self.tail.load(Ordering::Acquire)
+    }
+}
@@ -0,0 +1,248 @@
+use core::{arch::asm, sync::atomic::{AtomicUsize, Ordering}};
+
+use alloc::{boxed::Box, collections::VecDeque, sync::Arc, vec::Vec};
+
+use crate::{primitives::{Mutex, disable_interrupts}, interrupts::{self, InterruptStackFrame}, frame_alloc::{FRAME_ALLOCATOR, FRAME_SIZE}, virtmem::{self, KernPointer}};
+
+pub const MAX_CPUS: usize = 8;
+const AP_STACK_SIZE: usize = 64*1024;
+// Where the trampoline gets copied to, aps start in real mode so it has to be under 1 mb and page aligned
+// NOTE: Inside the reserved low memory, so the frame allocator never hands it out
+const TRAMPOLINE_BASE: usize = 0x8000;
+
+// Local apic registers
+// Source: Intel SDM vol. 3, chapter 10 ( advanced programmable interrupt controller )
+const IA32_APIC_BASE_MSR: u32 = 0x1B;
+const IA32_GS_BASE_MSR: u32 = 0xC000_0101;
+const IA32_EFER_MSR: u32 = 0xC000_0080;
+const LAPIC_EOI: usize = 0xB0;
+const LAPIC_SPURIOUS: usize = 0xF0;
+const LAPIC_ICR_LOW: usize = 0x300;
+const LAPIC_ICR_HIGH: usize = 0x310;
+const LAPIC_LVT_LINT0: usize = 0x350;
+const LAPIC_LVT_LINT1: usize = 0x360;
+const ICR_ALL_EXCLUDING_SELF: u32 = 0b11 << 18;
+const ICR_DELIVERY_PENDING: u32 = 1 << 12;
+pub const WAKEUP_VECTOR: u8 = 0xF0;
+const SPURIOUS_VECTOR: u8 = 0xFF;
+
+extern "C" {
+    static ap_trampoline_start: u8;
+    static ap_trampoline_end: u8;
+    static ap_tramp_cr3: u8;
+    static ap_tramp_cr4: u8;
+    static ap_tramp_cr0: u8;
+    static ap_tramp_efer: u8;
+    static ap_tramp_entry: u8;
+    static ap_tramp_stack_base: u8;
+    static ap_tramp_stack_size: u8;
+    static ap_tramp_max_cpus: u8;
+}
+
+pub type Job = Box<dyn FnOnce() + Send>;
+
+struct JobQueue(VecDeque<Job>);
+
+impl core::fmt::Debug for JobQueue {
+    fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
+        f.debug_struct("JobQueue").field("len", &self.0.len()).finish()
+    }
+}
+
+/// Everything a cpu owns, found through the gs base
+/// NOTE: id has to stay the first field, cpu_id() reads it with gs:[0]
+#[repr(C)]
+pub struct PerCpu {
+    id: usize,
+    // The owner pushes and pops at the back, thieves take from the front, so a thief gets the oldest ( and usually biggest ) piece of work
+    queue: Mutex<JobQueue>,
+    jobs_run: AtomicUsize,
+    jobs_stolen: AtomicUsize
+}
+
+const fn per_cpu(id: usize) -> PerCpu {
+    PerCpu { id, queue: Mutex::from(JobQueue(VecDeque::new())), jobs_run: AtomicUsize::new(0), jobs_stolen: AtomicUsize::new(0) }
+}
+
+static PER_CPU: [PerCpu; MAX_CPUS] = [per_cpu(0), per_cpu(1), per_cpu(2), per_cpu(3), per_cpu(4), per_cpu(5), per_cpu(6), per_cpu(7)];
+static CPUS_ONLINE: AtomicUsize = AtomicUsize::new(1);
+static LAPIC_BASE: AtomicUsize = AtomicUsize::new(0);
+
+unsafe fn read_msr(msr: u32) -> u64 {
+    let (low, high): (u32, u32);
+    asm!("rdmsr", in("ecx") msr, out("eax") low, out("edx") high, options(nomem, nostack));
+    (high as u64) << 32 | low as u64
+}
+
+unsafe fn write_msr(msr: u32, val: u64) {
+    asm!("wrmsr", in("ecx") msr, in("eax") val as u32, in("edx") (val >> 32) as u32, options(nostack));
+}
+
+unsafe fn lapic_read(reg: usize) -> u32 {
+    core::ptr::read_volatile((LAPIC_BASE.load(Ordering::Relaxed) + reg) as *const u32)
+}
+
+unsafe fn lapic_write(reg: usize, val: u32) {
+    core::ptr::write_volatile((LAPIC_BASE.load(Ordering::Relaxed) + reg) as *mut u32, val);
+}
+
+unsafe fn send_ipi(icr_low: u32) {
+    lapic_write(LAPIC_ICR_HIGH, 0);
+    lapic_write(LAPIC_ICR_LOW, icr_low);
+    while lapic_read(LAPIC_ICR_LOW) & ICR_DELIVERY_PENDING != 0 { core::hint::spin_loop(); }
+}
+
+/// FIXME: Crude, a write to port 0x80 takes about a microsecond, should use a calibrated timer
+fn delay_us(us: usize) {
+    for _ in 0..us { unsafe { KernPointer::<u8>::from_port(0x80).write(0); } }
+}
+
+/// Index of the cpu we are running on, the bsp is 0
+pub fn cpu_id() -> usize {
+    let id: usize;
+    unsafe { asm!("mov {}, gs:[0]", out(reg) id, options(readonly, nostack)); }
+    id
+}
+
+pub fn cpus_online() -> usize { CPUS_ONLINE.load(Ordering::Acquire) }
+
+fn this_cpu() -> &'static PerCpu { &PER_CPU[cpu_id()] }
+
+unsafe fn set_per_cpu(id: usize) {
+    write_msr(IA32_GS_BASE_MSR, &PER_CPU[id] as *const PerCpu as u64);
+}
+
+extern "x86-interrupt" fn wakeup_handler(_frame: InterruptStackFrame) {
+    // NOTE: Waking up from hlt was the whole point, there's nothing else to do
+    unsafe { lapic_write(LAPIC_EOI, 0); }
+}
+
+extern "x86-interrupt" fn spurious_handler(_frame: InterruptStackFrame) {}
+
+/// Sets up per cpu data for the bsp, has to run before anything uses cpu_id()
+pub unsafe fn init_bsp() {
+    set_per_cpu(0);
+}
+
+/// Starts every other cpu with INIT-SIPI-SIPI, returns how many cpus are running afterwards
+/// NOTE: Needs interrupts::init() to have run, the aps load the same idt and their own tss from there
+pub unsafe fn start_aps() -> usize {
+    let cpuid = core::arch::x86_64::__cpuid(1);
+    if cpuid.edx & (1 << 9) == 0 { return cpus_online(); } // No local apic, so no way to wake the other cpus
+    LAPIC_BASE.store((read_msr(IA32_APIC_BASE_MSR) & 0xF_FFFF_F000) as usize, Ordering::Relaxed);
+
+    // The trampoline goes through 32-bit protected mode, where only 32 bits of cr3 can be loaded
+    let cr3: u64;
+    asm!("mov {}, cr3", out(reg) cr3, options(nomem, nostack));
+    if cr3 >= 1 << 32 { return cpus_online(); }
+
+    // The bsp might still be relying on the firmware having the apic in virtual wire mode for the pic's irqs, make sure it is
+    if lapic_read(LAPIC_SPURIOUS) & (1 << 8) == 0 {
+        lapic_write(LAPIC_LVT_LINT0, 0b111 << 8); // ExtINT
+        lapic_write(LAPIC_LVT_LINT1, 0b100 << 8); // NMI
+    }
+    lapic_write(LAPIC_SPURIOUS, (1 << 8) | SPURIOUS_VECTOR as u32);
+    interrupts::set_handler(WAKEUP_VECTOR, wakeup_handler as usize, interrupts::INTERRUPT_IST);
+    interrupts::set_handler(SPURIOUS_VECTOR, spurious_handler as usize, interrupts::INTERRUPT_IST);
+
+    let stacks = if let Some(stacks) = FRAME_ALLOCATOR.lock().alloc_frames((MAX_CPUS-1)*AP_STACK_SIZE/FRAME_SIZE) { stacks } else { return cpus_online(); };
+
+    // Copy the trampoline down and fill in it's parameters
+    let start = core::ptr::addr_of!(ap_trampoline_start) as usize;
+    let len = core::ptr::addr_of!(ap_trampoline_end) as usize - start;
+    core::ptr::copy_nonoverlapping(start as *const u8, TRAMPOLINE_BASE as *mut u8, len);
+    let param = |sym: *const u8, val: u64| core::ptr::write_volatile((TRAMPOLINE_BASE + (sym as usize - start)) as *mut u64, val);
+    let (cr0, cr4): (u64, u64);
+    asm!("mov {}, cr0", out(reg) cr0, options(nomem, nostack));
+    asm!("mov {}, cr4", out(reg) cr4, options(nomem, nostack));
+    param(core::ptr::addr_of!(ap_tramp_cr3), cr3);
+    param(core::ptr::addr_of!(ap_tramp_cr4), cr4 & !(1 << 17)); // PCIDE can only be turned on in long mode
+    param(core::ptr::addr_of!(ap_tramp_cr0), cr0);
+    param(core::ptr::addr_of!(ap_tramp_efer), read_msr(IA32_EFER_MSR) & !(1 << 10)); // LMA gets set by the cpu
+    param(core::ptr::addr_of!(ap_tramp_entry), ap_main as usize as u64);
+    param(core::ptr::addr_of!(ap_tramp_stack_base), stacks as u64); // ap n ( starting at 1 ) gets [base + (n-1)*size, base + n*size)
+    param(core::ptr::addr_of!(ap_tramp_stack_size), AP_STACK_SIZE as u64);
+    param(core::ptr::addr_of!(ap_tramp_max_cpus), MAX_CPUS as u64);
+
+    // NOTE: Broadcast, so there's no need to find out the apic ids ( from the acpi tables ) first, every ap grabs an id in the trampoline
+    send_ipi(ICR_ALL_EXCLUDING_SELF | (0b101 << 8) | (1 << 14)); // INIT, assert
+    delay_us(10_000);
+    for _ in 0..2 {
+        send_ipi(ICR_ALL_EXCLUDING_SELF | (0b110 << 8) | (TRAMPOLINE_BASE >> 12) as u32); // Startup
+        delay_us(200);
+    }
+    // Give them some time to get going
+    delay_us(100_000);
+    cpus_online()
+}
+
+extern "C" fn ap_main(id: usize) -> ! {
+    unsafe {
+        set_per_cpu(id);
+        interrupts::load_tables(id);
+        virtmem::init_pat();
+        lapic_write(LAPIC_LVT_LINT0, 1 << 16); // Masked, the pic's irqs only go to the bsp
+        lapic_write(LAPIC_SPURIOUS, (1 << 8) | SPURIOUS_VECTOR as u32);
+    }
+    CPUS_ONLINE.fetch_add(1, Ordering::AcqRel);
+    loop {
+        if let Some(job) = find_job() {
+            job();
+            this_cpu().jobs_run.fetch_add(1, Ordering::Relaxed);
+            continue;
+        }
+        // Sleep until someone pushes work and sends the wakeup ipi, checking with interrupts off so the ipi can't be missed
+        disable_interrupts();
+        if !any_work() {
+            unsafe { asm!("sti", "hlt", options(nomem, nostack)); }
+        } else {
+            unsafe { asm!("sti", options(nomem, nostack)); }
+        }
+    }
+}
+
+fn any_work() -> bool {
+    PER_CPU.iter().any(|cpu| !cpu.queue.lock().0.is_empty())
+}
+
+/// Takes a job from our own queue, or steals the oldest one from someone else's
+fn find_job() -> Option<Job> {
+    let me = this_cpu();
+    if let Some(job) = me.queue.lock().0.pop_back() { return Some(job); }
+    for i in 1..MAX_CPUS {
+        let victim = &PER_CPU[(me.id + i) % MAX_CPUS];
+        if let Some(job) = victim.queue.lock().0.pop_front() {
+            me.jobs_stolen.fetch_add(1, Ordering::Relaxed);
+            return Some(job);
+        }
+    }
+    None
+}
+
+/// Queues a job on this cpu, idle cpus get woken up to steal it
+pub fn spawn_job(job: impl FnOnce() + Send + 'static) {
+    this_cpu().queue.lock().0.push_back(Box::new(job));
+    if cpus_online() > 1 { unsafe { send_ipi(ICR_ALL_EXCLUDING_SELF | (1 << 14) | WAKEUP_VECTOR as u32); } }
+}
+
+/// Runs every job and returns once they are all done, this cpu helps out instead of just waiting
+pub fn run_all(jobs: Vec<Job>) {
+    let remaining = Arc::new(AtomicUsize::new(jobs.len()));
+    for job in jobs {
+        let remaining = remaining.clone();
+        spawn_job(move || { job(); remaining.fetch_sub(1, Ordering::AcqRel); });
+    }
+    while remaining.load(Ordering::Acquire) != 0 {
+        if let Some(job) = find_job() {
+            job();
+            this_cpu().jobs_run.fetch_add(1, Ordering::Relaxed);
+        } else {
+            core::hint::spin_loop();
+        }
+    }
+}
+
+/// Returns (jobs run, jobs stolen) for every cpu that's online
+pub fn get_stats() -> Vec<(usize, usize)> {
+    PER_CPU[..cpus_online()].iter().map(|cpu| (cpu.jobs_run.load(Ordering::Relaxed), cpu.jobs_stolen.load(Ordering::Relaxed))).collect()
+}
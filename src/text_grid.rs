@@ -0,0 +1,119 @@
+use alloc::{collections::VecDeque, vec, vec::Vec};
+
+use crate::framebuffer::Pixel;
+
+#[derive(Clone, Copy)]
+pub struct Cell {
+    pub c: char,
+    pub color: Pixel
+}
+
+pub const BLANK_CELL: Cell = Cell { c: ' ', color: Pixel { r: 0, g: 0, b: 0 } };
+
+/// What's on screen plus the lines that scrolled off the top of it, this only keeps track of text, nothing gets drawn here
+/// Writes just mark rows dirty, whoever draws asks for the dirty rows and how far things scrolled since it last drew
+/// NOTE: Rows are screen rows, 0 is the top of the screen, not the oldest line
+pub struct TextGrid {
+    cols: usize,
+    rows: usize,
+    lines: VecDeque<Vec<Cell>>, // Oldest first, the last `rows` of them are the live screen
+    max_lines: usize,
+    dirty: Vec<bool>, // Per screen row
+    pending_scroll: usize, // Lines the screen moved up since the last repaint, those pixels can just be moved
+    view_offset: usize // How far back the view is scrolled, 0 is following the output
+}
+
+impl TextGrid {
+    pub fn new(cols: usize, rows: usize, scrollback: usize) -> Self {
+        let mut lines = VecDeque::with_capacity(rows + scrollback);
+        for _ in 0..rows { lines.push_back(vec![BLANK_CELL; cols]); }
+        Self { cols, rows, lines, max_lines: rows + scrollback, dirty: vec![true; rows], pending_scroll: 0, view_offset: 0 }
+    }
+
+    pub fn get_cols(&self) -> usize { self.cols }
+    pub fn get_rows(&self) -> usize { self.rows }
+
+    fn live_line(&mut self, row: usize) -> &mut Vec<Cell> {
+        let ind = self.lines.len() - self.rows + row;
+        &mut self.lines[ind]
+    }
+
+    /// Writing always goes to the live screen, so a scrolled back view jumps back to it
+    fn follow_output(&mut self) {
+        if self.view_offset == 0 { return; }
+        self.view_offset = 0;
+        self.mark_all_dirty();
+    }
+
+    pub fn set(&mut self, col: usize, row: usize, cell: Cell) {
+        if col >= self.cols || row >= self.rows { return; }
+        self.follow_output();
+        self.live_line(row)[col] = cell;
+        self.dirty[row] = true;
+    }
+
+    pub fn clear_row(&mut self, row: usize) {
+        if row >= self.rows { return; }
+        self.follow_output();
+        self.live_line(row).fill(BLANK_CELL);
+        self.dirty[row] = true;
+    }
+
+    pub fn clear(&mut self) {
+        self.follow_output();
+        for row in 0..self.rows { self.live_line(row).fill(BLANK_CELL); }
+        self.mark_all_dirty();
+    }
+
+    /// Moves everything up a line, the top line goes to the scrollback and the bottom one is blank
+    pub fn scroll_up(&mut self) {
+        self.follow_output();
+        if self.lines.len() >= self.max_lines {
+            // Reuse the oldest line instead of allocating a new one
+            let mut line = self.lines.pop_front().expect("Grid should have lines!");
+            line.fill(BLANK_CELL);
+            self.lines.push_back(line);
+        } else {
+            self.lines.push_back(vec![BLANK_CELL; self.cols]);
+        }
+        // NOTE: What's already on screen moves up with the pixels, so the dirty rows move up with it
+        self.dirty.rotate_left(1);
+        self.dirty[self.rows-1] = true;
+        self.pending_scroll += 1;
+    }
+
+    /// Moves the view delta lines back into the scrollback ( or forward for negative delta )
+    pub fn scroll_view(&mut self, delta: isize) {
+        let max_offset = self.lines.len() - self.rows;
+        let new_offset = core::cmp::min(max_offset as isize, core::cmp::max(0, self.view_offset as isize + delta)) as usize;
+        if new_offset == self.view_offset { return; }
+        self.view_offset = new_offset;
+        self.mark_all_dirty();
+    }
+
+    pub fn is_following_output(&self) -> bool { self.view_offset == 0 }
+
+    /// A screen row as it should look right now, scrollback included
+    pub fn get_row(&self, row: usize) -> &[Cell] {
+        &self.lines[self.lines.len() - self.rows - self.view_offset + row]
+    }
+
+    pub fn mark_dirty(&mut self, row: usize) {
+        if row < self.rows { self.dirty[row] = true; }
+    }
+
+    pub fn mark_all_dirty(&mut self) {
+        self.dirty.fill(true);
+        self.pending_scroll = 0; // Everything gets redrawn anyway
+    }
+
+    /// How far the screen scrolled since this was last called
+    pub fn take_pending_scroll(&mut self) -> usize {
+        core::mem::replace(&mut self.pending_scroll, 0)
+    }
+
+    /// Whether the row has to be redrawn, and it's considered drawn afterwards
+    pub fn take_dirty(&mut self, row: usize) -> bool {
+        core::mem::replace(&mut self.dirty[row], false)
+    }
+}
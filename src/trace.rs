@@ -0,0 +1,245 @@
+use core::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+
+use crate::{primitives::read_tsc, smp::{self, MAX_CPUS}, virtmem::KernPointer};
+
+/// Times the rest of the enclosing block as a TracePoint, optionally with how many bytes it moved
+/// trace_span!(AtaRead, count*512);
+macro_rules! trace_span {
+    ($point:ident) => {
+        let _span = $crate::trace::Span::new($crate::trace::TracePoint::$point, 0);
+    };
+    ($point:ident, $bytes:expr) => {
+        let _span = $crate::trace::Span::new($crate::trace::TracePoint::$point, $bytes as usize);
+    };
+}
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+#[repr(u8)]
+pub enum TracePoint {
+    AtaRead,
+    Ext2ReadBlock,
+    Ext2GetInode,
+    PathGetNode,
+    Alloc,
+    Dealloc,
+    WriteChar,
+    WriteStr
+}
+
+pub const TRACE_POINT_COUNT: usize = 8;
+const TRACE_POINTS: [TracePoint; TRACE_POINT_COUNT] = [TracePoint::AtaRead, TracePoint::Ext2ReadBlock, TracePoint::Ext2GetInode, TracePoint::PathGetNode, TracePoint::Alloc, TracePoint::Dealloc, TracePoint::WriteChar, TracePoint::WriteStr];
+
+impl TracePoint {
+    pub fn name(self) -> &'static str {
+        match self {
+            TracePoint::AtaRead => "ATABus::read_sectors",
+            TracePoint::Ext2ReadBlock => "Ext2FS::read_block",
+            TracePoint::Ext2GetInode => "Ext2FS::get_inode",
+            TracePoint::PathGetNode => "Path::get_node",
+            TracePoint::Alloc => "alloc",
+            TracePoint::Dealloc => "dealloc",
+            TracePoint::WriteChar => "CharDevice::write_char",
+            TracePoint::WriteStr => "CharDevice::write_str"
+        }
+    }
+}
+
+// Durations go in power of two buckets, so percentiles are only good to a factor of 2, but it's fixed size and lock free
+const HISTOGRAM_BUCKETS: usize = 40; // Up to 2^40 cycles, anything longer than that has bigger problems
+const TRACE_RING_SIZE: usize = 1024; // Events per cpu, power of two
+
+struct PointCounters {
+    calls: AtomicU64,
+    bytes: AtomicU64,
+    cycles: AtomicU64,
+    histogram: [AtomicU64; HISTOGRAM_BUCKETS]
+}
+
+/// A finished span, packed so it can be written without a lock
+/// NOTE: Someone reading the ring while it's written might see half an event, it's a debugging aid so that's fine
+struct TraceEvent {
+    start: AtomicU64,
+    info: AtomicU64 // point: 8 bits, bytes: 24 bits, cycles: 32 bits
+}
+
+/// Only ever written by it's own cpu, but interrupts on that cpu trace too, hence the atomics
+struct CpuTrace {
+    counters: [PointCounters; TRACE_POINT_COUNT],
+    ring: [TraceEvent; TRACE_RING_SIZE],
+    ring_head: AtomicUsize
+}
+
+const ZERO: AtomicU64 = AtomicU64::new(0);
+const EMPTY_COUNTERS: PointCounters = PointCounters { calls: ZERO, bytes: ZERO, cycles: ZERO, histogram: [ZERO; HISTOGRAM_BUCKETS] };
+const EMPTY_EVENT: TraceEvent = TraceEvent { start: ZERO, info: ZERO };
+const EMPTY_CPU_TRACE: CpuTrace = CpuTrace { counters: [EMPTY_COUNTERS; TRACE_POINT_COUNT], ring: [EMPTY_EVENT; TRACE_RING_SIZE], ring_head: AtomicUsize::new(0) };
+
+static CPU_TRACES: [CpuTrace; MAX_CPUS] = [EMPTY_CPU_TRACE; MAX_CPUS];
+static TRACING: AtomicBool = AtomicBool::new(true);
+static TSC_HZ: AtomicU64 = AtomicU64::new(0);
+
+// PIT channel 2, the one wired to the pc speaker, it's gate and output can be read back through port 0x61 which makes it usable for a one shot delay
+const PIT_HZ: u64 = 1_193_182;
+const PIT_CHANNEL2_PORT: u16 = 0x42;
+const PIT_COMMAND_PORT: u16 = 0x43;
+const SPEAKER_PORT: u16 = 0x61;
+const CALIBRATION_MS: u64 = 10;
+
+/// Measures how fast the tsc goes against the pit
+/// NOTE: Assumes an invariant tsc, which anything qemu emulates and every cpu from the last decade has
+pub fn calibrate_tsc() -> u64 {
+    let count = PIT_HZ*CALIBRATION_MS/1000;
+    let cycles = unsafe {
+        let mut speaker = KernPointer::<u8>::from_port(SPEAKER_PORT);
+        let mut command = KernPointer::<u8>::from_port(PIT_COMMAND_PORT);
+        let mut channel2 = KernPointer::<u8>::from_port(PIT_CHANNEL2_PORT);
+        // Gate on, speaker off
+        let old = speaker.read();
+        speaker.write((old & !0b10) | 0b1);
+        // Channel 2, lobyte/hibyte, mode 0 ( output goes high once the count reaches 0 )
+        command.write(0b10_11_000_0);
+        channel2.write(count as u8);
+        channel2.write((count >> 8) as u8);
+        let start = read_tsc();
+        wait_for!(speaker.read() & 0b10_0000 != 0);
+        let end = read_tsc();
+        speaker.write(old);
+        end - start
+    };
+    let hz = cycles*1000/CALIBRATION_MS;
+    TSC_HZ.store(hz, Ordering::Relaxed);
+    hz
+}
+
+pub fn get_tsc_hz() -> u64 { TSC_HZ.load(Ordering::Relaxed) }
+
+/// 0 if calibrate_tsc hasn't run yet
+pub fn cycles_to_ns(cycles: u64) -> u64 {
+    let hz = get_tsc_hz();
+    if hz == 0 { return 0; }
+    (cycles as u128 * 1_000_000_000 / hz as u128) as u64
+}
+
+/// Time since the cpu was reset, more or less
+pub fn now_ns() -> u64 { cycles_to_ns(read_tsc()) }
+
+pub fn set_enabled(enabled: bool) { TRACING.store(enabled, Ordering::Relaxed); }
+
+pub fn is_enabled() -> bool { TRACING.load(Ordering::Relaxed) }
+
+fn this_cpu_trace() -> &'static CpuTrace {
+    // NOTE: The allocator traces too, and that runs before gs is set up for this cpu
+    &CPU_TRACES[core::cmp::min(smp::cpu_id(), MAX_CPUS-1)]
+}
+
+pub struct Span {
+    point: TracePoint,
+    bytes: usize,
+    start: u64 // 0 when tracing was off
+}
+
+impl Span {
+    #[inline(always)]
+    pub fn new(point: TracePoint, bytes: usize) -> Self {
+        let start = if is_enabled() { read_tsc() } else { 0 };
+        Self { point, bytes, start }
+    }
+}
+
+impl Drop for Span {
+    #[inline(always)]
+    fn drop(&mut self) {
+        if self.start == 0 { return; }
+        record(self.point, self.start, read_tsc() - self.start, self.bytes);
+    }
+}
+
+fn record(point: TracePoint, start: u64, cycles: u64, bytes: usize) {
+    let cpu = this_cpu_trace();
+    let counters = &cpu.counters[point as usize];
+    counters.calls.fetch_add(1, Ordering::Relaxed);
+    counters.bytes.fetch_add(bytes as u64, Ordering::Relaxed);
+    counters.cycles.fetch_add(cycles, Ordering::Relaxed);
+    let bucket = core::cmp::min((u64::BITS - cycles.leading_zeros()) as usize, HISTOGRAM_BUCKETS-1);
+    counters.histogram[bucket].fetch_add(1, Ordering::Relaxed);
+
+    let event = &cpu.ring[cpu.ring_head.fetch_add(1, Ordering::Relaxed) % TRACE_RING_SIZE];
+    event.start.store(start, Ordering::Relaxed);
+    let info = (point as u64) << 56 | (core::cmp::min(bytes, 0xFF_FFFF) as u64) << 32 | core::cmp::min(cycles, u32::MAX as u64);
+    event.info.store(info, Ordering::Relaxed);
+}
+
+#[derive(Debug, Default, Clone, Copy)]
+pub struct PointStats {
+    pub calls: u64,
+    pub bytes: u64,
+    pub cycles: u64,
+    pub p50_cycles: u64, // Upper bound of the bucket the percentile falls in
+    pub p99_cycles: u64
+}
+
+/// Counters for point added up over every cpu
+pub fn get_point_stats(point: TracePoint) -> PointStats {
+    let mut stats = PointStats::default();
+    let mut histogram = [0u64; HISTOGRAM_BUCKETS];
+    for cpu in CPU_TRACES.iter() {
+        let counters = &cpu.counters[point as usize];
+        stats.calls += counters.calls.load(Ordering::Relaxed);
+        stats.bytes += counters.bytes.load(Ordering::Relaxed);
+        stats.cycles += counters.cycles.load(Ordering::Relaxed);
+        for (total, bucket) in histogram.iter_mut().zip(counters.histogram.iter()) { *total += bucket.load(Ordering::Relaxed); }
+    }
+    let calls = stats.calls;
+    let percentile = |p: u64| {
+        let target = (calls*p + 99)/100;
+        let mut seen = 0;
+        for (bucket, count) in histogram.iter().enumerate() {
+            seen += count;
+            if seen >= target && *count != 0 { return (1u64 << bucket) - 1; }
+        }
+        0
+    };
+    stats.p50_cycles = percentile(50);
+    stats.p99_cycles = percentile(99);
+    stats
+}
+
+pub fn get_all_point_stats() -> [(TracePoint, PointStats); TRACE_POINT_COUNT] {
+    TRACE_POINTS.map(|point| (point, get_point_stats(point)))
+}
+
+/// Zeroes all the counters and forgets the trace rings
+/// NOTE: Spans that are running right now still get counted afterwards
+pub fn reset() {
+    for cpu in CPU_TRACES.iter() {
+        for counters in cpu.counters.iter() {
+            counters.calls.store(0, Ordering::Relaxed);
+            counters.bytes.store(0, Ordering::Relaxed);
+            counters.cycles.store(0, Ordering::Relaxed);
+            counters.histogram.iter().for_each(|bucket| bucket.store(0, Ordering::Relaxed));
+        }
+        cpu.ring.iter().for_each(|event| event.info.store(0, Ordering::Relaxed));
+        cpu.ring_head.store(0, Ordering::Relaxed);
+    }
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct TraceRecord {
+    pub point: TracePoint,
+    pub start: u64,
+    pub cycles: u64,
+    pub bytes: usize
+}
+
+/// Calls f with cpu's last `TRACE_RING_SIZE` events, oldest first
+pub fn for_each_event(cpu: usize, mut f: impl FnMut(TraceRecord)) {
+    let trace = if let Some(trace) = CPU_TRACES.get(cpu) { trace } else { return; };
+    let head = trace.ring_head.load(Ordering::Relaxed);
+    for pos in head.saturating_sub(TRACE_RING_SIZE)..head {
+        let event = &trace.ring[pos % TRACE_RING_SIZE];
+        let info = event.info.load(Ordering::Relaxed);
+        let point = if let Some(point) = TRACE_POINTS.get((info >> 56) as usize) { *point } else { continue; };
+        if info == 0 && point == TracePoint::AtaRead { continue; } // Reset, never written
+        f(TraceRecord { point, start: event.start.load(Ordering::Relaxed), cycles: info & 0xFFFF_FFFF, bytes: ((info >> 32) & 0xFF_FFFF) as usize });
+    }
+}
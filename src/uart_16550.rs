@@ -1,7 +1,8 @@
 use core::fmt::Write;
 use core::fmt::Debug;
+use core::sync::atomic::{AtomicU8, Ordering};
 
-use crate::{virtmem::KernPointer, X86Default};
+use crate::{virtmem::KernPointer, X86Default, ring_buffer::SpscRing, interrupts::{self, InterruptStackFrame}, executor::{IrqWaker, RingFuture}};
 use packed_struct::prelude::*;
 
 
@@ -172,9 +173,13 @@ impl UARTDevice {
                 .unwrap()[0],
             );
 
-            // We don't enable interrupts for now because we don't use them for now
-            // self.int_en.write(InterruptEnableRegister{data_available_interrupt: true, ..InterruptEnableRegister::default()}.pack().unwrap()[0]);
+            // NOTE: Only does anything once COM1_IRQ is unmasked, received bytes then go through com1_irq_handler
+            self.int_en.write(InterruptEnableRegister{data_available_interrupt: true, ..InterruptEnableRegister::default()}.pack().unwrap()[0]);
         }
+        // FIXME: Assumes this is COM1, same as receive
+        // Anything logged before this just sat in the ring
+        LOG_DRAIN_MODE.store(LOG_DRAIN_POLL, Ordering::Release);
+        kick_log_drain();
     }
     fn line_sts(&self) -> LineStatusFlags { unsafe { LineStatusFlags::unpack(&[self.line_status.read()]).unwrap() } }
 
@@ -185,12 +190,100 @@ impl UARTDevice {
         }
     }
 
+    /// Once the holding register is empty so is the whole tx fifo, so that's one wait per FIFO_SIZE bytes instead of one per byte
+    /// NOTE: Still spins instead of awaiting, the THR empty irq is the log drain's and write_str can't await anyway
+    fn send_bytes(&mut self, bytes: impl Iterator<Item = u8>) {
+        let mut in_fifo = FIFO_SIZE;
+        for b in bytes {
+            if in_fifo == FIFO_SIZE {
+                wait_for!(self.line_sts().output_empty);
+                in_fifo = 0;
+            }
+            unsafe{ self.data.write(b); }
+            in_fifo += 1;
+        }
+    }
+
+    /// Sleeps until com1_irq_handler has a byte
+    /// FIXME: Assumes this is COM1, which it always is for now
     pub fn receive(&self) -> u8 {
-        unsafe {
-            wait_for!(self.line_sts().input_full);
-            self.data.read()
+        interrupts::wait_until(|| COM1_RECEIVED.pop())
+    }
+
+    /// Same as receive, but lets other tasks run while waiting
+    pub fn receive_async(&self) -> RingFuture<'static, u8, 256> {
+        RingFuture::new(&COM1_RECEIVED, &COM1_WAKER)
+    }
+}
+
+const COM1_PORT: u16 = 0x3f8;
+const FIFO_SIZE: usize = 16;
+static COM1_RECEIVED: SpscRing<u8, 256> = SpscRing::new(0);
+static COM1_WAKER: IrqWaker = IrqWaker::new();
+
+// How the log ring gets to COM1
+const LOG_DRAIN_NONE: u8 = 0; // UART isn't set up yet, lines just wait in the ring
+const LOG_DRAIN_POLL: u8 = 1; // Whoever logs sends it right away, spinning on the line status
+const LOG_DRAIN_IRQ: u8 = 2; // The THR empty irq sends it a fifo at a time
+static LOG_DRAIN_MODE: AtomicU8 = AtomicU8::new(LOG_DRAIN_NONE);
+
+// NOTE: The log goes through the ports directly and not through UART, so logging never takes a lock
+unsafe fn com1_port(offset: u16) -> KernPointer<u8> { KernPointer::<u8>::from_port(COM1_PORT+offset) }
+
+unsafe fn com1_output_empty() -> bool {
+    LineStatusFlags::unpack(&[com1_port(5).read()]).unwrap().output_empty
+}
+
+unsafe fn set_com1_tx_irq(enabled: bool) {
+    com1_port(1).write(InterruptEnableRegister{data_available_interrupt: true, transmitter_holding_register_empty_interrupt: enabled, ..InterruptEnableRegister::default()}.pack().unwrap()[0]);
+}
+
+/// Called after something is added to the log ring
+pub fn kick_log_drain() {
+    match LOG_DRAIN_MODE.load(Ordering::Acquire) {
+        LOG_DRAIN_POLL => flush_log_blocking(),
+        // If the holding register is already empty this fires right away
+        LOG_DRAIN_IRQ => unsafe { set_com1_tx_irq(true) },
+        _ => ()
+    }
+}
+
+/// Sends everything in the log ring right now, for before the irq is up, panics and shutdown
+pub fn flush_log_blocking() {
+    if LOG_DRAIN_MODE.load(Ordering::Acquire) == LOG_DRAIN_NONE { return; }
+    unsafe {
+        loop {
+            wait_for!(com1_output_empty());
+            if !crate::log::drain(FIFO_SIZE, |b| com1_port(0).write(b)) { break; }
+        }
+    }
+}
+
+/// Call once com1_irq_handler is installed and COM1_IRQ is unmasked
+pub fn enable_log_irq_drain() {
+    LOG_DRAIN_MODE.store(LOG_DRAIN_IRQ, Ordering::Release);
+    kick_log_drain();
+}
+
+pub extern "x86-interrupt" fn com1_irq_handler(_frame: InterruptStackFrame) {
+    // NOTE: Can't lock UART here, the code we interrupted might be holding it, so the ports are used directly
+    unsafe {
+        let mut data = com1_port(0);
+        // Drain the fifo, the irq only fires again once it's empty
+        while LineStatusFlags::unpack(&[com1_port(5).read()]).unwrap().input_full {
+            COM1_RECEIVED.push(data.read());
+        }
+        if LOG_DRAIN_MODE.load(Ordering::Acquire) == LOG_DRAIN_IRQ && com1_output_empty() {
+            // Refill the whole tx fifo
+            if !crate::log::drain(FIFO_SIZE, |b| data.write(b)) {
+                set_com1_tx_irq(false);
+                // Something might have been logged between the drain and turning the irq off, then nobody would turn it back on
+                if crate::log::has_pending() { set_com1_tx_irq(true); }
+            }
         }
     }
+    COM1_WAKER.wake();
+    interrupts::end_of_interrupt(interrupts::COM1_IRQ);
 }
 
 impl Debug for UARTDevice{
@@ -201,16 +294,12 @@ impl Debug for UARTDevice{
 
 impl Write for UARTDevice{
     fn write_str(&mut self, s: &str) -> core::fmt::Result {
-        s.chars().for_each(|c|{
-            self.send(c as u8);
-            if c == '\n' {
-                self.send(b'\r')
-            }
-        });
+        // '\n' goes out as "\r\n"
+        self.send_bytes(s.bytes().flat_map(|b| [(b == b'\n').then_some(b'\r'), Some(b)]).flatten());
         Ok(())
     }
 }
 
 impl X86Default for UARTDevice {
-    unsafe fn x86_default() -> Self { Self::new(KernPointer::<u8>::from_port(0x3f8)) }
+    unsafe fn x86_default() -> Self { Self::new(KernPointer::<u8>::from_port(COM1_PORT)) }
 }
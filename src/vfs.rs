@@ -1,20 +1,76 @@
 use core::{convert::TryFrom, ops::Deref, cell::RefCell, fmt::{Display, Debug}, borrow::Borrow};
 
-use alloc::{string::String, vec::Vec, rc::Rc, borrow::ToOwned};
+use alloc::{string::String, vec::Vec, rc::Rc, borrow::ToOwned, vec};
 
-use crate::primitives::{Mutex, LazyInitialised};
+use crate::{primitives::{Mutex, LazyInitialised}, dcache, arena::{Arena, ArenaVec, ArenaString}};
 
 pub static VFS_ROOT: Mutex<LazyInitialised<Rc<RefCell<VFSNode>>>> = Mutex::from(LazyInitialised::uninit());
 
 
 pub trait IFolder {
     fn get_children(&self) -> Vec<(String, Node)>;
+
+    /// Names, kinds and file sizes of the children in an arena, for listing a folder without looking every child up again
+    /// NOTE: Sizes are only there for files
+    fn get_listing_in<'a>(&self, arena: &'a Arena) -> ArenaVec<'a, (ArenaString<'a>, NodeKind, Option<usize>)> {
+        let mut v = Vec::new_in(arena);
+        v.extend(self.get_children().into_iter().map(|(name, node)| {
+            let size = if let Node::File(f) = &node { Some((**f).borrow().get_size()) } else { None };
+            (ArenaString::from_str_in(&name, arena), node.kind(), size)
+        }));
+        v
+    }
+
+    /// Finds one child by name, folders that can do this without building every child should override it
+    fn lookup(&self, name: &str) -> Option<Node> {
+        self.get_children().into_iter().find(|(child_name, _)| child_name == name).map(|(_, node)| node)
+    }
+
+    /// Makes a new empty file, None if the folder can't do that or something with that name already exists
+    fn create_file(&mut self, _name: &str) -> Option<Node> { None }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum IOError{
+    OutOfBounds, // Offset is past the end of the file
+    DeviceError, // Backing device couldn't complete the request
+    Unsupported, // File can't do that (yet)
+    NoSpace // Ran out of space on the backing device
 }
 
 pub trait IFile {
-    fn read(&self, offset: usize, len: usize) -> Option<Vec<u8>>;
-    fn write(&mut self, offset: usize, data: &[u8]);
+    /// Reads up to buf.len() bytes starting at offset directly into buf, returns how many bytes were actually read
+    /// NOTE: Less than buf.len() bytes are only read if the end of the file is reached
+    fn read_into(&self, offset: usize, buf: &mut [u8]) -> Result<usize, IOError>;
+    /// Writes data starting at offset, returns how many bytes were actually written
+    fn write_from(&mut self, offset: usize, data: &[u8]) -> Result<usize, IOError>;
     fn get_size(&self) -> usize;
+
+    /// Hint that [offset, offset+len) is going to be read soon, files that can't do anything useful with that just ignore it
+    fn prefetch(&self, _offset: usize, _len: usize) {}
+
+    /// Identifies what the file's contents are, so two IFiles for the same data ( two nodes for one ext2 inode, say ) can share cached pages
+    /// None means the file can only be told apart by it's address
+    fn get_id(&self) -> Option<(usize, usize)> { None }
+
+    /// Convenience wrapper around read_into for when a fresh buffer is needed anyway
+    fn read(&self, offset: usize, len: usize) -> Option<Vec<u8>> {
+        let mut res = vec![0; len];
+        let read = self.read_into(offset, &mut res).ok()?;
+        res.truncate(read);
+        Some(res)
+    }
+
+    fn write(&mut self, offset: usize, data: &[u8]) {
+        let _ = self.write_from(offset, data);
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum NodeKind{
+    File,
+    Folder,
+    Unknown // The folder doesn't know without looking at the child itself
 }
 
 #[derive(Clone)]
@@ -24,6 +80,13 @@ pub enum Node{
 }
 
 impl Node{
+    pub fn kind(&self) -> NodeKind{
+        match self{
+            Node::File(_) => NodeKind::File,
+            Node::Folder(_) => NodeKind::Folder
+        }
+    }
+
     pub fn expect_folder(self) -> Rc<RefCell<dyn IFolder>>{
         match self{
             Node::Folder(f) => f,
@@ -62,60 +125,50 @@ impl Path{
         }
     }
 
-    pub fn add_last(&mut self, node: &str){
-        if !self.inner.ends_with("/"){
-            self.inner.push('/');
-        }
-        self.inner.push_str(node);
-    }
-
     pub fn append(&mut self, subnode: &str){
         if !self.inner.ends_with("/"){ self.inner.push('/'); }
         self.inner.push_str(subnode);
     }
 
+    /// rel relative to this path, or just rel if it's already absolute
+    pub fn join_in<'a>(&self, rel: &str, arena: &'a Arena) -> ArenaString<'a> {
+        if rel.starts_with("/") { return ArenaString::from_str_in(rel, arena); }
+        let mut res = ArenaString::from_str_in(&self.inner, arena);
+        if !res.ends_with("/"){ res.push('/'); }
+        res.push_str(rel);
+        res
+    }
+
     pub fn get_node(&self) -> Option<Node> {
-       let mut cur_node: Node = Node::Folder((**VFS_ROOT.lock()).clone() as Rc<RefCell<dyn IFolder>>);
-       let mut cur_path: Path = Path::root();
-       let mut nodes = self.inner.split('/');
-       'tree_traversal_loop: while cur_path != *self {
-            let to_find = nodes.next();
-            if to_find == Some("") { continue; }
-            let to_find = if let Some(val) = to_find { val } else { break; }.trim();
-
-            let children = (*cur_node.clone().expect_folder()).borrow().get_children();
-            for (name, node) in children{
-                if name == to_find {
-                    cur_node = node;
-                    cur_path.append(to_find);
-                    continue 'tree_traversal_loop;
-                }
-            }
-            return None;
-       }
-       
-       Some(cur_node)
+        trace_span!(PathGetNode);
+        lookup_path(&self.inner)
     }
 
     pub fn get_vfs_node(&self) -> Option<Rc<RefCell<VFSNode>>>{
-        let mut to_search: Vec<Rc<RefCell<VFSNode>>> = Vec::new();
-        to_search.push(VFS_ROOT.lock().clone());
-        let mut cur_path = Path::root();
-        while to_search.len() != 0 {
-            if let Some(cur) = to_search.pop(){
-                cur_path.add_last(&(*cur).borrow().path.last());
-                if cur_path == *self{
-                    return Some(cur);
-                }else{
-                    for c in &(*cur).borrow().children{
-                        to_search.push(c.clone());
-                    }
-                    cur_path.del_last();
-                }
-            }
-        }
-        None
+        lookup_vfs_path(&self.inner)
+    }
+}
+
+/// Walks an absolute path, going into whatever is mounted
+pub fn lookup_path(path: &str) -> Option<Node> {
+   let mut cur_node: Node = Node::Folder((**VFS_ROOT.lock()).clone() as Rc<RefCell<dyn IFolder>>);
+   for to_find in path.split('/'){
+        let to_find = to_find.trim();
+        if to_find == "" { continue; }
+        let cur_folder = if let Node::Folder(f) = cur_node { f } else { return None; };
+        cur_node = dcache::lookup(&cur_folder, to_find)?;
+   }
+   Some(cur_node)
+}
+
+/// Walks an absolute path through the vfs folders only, mounted filesystems are ignored
+pub fn lookup_vfs_path(path: &str) -> Option<Rc<RefCell<VFSNode>>>{
+    let mut cur = VFS_ROOT.lock().clone();
+    for to_find in path.split('/'){
+        if to_find == "" { continue; }
+        cur = VFSNode::find_folder(cur, to_find)?;
     }
+    Some(cur)
 }
 
 impl Display for Path{
@@ -182,6 +235,7 @@ impl VFSNode{
             mountpoint: None,
         }));
         (*slf).borrow_mut().children.push(new_f.clone());
+        dcache::invalidate();
         new_f
     }
 
@@ -196,6 +250,7 @@ impl VFSNode{
         }
         if let Some(i) = di {
             (*slf).borrow_mut().children.remove(i);
+            dcache::invalidate();
             true
         }else{
             false
@@ -211,6 +266,11 @@ impl VFSNode{
         None
     }
 
+    pub fn set_mountpoint(&mut self, mnt: Option<Rc<RefCell<dyn IFolder>>>){
+        self.mountpoint = mnt;
+        dcache::invalidate();
+    }
+
     pub fn get_parent(&self) -> Option<&RefCell<VFSNode>>{
         self.parent.as_deref()
     }
@@ -224,18 +284,52 @@ impl IFolder for VFSNode{
     fn get_children(&self) -> Vec<(String, Node)>{
         let mut v = Vec::<(String, Node)>::new();
         if let Some(mnt) = &self.mountpoint{
-            for c in (**mnt).borrow().get_children(){
-                v.push((c.0, c.1.clone()));
-            }
+            v = (**mnt).borrow().get_children();
         }
 
+        // Name resolution, whatever is mounted here shadows our own children
+        let mut mounted_names: Vec<&str> = v.iter().map(|(name, _)| name.as_str()).collect();
+        mounted_names.sort_unstable();
+        let mut own_children = Vec::new();
         for c in &self.children {
-            // Name resolution
-            if v.iter().any(|(child_name, _)| *child_name == (**c).borrow().path.last()) {
-                continue;
-            }
-            v.push(( c.as_ref().borrow().path.last().to_owned(), Node::Folder(c.clone() as Rc<RefCell<dyn IFolder>>)));
+            let name = (**c).borrow().path.last().to_owned();
+            if mounted_names.binary_search(&name.as_str()).is_ok() { continue; }
+            own_children.push((name, Node::Folder(c.clone() as Rc<RefCell<dyn IFolder>>)));
         }
+        v.append(&mut own_children);
         v
     }
-}
\ No newline at end of file
+
+    fn get_listing_in<'a>(&self, arena: &'a Arena) -> ArenaVec<'a, (ArenaString<'a>, NodeKind, Option<usize>)>{
+        let mut v = Vec::new_in(arena);
+        if let Some(mnt) = &self.mountpoint{
+            v = (**mnt).borrow().get_listing_in(arena);
+        }
+
+        // Same shadowing as get_children
+        let mut mounted_names: ArenaVec<&str> = Vec::with_capacity_in(v.len(), arena);
+        mounted_names.extend(v.iter().map(|(name, _, _)| name.as_str()));
+        mounted_names.sort_unstable();
+        let mut own_children = Vec::new_in(arena);
+        for c in &self.children {
+            let c = (**c).borrow();
+            let name = c.path.last();
+            if mounted_names.binary_search(&name).is_ok() { continue; }
+            own_children.push((ArenaString::from_str_in(name, arena), NodeKind::Folder, None));
+        }
+        drop(mounted_names);
+        v.append(&mut own_children);
+        v
+    }
+
+    fn lookup(&self, name: &str) -> Option<Node>{
+        if let Some(mnt) = &self.mountpoint{
+            if let Some(node) = (**mnt).borrow().lookup(name) { return Some(node); }
+        }
+        self.children.iter().find(|c| (***c).borrow().path.last() == name).map(|c| Node::Folder(c.clone() as Rc<RefCell<dyn IFolder>>))
+    }
+
+    fn create_file(&mut self, name: &str) -> Option<Node>{
+        (**self.mountpoint.as_ref()?).borrow_mut().create_file(name)
+    }
+}
@@ -1,4 +1,4 @@
-use core::marker::PhantomData;
+use core::{marker::PhantomData, cell::UnsafeCell};
 
 use crate::{X86Default, virtmem::KernPointer};
 
@@ -176,6 +176,58 @@ const COLOR_320X200: VgaModeDump = VgaModeDump{
 };
 
 pub const FANCY_PALETTE: [(u8, u8, u8); 256] = [(0x0, 0x0, 0x0), (0x0, 0x0, 0xc), (0x0, 0x0, 0x18), (0x0, 0x0, 0x24), (0x0, 0x0, 0x30), (0x0, 0x0, 0x3c), (0x0, 0xa, 0x0), (0x0, 0xa, 0xc), (0x0, 0xa, 0x18), (0x0, 0xa, 0x24), (0x0, 0xa, 0x30), (0x0, 0xa, 0x3c), (0x0, 0x14, 0x0), (0x0, 0x14, 0xc), (0x0, 0x14, 0x18), (0x0, 0x14, 0x24), (0x0, 0x14, 0x30), (0x0, 0x14, 0x3c), (0x0, 0x1e, 0x0), (0x0, 0x1e, 0xc), (0x0, 0x1e, 0x18), (0x0, 0x1e, 0x24), (0x0, 0x1e, 0x30), (0x0, 0x1e, 0x3c), (0x0, 0x28, 0x0), (0x0, 0x28, 0xc), (0x0, 0x28, 0x18), (0x0, 0x28, 0x24), (0x0, 0x28, 0x30), (0x0, 0x28, 0x3c), (0x0, 0x32, 0x0), (0x0, 0x32, 0xc), (0x0, 0x32, 0x18), (0x0, 0x32, 0x24), (0x0, 0x32, 0x30), (0x0, 0x32, 0x3c), (0x0, 0x3c, 0x0), (0x0, 0x3c, 0xc), (0x0, 0x3c, 0x18), (0x0, 0x3c, 0x24), (0x0, 0x3c, 0x30), (0x0, 0x3c, 0x3c), (0xc, 0x0, 0x0), (0xc, 0x0, 0xc), (0xc, 0x0, 0x18), (0xc, 0x0, 0x24), (0xc, 0x0, 0x30), (0xc, 0x0, 0x3c), (0xc, 0xa, 0x0), (0xc, 0xa, 0xc), (0xc, 0xa, 0x18), (0xc, 0xa, 0x24), (0xc, 0xa, 0x30), (0xc, 0xa, 0x3c), (0xc, 0x14, 0x0), (0xc, 0x14, 0xc), (0xc, 0x14, 0x18), (0xc, 0x14, 0x24), (0xc, 0x14, 0x30), (0xc, 0x14, 0x3c), (0xc, 0x1e, 0x0), (0xc, 0x1e, 0xc), (0xc, 0x1e, 0x18), (0xc, 0x1e, 0x24), (0xc, 0x1e, 0x30), (0xc, 0x1e, 0x3c), (0xc, 0x28, 0x0), (0xc, 0x28, 0xc), (0xc, 0x28, 0x18), (0xc, 0x28, 0x24), (0xc, 0x28, 0x30), (0xc, 0x28, 0x3c), (0xc, 0x32, 0x0), (0xc, 0x32, 0xc), (0xc, 0x32, 0x18), (0xc, 0x32, 0x24), (0xc, 0x32, 0x30), (0xc, 0x32, 0x3c), (0xc, 0x3c, 0x0), (0xc, 0x3c, 0xc), (0xc, 0x3c, 0x18), (0xc, 0x3c, 0x24), (0xc, 0x3c, 0x30), (0xc, 0x3c, 0x3c), (0x18, 0x0, 0x0), (0x18, 0x0, 0xc), (0x18, 0x0, 0x18), (0x18, 0x0, 0x24), (0x18, 0x0, 0x30), (0x18, 0x0, 0x3c), (0x18, 0xa, 0x0), (0x18, 0xa, 0xc), (0x18, 0xa, 0x18), (0x18, 0xa, 0x24), (0x18, 0xa, 0x30), (0x18, 0xa, 0x3c), (0x18, 0x14, 0x0), (0x18, 0x14, 0xc), (0x18, 0x14, 0x18), (0x18, 0x14, 0x24), (0x18, 0x14, 0x30), (0x18, 0x14, 0x3c), (0x18, 0x1e, 0x0), (0x18, 0x1e, 0xc), (0x18, 0x1e, 0x18), (0x18, 0x1e, 0x24), (0x18, 0x1e, 0x30), (0x18, 0x1e, 0x3c), (0x18, 0x28, 0x0), (0x18, 0x28, 0xc), (0x18, 0x28, 0x18), (0x18, 0x28, 0x24), (0x18, 0x28, 0x30), (0x18, 0x28, 0x3c), (0x18, 0x32, 0x0), (0x18, 0x32, 0xc), (0x18, 0x32, 0x18), (0x18, 0x32, 0x24), (0x18, 0x32, 0x30), (0x18, 0x32, 0x3c), (0x18, 0x3c, 0x0), (0x18, 0x3c, 0xc), (0x18, 0x3c, 0x18), (0x18, 0x3c, 0x24), (0x18, 0x3c, 0x30), (0x18, 0x3c, 0x3c), (0x24, 0x0, 0x0), (0x24, 0x0, 0xc), (0x24, 0x0, 0x18), (0x24, 0x0, 0x24), (0x24, 0x0, 0x30), (0x24, 0x0, 0x3c), (0x24, 0xa, 0x0), (0x24, 0xa, 0xc), (0x24, 0xa, 0x18), (0x24, 0xa, 0x24), (0x24, 0xa, 0x30), (0x24, 0xa, 0x3c), (0x24, 0x14, 0x0), (0x24, 0x14, 0xc), (0x24, 0x14, 0x18), (0x24, 0x14, 0x24), (0x24, 0x14, 0x30), (0x24, 0x14, 0x3c), (0x24, 0x1e, 0x0), (0x24, 0x1e, 0xc), (0x24, 0x1e, 0x18), (0x24, 0x1e, 0x24), (0x24, 0x1e, 0x30), (0x24, 0x1e, 0x3c), (0x24, 0x28, 0x0), (0x24, 0x28, 0xc), (0x24, 0x28, 0x18), (0x24, 0x28, 0x24), (0x24, 0x28, 0x30), (0x24, 0x28, 0x3c), (0x24, 0x32, 0x0), (0x24, 0x32, 0xc), (0x24, 0x32, 0x18), (0x24, 0x32, 0x24), (0x24, 0x32, 0x30), (0x24, 0x32, 0x3c), (0x24, 0x3c, 0x0), (0x24, 0x3c, 0xc), (0x24, 0x3c, 0x18), (0x24, 0x3c, 0x24), (0x24, 0x3c, 0x30), (0x24, 0x3c, 0x3c), (0x30, 0x0, 0x0), (0x30, 0x0, 0xc), (0x30, 0x0, 0x18), (0x30, 0x0, 0x24), (0x30, 0x0, 0x30), (0x30, 0x0, 0x3c), (0x30, 0xa, 0x0), (0x30, 0xa, 0xc), (0x30, 0xa, 0x18), (0x30, 0xa, 0x24), (0x30, 0xa, 0x30), (0x30, 0xa, 0x3c), (0x30, 0x14, 0x0), (0x30, 0x14, 0xc), (0x30, 0x14, 0x18), (0x30, 0x14, 0x24), (0x30, 0x14, 0x30), (0x30, 0x14, 0x3c), (0x30, 0x1e, 0x0), (0x30, 0x1e, 0xc), (0x30, 0x1e, 0x18), (0x30, 0x1e, 0x24), (0x30, 0x1e, 0x30), (0x30, 0x1e, 0x3c), (0x30, 0x28, 0x0), (0x30, 0x28, 0xc), (0x30, 0x28, 0x18), (0x30, 0x28, 0x24), (0x30, 0x28, 0x30), (0x30, 0x28, 0x3c), (0x30, 0x32, 0x0), (0x30, 0x32, 0xc), (0x30, 0x32, 0x18), (0x30, 0x32, 0x24), (0x30, 0x32, 0x30), (0x30, 0x32, 0x3c), (0x30, 0x3c, 0x0), (0x30, 0x3c, 0xc), (0x30, 0x3c, 0x18), (0x30, 0x3c, 0x24), (0x30, 0x3c, 0x30), (0x30, 0x3c, 0x3c), (0x3c, 0x0, 0x0), (0x3c, 0x0, 0xc), (0x3c, 0x0, 0x18), (0x3c, 0x0, 0x24), (0x3c, 0x0, 0x30), (0x3c, 0x0, 0x3c), (0x3c, 0xa, 0x0), (0x3c, 0xa, 0xc), (0x3c, 0xa, 0x18), (0x3c, 0xa, 0x24), (0x3c, 0xa, 0x30), (0x3c, 0xa, 0x3c), (0x3c, 0x14, 0x0), (0x3c, 0x14, 0xc), (0x3c, 0x14, 0x18), (0x3c, 0x14, 0x24), (0x3c, 0x14, 0x30), (0x3c, 0x14, 0x3c), (0x3c, 0x1e, 0x0), (0x3c, 0x1e, 0xc), (0x3c, 0x1e, 0x18), (0x3c, 0x1e, 0x24), (0x3c, 0x1e, 0x30), (0x3c, 0x1e, 0x3c), (0x3c, 0x28, 0x0), (0x3c, 0x28, 0xc), (0x3c, 0x28, 0x18), (0x3c, 0x28, 0x24), (0x3c, 0x28, 0x30), (0x3c, 0x28, 0x3c), (0x3c, 0x32, 0x0), (0x3c, 0x32, 0xc), (0x3c, 0x32, 0x18), (0x3c, 0x32, 0x24), (0x3c, 0x32, 0x30), (0x3c, 0x32, 0x3c), (0x3c, 0x3c, 0x0), (0x3c, 0x3c, 0xc), (0x3c, 0x3c, 0x18), (0x3c, 0x3c, 0x24), (0x3c, 0x3c, 0x30), (0x3c, 0x3c, 0x3c), (0x3f, 0x3f, 0x3f), (0x3f, 0x0, 0x0), (0x0, 0x3f, 0x0), (0x0, 0x0, 0x3f)];
+// RGB quantised to 5 bits per channel -> closest palette index, so drawing doesn't have to search the whole palette for every pixel
+// NOTE: Built when switching to Color256 and not at compile time, 32k cells * 256 colors makes const eval take minutes
+pub const PALETTE_LUT_BITS: usize = 5;
+const PALETTE_LUT_SIZE: usize = 1 << (3*PALETTE_LUT_BITS);
+pub static PALETTE_LUT: PaletteLut = PaletteLut(UnsafeCell::new([0; PALETTE_LUT_SIZE]));
+
+pub struct PaletteLut(UnsafeCell<[u8; PALETTE_LUT_SIZE]>);
+
+// Only written by build(), which happens before anything draws
+unsafe impl Sync for PaletteLut {}
+
+impl PaletteLut {
+    /// Every cell gets the color closest to it's center
+    /// NOTE: Nothing can be using the lut while this runs
+    pub unsafe fn build(&self, palette: &[(u8, u8, u8); 256]) {
+        let lut = &mut *self.0.get();
+        let shift = 8 - PALETTE_LUT_BITS;
+        let half = 1 << (shift - 1);
+        let mask = (1 << PALETTE_LUT_BITS) - 1;
+        for (i, cell) in lut.iter_mut().enumerate() {
+            let r = ((i >> (2*PALETTE_LUT_BITS)) << shift | half) as u8;
+            let g = (((i >> PALETTE_LUT_BITS) & mask) << shift | half) as u8;
+            let b = ((i & mask) << shift | half) as u8;
+            *cell = closest_palette_index(palette, r, g, b);
+        }
+    }
+
+    #[inline(always)]
+    pub fn lookup(&self, r: u8, g: u8, b: u8) -> u8 {
+        let shift = 8 - PALETTE_LUT_BITS;
+        let i = ((r as usize >> shift) << (2*PALETTE_LUT_BITS)) | ((g as usize >> shift) << PALETTE_LUT_BITS) | (b as usize >> shift);
+        unsafe { (*self.0.get())[i] }
+    }
+}
+
+/// Closest palette entry to an 8 bit per channel color, palette entries are 6 bit dac values
+pub const fn closest_palette_index(palette: &[(u8, u8, u8); 256], r: u8, g: u8, b: u8) -> u8 {
+    let mut best_ind = 0;
+    let mut best_err = i32::MAX;
+    let mut i = 0;
+    while i < palette.len() {
+        let (dr, dg, db) = (palette[i].0 as i32*4 - r as i32, palette[i].1 as i32*4 - g as i32, palette[i].2 as i32*4 - b as i32);
+        let err = dr*dr + dg*dg + db*db;
+        if err < best_err {
+            best_ind = i;
+            best_err = err;
+        }
+        i += 1;
+    }
+    best_ind as u8
+}
+
 pub const DEFAULT_PALETTE: [(u8, u8, u8); 256] = [
     (0x0, 0x0, 0x0), (0x0, 0x0, 0x2A), (0x0, 0x2A, 0x0), (0x0, 0x2A, 0x2A), (0x2A, 0x0, 0x0), 
     (0x2A, 0x0, 0x2A), (0x2A, 0x2A, 0x0), (0x2A, 0x2A, 0x2A), (0x0, 0x0, 0x15), (0x0, 0x0, 0x3F), (0x0, 0x2A, 0x15),
@@ -600,6 +652,7 @@ impl<T: VgaMode + 'static> Vga<T, Blanked>{
             if core::any::TypeId::of::<U>() == core::any::TypeId::of::<Color256>(){
                 self.load_mode_dump(&COLOR_320X200);
                 self.dac.write_bulk( 0, &FANCY_PALETTE); // Reset pallette
+                PALETTE_LUT.build(&FANCY_PALETTE);
                 self.video_ram = KernPointer::<u8>::from_mem(0xa0000 as *mut u8);
                 return self.typestate_transmute::<U>();
             }
@@ -702,5 +755,11 @@ impl<STATE: MixedRegisterState> Vga<Color256, STATE>{
             let vram: KernPointer::<u8> = core::mem::transmute(self.video_ram);
             vram.offset((y*320+x) as isize).write(pixel_color);
     }
+
+    #[inline(always)]
+    pub unsafe fn read(&self, x: usize, y: usize) -> u8{
+            let vram: KernPointer::<u8> = core::mem::transmute(self.video_ram);
+            vram.offset((y*320+x) as isize).read()
+    }
 }
 
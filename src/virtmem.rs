@@ -1,4 +1,6 @@
-use core::{marker::PhantomData, ops::Add, arch::asm, mem};
+use core::{marker::PhantomData, ops::Add, arch::asm, mem, ops::BitOr};
+
+use crate::{primitives::{Mutex, LazyInitialised}, frame_alloc::FRAME_ALLOCATOR};
 
 pub trait AddressSpace {}
 
@@ -48,6 +50,19 @@ unsafe fn port_inh(addr: u16) -> u16 {
 }
 
 
+#[inline(always)]
+unsafe fn port_outd(addr: u16, val: u32) {
+    asm!("out dx, eax", in("eax") val, in("dx") addr, options(nostack, nomem));
+}
+
+#[inline(always)]
+unsafe fn port_ind(addr: u16) -> u32 {
+    let mut res: u32;
+    asm!("in eax, dx", out("eax") res, in("dx") addr, options(nostack, nomem));
+    return res;
+}
+
+
 impl<A: AddressSpace, T> Pointer<A, T>{
     pub unsafe fn offset(&self, o: isize) -> Self {
         /// FIXME: Does offsetting a port "address" work the same way as offestting a real memory addres?
@@ -132,4 +147,334 @@ impl<A: AddressSpace> Pointer<A, u16> {
             *self.inner
         }
     }
-}
\ No newline at end of file
+}
+impl<A: AddressSpace> Pointer<A, u32> {
+    // SAFTEY: Constructors assume address is in correct space
+    pub unsafe fn from_mem(a: *mut u32) -> Self {
+        Self {
+            inner: a,
+            space: PhantomData,
+            is_port: false,
+        }
+    }
+    pub unsafe fn from_port(p: u16) -> Self {
+        Self {
+            inner: p as *mut u32,
+            space: PhantomData,
+            is_port: true,
+        }
+    }
+
+    #[inline(always)]
+    pub unsafe fn write(&mut self, val: u32) {
+        if self.is_port {
+            port_outd(self.inner as u16, val);
+        } else {
+            core::ptr::write_volatile(self.inner, val);
+        }
+    }
+
+    #[inline(always)]
+    pub unsafe fn read(&self) -> u32 {
+        if self.is_port {
+            port_ind(self.inner as u16)
+        } else {
+            *self.inner
+        }
+    }
+}
+
+
+// Page tables
+// Source: AMD64 programmer's manual vol. 2, section 5.3 ( long mode page translation )
+pub const PAGE_SIZE: usize = 4096;
+pub const HUGE_PAGE_SIZE: usize = 2*1024*1024;
+const ENTRIES_PER_TABLE: usize = 512;
+const ADDRESS_MASK: u64 = 0x000F_FFFF_FFFF_F000;
+const HUGE_ADDRESS_MASK: u64 = 0x000F_FFFF_FFE0_0000;
+const HUGE_PAT_BIT: u64 = 1 << 12; // In a 2 mb entry the pat bit moves here, because bit 7 is the page size bit
+// NOTE: Past this many pages invlpg-ing each one costs more than reloading cr3 and eating the tlb misses
+const FULL_FLUSH_THRESHOLD: usize = 32;
+
+// PAT entry 4 ( PAT bit set, PCD and PWT clear ) is switched from write back to write combining by init_pat(), the other 7 stay the default
+const IA32_PAT_MSR: u32 = 0x277;
+const PAT_VALUE: u64 = 0x0007040100070406;
+pub const WRITE_COMBINING: PageFlags = PageFlags::PAT;
+
+/// Every cpu has to call this, mappings using WRITE_COMBINING mean different things on cpus with different pats
+/// Returns false if the cpu has no pat, WRITE_COMBINING pages are then just write back
+pub unsafe fn init_pat() -> bool {
+    if core::arch::x86_64::__cpuid(1).edx & (1 << 16) == 0 { return false; }
+    asm!("wrmsr", in("ecx") IA32_PAT_MSR, in("eax") PAT_VALUE as u32, in("edx") (PAT_VALUE >> 32) as u32, options(nostack));
+    true
+}
+
+pub static KERNEL_PAGE_TABLES: Mutex<LazyInitialised<PageMapper<KernelSpace>>> = Mutex::from(LazyInitialised::uninit());
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct PageFlags(pub u64);
+
+impl PageFlags {
+    pub const PRESENT: Self = Self(1 << 0);
+    pub const WRITABLE: Self = Self(1 << 1);
+    pub const USER: Self = Self(1 << 2);
+    pub const PAT: Self = Self(1 << 7); // For 4 kb pages, map_page moves it to the right place for 2 mb ones
+    pub const GLOBAL: Self = Self(1 << 8); // Survives cr3 reloads, so only for things that are mapped the same everywhere
+    const HUGE: Self = Self(1 << 7);
+
+    pub const fn contains(self, other: Self) -> bool { self.0 & other.0 == other.0 }
+}
+
+impl BitOr for PageFlags {
+    type Output = Self;
+    fn bitor(self, rhs: Self) -> Self { Self(self.0 | rhs.0) }
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum PageSize {
+    Small, // 4 kb, mapped by a level 1 entry
+    Huge   // 2 mb, mapped by a level 2 entry
+}
+
+impl PageSize {
+    pub const fn bytes(self) -> usize {
+        match self {
+            PageSize::Small => PAGE_SIZE,
+            PageSize::Huge => HUGE_PAGE_SIZE
+        }
+    }
+}
+
+#[repr(C, align(4096))]
+struct PageTable {
+    entries: [u64; ENTRIES_PER_TABLE]
+}
+
+fn table_index(virt: usize, level: usize) -> usize {
+    (virt >> (12 + 9*(level-1))) & (ENTRIES_PER_TABLE-1)
+}
+
+/// Collects the pages whose mappings changed, so the tlb can be flushed once when done instead of after every change
+#[must_use = "The tlb still has the old mappings until flush() is called"]
+pub struct TlbFlush {
+    pages: [usize; FULL_FLUSH_THRESHOLD],
+    page_count: usize,
+    full: bool, // Too many pages, just flush everything
+    global: bool // A global page changed, which a cr3 reload doesn't flush
+}
+
+impl TlbFlush {
+    pub fn new() -> Self {
+        Self { pages: [0; FULL_FLUSH_THRESHOLD], page_count: 0, full: false, global: false }
+    }
+
+    fn add(&mut self, virt: usize, entry: u64) {
+        if entry & PageFlags::GLOBAL.0 != 0 { self.global = true; }
+        if self.page_count == FULL_FLUSH_THRESHOLD { self.full = true; return; }
+        self.pages[self.page_count] = virt;
+        self.page_count += 1;
+    }
+
+    pub fn flush(self) {
+        unsafe {
+            if !self.full {
+                // NOTE: invlpg on any address in a 2 mb page flushes the whole page
+                for virt in &self.pages[..self.page_count] {
+                    asm!("invlpg [{}]", in(reg) *virt, options(nostack));
+                }
+            } else if self.global {
+                // Toggling CR4.PGE flushes everything, global pages included
+                let mut cr4: usize;
+                asm!("mov {}, cr4", out(reg) cr4, options(nomem, nostack));
+                asm!("mov cr4, {}", in(reg) cr4 & !(1 << 7), options(nostack));
+                asm!("mov cr4, {}", in(reg) cr4, options(nostack));
+            } else {
+                let cr3: usize;
+                asm!("mov {}, cr3", out(reg) cr3, options(nomem, nostack));
+                asm!("mov cr3, {}", in(reg) cr3, options(nostack));
+            }
+        }
+    }
+}
+
+/// Edits the 4 level page tables of an address space
+/// NOTE: The tables are accessed through their physical address, which works because everything under 4 gb is identity mapped
+/// and the frame allocator only hands out frames under 4 gb
+pub struct PageMapper<A: AddressSpace> {
+    pml4: *mut PageTable,
+    space: PhantomData<A>
+}
+
+impl<A: AddressSpace> core::fmt::Debug for PageMapper<A> {
+    fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
+        f.debug_struct("PageMapper").field("pml4", &self.pml4).finish()
+    }
+}
+
+impl<A: AddressSpace> PageMapper<A> {
+    /// SAFETY: cr3 has to point to the tables of this address space
+    /// NOTE: Under uefi these are the firmware's tables, as the asm init doesn't load it's own ( see the FIXME there )
+    pub unsafe fn from_cr3() -> Self {
+        let cr3: u64;
+        asm!("mov {}, cr3", out(reg) cr3, options(nomem, nostack));
+        Self { pml4: (cr3 & ADDRESS_MASK) as *mut PageTable, space: PhantomData }
+    }
+
+    fn alloc_table() -> Option<*mut PageTable> {
+        let table = FRAME_ALLOCATOR.lock().alloc_frames(1)? as *mut PageTable;
+        unsafe { core::ptr::write_bytes(table, 0, 1); }
+        Some(table)
+    }
+
+    /// Turns a 2 mb entry into a table of 512 4 kb entries mapping the same memory, so part of it can be changed
+    unsafe fn split_huge(entry: &mut u64) -> Option<()> {
+        let table = Self::alloc_table()?;
+        let base = *entry & HUGE_ADDRESS_MASK;
+        let mut flags = *entry & !ADDRESS_MASK & !PageFlags::HUGE.0;
+        if *entry & HUGE_PAT_BIT != 0 { flags |= PageFlags::PAT.0; }
+        for (i, e) in (*table).entries.iter_mut().enumerate() {
+            *e = (base + (i*PAGE_SIZE) as u64) | flags;
+        }
+        // NOTE: The new table is as permissive as the old page, the 4 kb entries decide what is actually allowed
+        *entry = table as u64 | (*entry & (PageFlags::PRESENT.0 | PageFlags::WRITABLE.0 | PageFlags::USER.0));
+        Some(())
+    }
+
+    /// Returns the entry that maps virt with a page of the given size
+    /// If create is set missing tables are made, and a 2 mb page in the way of a 4 kb one is split
+    unsafe fn get_entry(&mut self, virt: usize, size: PageSize, create: bool, flush: &mut TlbFlush) -> Option<&mut u64> {
+        let leaf_level = if size == PageSize::Small { 1 } else { 2 };
+        let mut table = self.pml4;
+        for level in (leaf_level+1..=4).rev() {
+            let entry = &mut (*table).entries[table_index(virt, level)];
+            if *entry & PageFlags::PRESENT.0 == 0 {
+                if !create { return None; }
+                *entry = Self::alloc_table()? as u64 | PageFlags::PRESENT.0 | PageFlags::WRITABLE.0 | PageFlags::USER.0;
+            } else if *entry & PageFlags::HUGE.0 != 0 {
+                // FIXME: 1 gb pages aren't supported, those have to be split too
+                if level != 2 || !create { return None; }
+                flush.add(virt, *entry);
+                Self::split_huge(entry)?;
+            }
+            table = (*entry & ADDRESS_MASK) as *mut PageTable;
+        }
+        Some(&mut (*table).entries[table_index(virt, leaf_level)])
+    }
+
+    /// Maps one page, None if something is already mapped there or there's no memory for the tables
+    pub unsafe fn map_page(&mut self, virt: usize, phys: usize, size: PageSize, flags: PageFlags, flush: &mut TlbFlush) -> Option<()> {
+        if virt % size.bytes() != 0 || phys % size.bytes() != 0 { return None; }
+        let entry = self.get_entry(virt, size, true, flush)?;
+        if *entry & PageFlags::PRESENT.0 != 0 { return None; }
+        *entry = phys as u64 | Self::leaf_flags(flags, size);
+        // NOTE: Non-present entries can't be in the tlb, so there's nothing to flush
+        Some(())
+    }
+
+    /// Unmaps one page, returns the physical address it was mapped to
+    pub unsafe fn unmap_page(&mut self, virt: usize, size: PageSize, flush: &mut TlbFlush) -> Option<usize> {
+        let entry = self.get_entry(virt, size, false, flush)?;
+        if !Self::is_leaf(*entry, size) { return None; }
+        let old = *entry;
+        *entry = 0;
+        flush.add(virt, old);
+        Some((old & if size == PageSize::Small { ADDRESS_MASK } else { HUGE_ADDRESS_MASK }) as usize)
+    }
+
+    /// Changes the flags of an already mapped page
+    pub unsafe fn protect_page(&mut self, virt: usize, size: PageSize, flags: PageFlags, flush: &mut TlbFlush) -> Option<()> {
+        let entry = self.get_entry(virt, size, size == PageSize::Small, flush)?;
+        if !Self::is_leaf(*entry, size) { return None; }
+        let mask = if size == PageSize::Small { ADDRESS_MASK } else { HUGE_ADDRESS_MASK };
+        let old = *entry;
+        *entry = (old & mask) | Self::leaf_flags(flags, size);
+        flush.add(virt, old);
+        Some(())
+    }
+
+    /// A present level 2 entry can still be a table instead of a 2 mb page
+    fn is_leaf(entry: u64, size: PageSize) -> bool {
+        entry & PageFlags::PRESENT.0 != 0 && (size == PageSize::Small || entry & PageFlags::HUGE.0 != 0)
+    }
+
+    fn leaf_flags(flags: PageFlags, size: PageSize) -> u64 {
+        let mut res = (flags | PageFlags::PRESENT).0;
+        if size == PageSize::Huge {
+            res |= PageFlags::HUGE.0;
+            if flags.contains(PageFlags::PAT) { res |= HUGE_PAT_BIT; }
+        }
+        res
+    }
+
+    /// Changes the flags of every page in [virt, virt+len), 2 mb pages the range fully covers stay 2 mb pages, only the ones at the unaligned ends get split
+    pub unsafe fn protect_range(&mut self, virt: usize, len: usize, flags: PageFlags, flush: &mut TlbFlush) -> Option<()> {
+        let end = virt + len;
+        let mut pos = virt & !(PAGE_SIZE-1);
+        while pos < end {
+            // NOTE: If the chunk is already made of 4 kb pages protect_page with Huge fails and this just falls through to doing them one by one
+            if pos % HUGE_PAGE_SIZE == 0 && end - pos >= HUGE_PAGE_SIZE && self.protect_page(pos, PageSize::Huge, flags, flush).is_some() {
+                pos += HUGE_PAGE_SIZE;
+                continue;
+            }
+            self.protect_page(pos, PageSize::Small, flags, flush)?;
+            pos += PAGE_SIZE;
+        }
+        Some(())
+    }
+
+    /// Maps [virt, virt+len) to [phys, phys+len), using 2 mb pages wherever both sides are aligned enough
+    /// NOTE: On failure whatever was mapped before the failing page stays mapped
+    pub unsafe fn map_range(&mut self, virt: usize, phys: usize, len: usize, flags: PageFlags, flush: &mut TlbFlush) -> Option<()> {
+        let mut done = 0;
+        while done < len {
+            let (v, p) = (virt + done, phys + done);
+            let size = if v % HUGE_PAGE_SIZE == 0 && p % HUGE_PAGE_SIZE == 0 && len - done >= HUGE_PAGE_SIZE { PageSize::Huge } else { PageSize::Small };
+            self.map_page(v, p, size, flags, flush)?;
+            done += size.bytes();
+        }
+        Some(())
+    }
+
+    /// Unmaps [virt, virt+len), whole 2 mb aligned chunks made of 4 kb pages get their table dropped instead of clearing 512 entries
+    pub unsafe fn unmap_range(&mut self, virt: usize, len: usize, flush: &mut TlbFlush) {
+        let mut done = 0;
+        while done < len {
+            let v = virt + done;
+            if v % HUGE_PAGE_SIZE == 0 && len - done >= HUGE_PAGE_SIZE {
+                if let Some(entry) = self.get_entry(v, PageSize::Huge, false, flush) {
+                    let old = *entry;
+                    if old & PageFlags::PRESENT.0 != 0 {
+                        *entry = 0;
+                        if old & PageFlags::HUGE.0 == 0 {
+                            FRAME_ALLOCATOR.lock().free_frames((old & ADDRESS_MASK) as usize, 1);
+                            // NOTE: invlpg also drops cached paging structure entries for the address, so this takes care of the old table too
+                            for page in (v..v+HUGE_PAGE_SIZE).step_by(PAGE_SIZE) { flush.add(page, old); }
+                        } else {
+                            flush.add(v, old);
+                        }
+                    }
+                }
+                done += HUGE_PAGE_SIZE;
+            } else {
+                self.unmap_page(v, PageSize::Small, flush);
+                done += PAGE_SIZE;
+            }
+        }
+    }
+
+    /// Walks the tables to find out where virt actually goes
+    pub fn translate(&self, virt: usize) -> Option<usize> {
+        let mut table = self.pml4;
+        for level in (1..=4).rev() {
+            let entry = unsafe { (*table).entries[table_index(virt, level)] };
+            if entry & PageFlags::PRESENT.0 == 0 { return None; }
+            if level == 1 || entry & PageFlags::HUGE.0 != 0 {
+                let page_size = 1usize << (12 + 9*(level-1));
+                let mask = if level == 1 { ADDRESS_MASK } else { ADDRESS_MASK & !(page_size as u64 - 1) };
+                return Some((entry & mask) as usize + virt % page_size);
+            }
+            table = (entry & ADDRESS_MASK) as *mut PageTable;
+        }
+        None
+    }
+}